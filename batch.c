@@ -0,0 +1,342 @@
+/*
+ *  batch.c
+ *  Contains the batch runner, every job gets its own APEX_CPU and the jobs
+ *  are spread over a work-stealing pool of threads
+ */
+#define _GNU_SOURCE
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "batch.h"
+#include "cpu.h"
+
+/* Per-worker double ended queue of job indices */
+typedef struct Job_Deque
+{
+  pthread_mutex_t lock;
+  int* items;
+  int head;		// Thieves take from here
+  int tail;		// Owner takes from here
+} Job_Deque;
+
+typedef struct Batch_Pool
+{
+  APEX_Job* jobs;
+  Job_Deque* deques;
+  int num_workers;
+} Batch_Pool;
+
+typedef struct Batch_Worker
+{
+  Batch_Pool* pool;
+  int id;
+  pthread_t thread;
+} Batch_Worker;
+
+static double
+now_seconds()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+parse_mode(const char* name)
+{
+  if (strcmp(name, "simulate") == 0) {
+    return MODE_SIMULATE;
+  }
+  if (strcmp(name, "display") == 0) {
+    return MODE_DISPLAY;
+  }
+  if (strcmp(name, "quiet") == 0) {
+    return MODE_NONE;
+  }
+  return -1;
+}
+
+static const char*
+mode_name(int mode)
+{
+  switch (mode) {
+    case MODE_SIMULATE:
+      return "simulate";
+    case MODE_DISPLAY:
+      return "display";
+    default:
+      return "quiet";
+  }
+}
+
+/*
+ * Reads a batch file, one job per line:
+ *
+ *   <program> <cycles> [simulate|display|quiet]
+ *
+ * Blank lines and lines starting with '#' are skipped, a file without
+ * any job is an error.
+ */
+APEX_Job*
+APEX_batch_load(const char* filename, int* num_jobs)
+{
+  FILE* fp = fopen(filename, "r");
+  if (!fp) {
+    fprintf(stderr, "APEX_Error : Unable to open batch file %s\n", filename);
+    return NULL;
+  }
+
+  APEX_Job* jobs = NULL;
+  int count = 0;
+  int capacity = 0;
+  char* line = NULL;
+  size_t len = 0;
+  int line_num = 0;
+  int ok = 1;
+
+  while (getline(&line, &len, fp) != -1) {
+    line_num++;
+    char* program = strtok(line, " \t\r\n");
+    if (!program || program[0] == '#') {
+      continue;
+    }
+    char* cycles = strtok(NULL, " \t\r\n");
+    char* mode = strtok(NULL, " \t\r\n");
+    int mode_id = mode ? parse_mode(mode) : MODE_SIMULATE;
+    char* end = NULL;
+    long max_cycles = cycles ? strtol(cycles, &end, 10) : 0;
+    if (!cycles || *end != '\0' || max_cycles < 0 || max_cycles > INT_MAX || mode_id < 0) {
+      fprintf(stderr, "APEX_Error : %s:%d: expected <program> <cycles> [simulate|display|quiet]\n",
+              filename, line_num);
+      ok = 0;
+      break;
+    }
+
+    if (count == capacity) {
+      int grown = capacity ? capacity * 2 : 64;
+      APEX_Job* more = realloc(jobs, sizeof(*jobs) * grown);
+      if (!more) {
+        fprintf(stderr, "APEX_Error : Unable to allocate %d jobs\n", grown);
+        ok = 0;
+        break;
+      }
+      jobs = more;
+      capacity = grown;
+    }
+    APEX_Job* job = &jobs[count++];
+    memset(job, 0, sizeof(*job));
+    job->program = strdup(program);
+    job->max_cycles = max_cycles;
+    job->mode = mode_id;
+    if (!job->program) {
+      fprintf(stderr, "APEX_Error : Unable to allocate job %s\n", program);
+      ok = 0;
+      break;
+    }
+  }
+
+  free(line);
+  fclose(fp);
+  if (!ok) {
+    APEX_batch_free(jobs, count);
+    return NULL;
+  }
+  if (count == 0) {
+    fprintf(stderr, "APEX_Error : %s contains no jobs\n", filename);
+    return NULL;
+  }
+  *num_jobs = count;
+  return jobs;
+}
+
+static void
+run_job(APEX_Job* job)
+{
+  double start = now_seconds();
+  FILE* out = open_memstream(&job->output, &job->output_size);
+
+  APEX_CPU* cpu = APEX_cpu_init(job->program);
+  job->status = cpu ? 0 : -1;
+  if (!cpu) {
+    fprintf(out, "APEX_Error : Unable to initialize CPU\n");
+  }
+
+  for (int i = 0; i < job->num_settings && job->status == 0; ++i) {
+    if (APEX_config_parse(cpu, job->settings[i]) != 0) {
+      fprintf(out, "APEX_Error : Bad setting %s\n", job->settings[i]);
+      job->status = -1;
+    }
+  }
+  if (job->status == 0) {
+    cpu->mode = job->mode;
+    cpu->max_cycles = job->max_cycles;
+    cpu->out = out;
+    APEX_cpu_run(cpu);
+    job->cycles = cpu->clock;
+    job->ins_completed = cpu->ins_completed;
+    memcpy(job->stall_cycles, cpu->counters.stage_cycles[WB], sizeof(job->stall_cycles));
+    job->status = cpu->trapped ? -1 : 0;
+  }
+  if (cpu) {
+    APEX_cpu_stop(cpu);
+  }
+
+  fclose(out);
+  job->seconds = now_seconds() - start;
+}
+
+/* Owner end of the deque, LIFO */
+static int
+deque_pop(Job_Deque* dq)
+{
+  int index = -1;
+  pthread_mutex_lock(&dq->lock);
+  if (dq->tail > dq->head) {
+    index = dq->items[--dq->tail];
+  }
+  pthread_mutex_unlock(&dq->lock);
+  return index;
+}
+
+/* Thief end of the deque, FIFO */
+static int
+deque_steal(Job_Deque* dq)
+{
+  int index = -1;
+  pthread_mutex_lock(&dq->lock);
+  if (dq->tail > dq->head) {
+    index = dq->items[dq->head++];
+  }
+  pthread_mutex_unlock(&dq->lock);
+  return index;
+}
+
+static void*
+worker_main(void* arg)
+{
+  Batch_Worker* worker = arg;
+  Batch_Pool* pool = worker->pool;
+
+  while (1) {
+    int index = deque_pop(&pool->deques[worker->id]);
+
+    /* Own queue drained, try to steal from the others */
+    for (int i = 1; index < 0 && i < pool->num_workers; ++i) {
+      index = deque_steal(&pool->deques[(worker->id + i) % pool->num_workers]);
+    }
+
+    /* Jobs are never added once the pool starts, so all queues are empty */
+    if (index < 0) {
+      break;
+    }
+    run_job(&pool->jobs[index]);
+  }
+  return NULL;
+}
+
+/*
+ * Runs all jobs on num_threads workers. Jobs are dealt round-robin to the
+ * workers up front, idle workers steal from the others.
+ *
+ * Returns the wall time taken, in seconds
+ */
+double
+APEX_batch_run(APEX_Job* jobs, int num_jobs, int num_threads)
+{
+  double start = now_seconds();
+
+  if (num_threads < 1) {
+    num_threads = 1;
+  }
+  if (num_threads > num_jobs) {
+    num_threads = num_jobs > 0 ? num_jobs : 1;
+  }
+
+  Batch_Pool pool;
+  pool.jobs = jobs;
+  pool.num_workers = num_threads;
+  pool.deques = calloc(num_threads, sizeof(*pool.deques));
+  Batch_Worker* workers = calloc(num_threads, sizeof(*workers));
+
+  for (int w = 0; w < num_threads; ++w) {
+    pthread_mutex_init(&pool.deques[w].lock, NULL);
+    pool.deques[w].items = malloc(sizeof(int) * (num_jobs / num_threads + 1));
+  }
+  for (int i = 0; i < num_jobs; ++i) {
+    Job_Deque* dq = &pool.deques[i % num_threads];
+    dq->items[dq->tail++] = i;
+  }
+
+  for (int w = 0; w < num_threads; ++w) {
+    workers[w].pool = &pool;
+    workers[w].id = w;
+    pthread_create(&workers[w].thread, NULL, worker_main, &workers[w]);
+  }
+  for (int w = 0; w < num_threads; ++w) {
+    pthread_join(workers[w].thread, NULL);
+  }
+
+  for (int w = 0; w < num_threads; ++w) {
+    pthread_mutex_destroy(&pool.deques[w].lock);
+    free(pool.deques[w].items);
+  }
+  free(pool.deques);
+  free(workers);
+  return now_seconds() - start;
+}
+
+/*
+ * Prints the captured output of every job in batch file order, followed
+ * by a per-job summary table and the totals
+ */
+void
+APEX_batch_report(FILE* fp, const APEX_Job* jobs, int num_jobs, double seconds)
+{
+  long long total_cycles = 0;
+  long long total_ins = 0;
+  int failed = 0;
+
+  for (int i = 0; i < num_jobs; ++i) {
+    fprintf(fp, "=============== JOB %d : %s ===============\n", i, jobs[i].program);
+    if (jobs[i].output_size) {
+      fwrite(jobs[i].output, 1, jobs[i].output_size, fp);
+      fprintf(fp, "\n");
+    }
+  }
+
+  fprintf(fp, "\n=============== BATCH SUMMARY ===============\n");
+  fprintf(fp, "| %5s | %-30s | %-8s | %-6s | %10s | %10s | %6s | %10s |\n",
+          "Job", "Program", "Mode", "Status", "Cycles", "Retired", "IPC", "Time(ms)");
+  for (int i = 0; i < num_jobs; ++i) {
+    const APEX_Job* job = &jobs[i];
+    double ipc = job->cycles ? (double)job->ins_completed / job->cycles : 0.0;
+    fprintf(fp, "| %5d | %-30s | %-8s | %-6s | %10d | %10d | %6.3f | %10.3f |\n",
+            i, job->program, mode_name(job->mode), job->status ? "FAILED" : "OK",
+            job->cycles, job->ins_completed, ipc, job->seconds * 1e3);
+    total_cycles += job->cycles;
+    total_ins += job->ins_completed;
+    failed += job->status != 0;
+  }
+
+  fprintf(fp, "\nJobs             : %d (%d failed)\n", num_jobs, failed);
+  fprintf(fp, "Cycles simulated : %lld\n", total_cycles);
+  fprintf(fp, "Retired          : %lld\n", total_ins);
+  fprintf(fp, "Wall time        : %.3f s\n", seconds);
+  if (seconds > 0) {
+    fprintf(fp, "Throughput       : %.0f cycles/s\n", total_cycles / seconds);
+  }
+}
+
+void
+APEX_batch_free(APEX_Job* jobs, int num_jobs)
+{
+  for (int i = 0; i < num_jobs; ++i) {
+    free(jobs[i].program);
+    free(jobs[i].output);
+  }
+  free(jobs);
+}
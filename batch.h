@@ -0,0 +1,44 @@
+#ifndef _APEX_BATCH_H_
+#define _APEX_BATCH_H_
+/**
+ *  batch.h
+ *  Runs a list of APEX programs inside a single process, spread over a
+ *  pool of worker threads
+ */
+#include <stdio.h>
+
+#include "cpu.h"
+
+/* One simulation job, a line of the batch file */
+typedef struct APEX_Job
+{
+  char* program;	// Input file to simulate
+  int max_cycles;	// Stop after this many cycles
+  int mode;		// One of MODE_NONE, MODE_SIMULATE, MODE_DISPLAY
+  char* const* settings;	// key=value settings applied first, not owned
+  int num_settings;
+
+  /* Results, filled in by the worker which ran the job */
+  int status;		// 0 on success, -1 if the CPU could not be created or
+			// configured, or trapped
+  int cycles;		// Clock cycles simulated
+  int ins_completed;	// Instructions retired
+  long stall_cycles[NUM_STALLS];	// Writeback cycles by cause, the CPI stack
+  double seconds;	// Host time spent on the job
+  char* output;		// Everything the CPU printed
+  size_t output_size;
+} APEX_Job;
+
+APEX_Job*
+APEX_batch_load(const char* filename, int* num_jobs);
+
+double
+APEX_batch_run(APEX_Job* jobs, int num_jobs, int num_threads);
+
+void
+APEX_batch_report(FILE* fp, const APEX_Job* jobs, int num_jobs, double seconds);
+
+void
+APEX_batch_free(APEX_Job* jobs, int num_jobs);
+
+#endif
@@ -0,0 +1,147 @@
+/*
+ *  bpred.c
+ *  Contains the branch prediction unit: BTB lookup at fetch, training
+ *  when a branch resolves
+ */
+#include <string.h>
+
+#include "bpred.h"
+
+const char* const bpred_names[NUM_BPREDS] = {
+  [BP_NONE] = "none",
+  [BP_STATIC] = "static",
+  [BP_BIMODAL] = "bimodal",
+  [BP_GSHARE] = "gshare",
+  [BP_TOURNAMENT] = "tournament",
+};
+
+static inline unsigned
+btb_index(const APEX_BranchPredictor* bp, int pc)
+{
+  return ((unsigned)pc >> 2) & (bp->btb_entries - 1);
+}
+
+static inline unsigned
+bimodal_index(const APEX_BranchPredictor* bp, int pc)
+{
+  return ((unsigned)pc >> 2) & ((1u << bp->bht_bits) - 1);
+}
+
+static inline unsigned
+gshare_index(const APEX_BranchPredictor* bp, int pc)
+{
+  return (((unsigned)pc >> 2) ^ bp->history) & ((1u << bp->bht_bits) - 1);
+}
+
+static inline void
+train(uint8_t* counter, int taken)
+{
+  if (taken && *counter < 3) {
+    (*counter)++;
+  } else if (!taken && *counter > 0) {
+    (*counter)--;
+  }
+}
+
+/*
+ * Forgets everything learnt, keeps the configuration and clears the stats
+ */
+void
+APEX_bpred_reset(APEX_BranchPredictor* bp)
+{
+  bp->history = 0;
+  memset(bp->btb, 0, sizeof(bp->btb));
+
+  /* Weakly taken, a branch only hits in the BTB once it has been taken */
+  memset(bp->bimodal, 2, sizeof(bp->bimodal));
+  memset(bp->gshare, 2, sizeof(bp->gshare));
+  memset(bp->chooser, 2, sizeof(bp->chooser));
+
+  bp->branches = 0;
+  bp->mispredicts = 0;
+  bp->btb_misses = 0;
+}
+
+/*
+ * Returns the pc fetch should continue from after the instruction at pc
+ */
+int
+APEX_bpred_predict(const APEX_BranchPredictor* bp, int pc)
+{
+  if (bp->type == BP_NONE) {
+    return pc + 4;
+  }
+
+  const APEX_BTBEntry* entry = &bp->btb[btb_index(bp, pc)];
+  if (!entry->valid || entry->pc != pc) {
+    return pc + 4;
+  }
+
+  int taken;
+  switch (bp->type) {
+    case BP_STATIC:
+      taken = entry->target <= pc;
+      break;
+
+    case BP_BIMODAL:
+      taken = bp->bimodal[bimodal_index(bp, pc)] >= 2;
+      break;
+
+    case BP_GSHARE:
+      taken = bp->gshare[gshare_index(bp, pc)] >= 2;
+      break;
+
+    default:
+      if (bp->chooser[bimodal_index(bp, pc)] >= 2) {
+        taken = bp->gshare[gshare_index(bp, pc)] >= 2;
+      } else {
+        taken = bp->bimodal[bimodal_index(bp, pc)] >= 2;
+      }
+      break;
+  }
+
+  return taken || entry->unconditional ? entry->target : pc + 4;
+}
+
+/*
+ * Trains the predictor with the outcome of the branch at pc, called once
+ * per branch when it resolves
+ */
+void
+APEX_bpred_update(APEX_BranchPredictor* bp, int pc, int unconditional,
+                  int taken, int target, int mispredicted)
+{
+  bp->branches++;
+  bp->mispredicts += mispredicted != 0;
+
+  if (bp->type == BP_NONE) {
+    return;
+  }
+
+  APEX_BTBEntry* entry = &bp->btb[btb_index(bp, pc)];
+  if (taken) {
+    if (!entry->valid || entry->pc != pc) {
+      bp->btb_misses++;
+    }
+    entry->valid = 1;
+    entry->pc = pc;
+    entry->target = target;
+    entry->unconditional = unconditional;
+  }
+
+  if (unconditional) {
+    return;
+  }
+
+  uint8_t* bimodal = &bp->bimodal[bimodal_index(bp, pc)];
+  uint8_t* gshare = &bp->gshare[gshare_index(bp, pc)];
+  int bimodal_ok = (*bimodal >= 2) == taken;
+  int gshare_ok = (*gshare >= 2) == taken;
+
+  if (bimodal_ok != gshare_ok) {
+    train(&bp->chooser[bimodal_index(bp, pc)], gshare_ok);
+  }
+  train(bimodal, taken);
+  train(gshare, taken);
+  bp->history = (bp->history << 1) | (taken != 0);
+}
@@ -0,0 +1,66 @@
+#ifndef _APEX_BPRED_H_
+#define _APEX_BPRED_H_
+/**
+ *  bpred.h
+ *  Branch prediction unit consulted by fetch: a direct mapped branch
+ *  target buffer plus one of several direction predictors. All state is
+ *  kept in fixed size arrays so that it lives inside APEX_CPU and is
+ *  carried by checkpoints.
+ */
+#include <stdint.h>
+
+/* Direction predictors, selected with --set bpred=<name> */
+enum
+{
+  BP_NONE,		// Always fall through, branches resolve as before
+  BP_STATIC,		// Backward taken, forward not taken
+  BP_BIMODAL,		// 2-bit counters indexed by pc
+  BP_GSHARE,		// 2-bit counters indexed by pc xor global history
+  BP_TOURNAMENT,	// Bimodal and gshare with a 2-bit chooser per pc
+  NUM_BPREDS
+};
+
+#define BTB_MAX_ENTRIES 1024
+#define BHT_MAX_BITS 12
+
+typedef struct APEX_BTBEntry
+{
+  int pc;		// Address of the branch
+  int target;		// Target last time it was taken
+  int8_t valid;
+  int8_t unconditional;	// JUMP, always predicted taken on a hit
+} APEX_BTBEntry;
+
+typedef struct APEX_BranchPredictor
+{
+  /* Configuration */
+  int type;		// One of BP_*
+  int btb_entries;	// Power of 2, at most BTB_MAX_ENTRIES
+  int bht_bits;		// log2 of the counter tables, also the history length
+
+  /* State */
+  unsigned history;	// Global outcome history, newest in bit 0
+  APEX_BTBEntry btb[BTB_MAX_ENTRIES];
+  uint8_t bimodal[1 << BHT_MAX_BITS];
+  uint8_t gshare[1 << BHT_MAX_BITS];
+  uint8_t chooser[1 << BHT_MAX_BITS];	// >= 2 selects gshare
+
+  /* Stats */
+  long branches;	// Branches resolved
+  long mispredicts;	// Of which fetch went down the wrong path
+  long btb_misses;	// Taken branches without a BTB entry
+} APEX_BranchPredictor;
+
+extern const char* const bpred_names[NUM_BPREDS];
+
+void
+APEX_bpred_reset(APEX_BranchPredictor* bp);
+
+int
+APEX_bpred_predict(const APEX_BranchPredictor* bp, int pc);
+
+void
+APEX_bpred_update(APEX_BranchPredictor* bp, int pc, int unconditional,
+                  int taken, int target, int mispredicted);
+
+#endif
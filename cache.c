@@ -0,0 +1,188 @@
+/*
+ *  cache.c
+ *  Contains the L1 cache model used for both the I-cache and the
+ *  D-cache: set lookup, replacement and the latency of every access
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "cache.h"
+
+const char* const cache_repl_names[NUM_REPLS] = {
+  [REPL_LRU] = "lru",
+  [REPL_PLRU] = "plru",
+  [REPL_RANDOM] = "random",
+};
+
+static inline int
+log2_of(int v)
+{
+  int n = 0;
+  while ((1 << n) < v) {
+    n++;
+  }
+  return n;
+}
+
+/* Points the tree bits of set away from way */
+static void
+plru_touch(APEX_Cache* c, int set, int way)
+{
+  int levels = log2_of(c->assoc);
+  int node = 1;
+  for (int l = levels - 1; l >= 0; --l) {
+    int right = (way >> l) & 1;
+    if (right) {
+      c->plru[set] &= ~(1u << node);
+    } else {
+      c->plru[set] |= 1u << node;
+    }
+    node = node * 2 + right;
+  }
+}
+
+/* Follows the tree bits of set to the way they point at */
+static int
+plru_victim(const APEX_Cache* c, int set)
+{
+  int levels = log2_of(c->assoc);
+  int node = 1;
+  int way = 0;
+  for (int l = 0; l < levels; ++l) {
+    int right = (c->plru[set] >> node) & 1;
+    way = way * 2 + right;
+    node = node * 2 + right;
+  }
+  return way;
+}
+
+static int
+choose_victim(APEX_Cache* c, int set)
+{
+  APEX_CacheLine* ways = &c->lines[set * c->assoc];
+  for (int w = 0; w < c->assoc; ++w) {
+    if (!ways[w].valid) {
+      return w;
+    }
+  }
+
+  switch (c->replacement) {
+    case REPL_PLRU:
+      return plru_victim(c, set);
+
+    case REPL_RANDOM:
+      c->random ^= c->random << 13;
+      c->random ^= c->random >> 17;
+      c->random ^= c->random << 5;
+      return c->random % c->assoc;
+
+    default: {
+      int victim = 0;
+      for (int w = 1; w < c->assoc; ++w) {
+        if (ways[w].last_use < ways[victim].last_use) {
+          victim = w;
+        }
+      }
+      return victim;
+    }
+  }
+}
+
+static void
+touch(APEX_Cache* c, int set, int way)
+{
+  c->lines[set * c->assoc + way].last_use = ++c->use_clock;
+  plru_touch(c, set, way);
+}
+
+/*
+ * Checks the geometry, empties the cache and clears the stats
+ *
+ * Returns 0 on success, -1 if size, assoc and line_size do not fit
+ */
+int
+APEX_cache_reset(APEX_Cache* c)
+{
+  memset(c->lines, 0, sizeof(c->lines));
+  memset(c->plru, 0, sizeof(c->plru));
+  c->use_clock = 0;
+  c->random = 0x9e3779b9u;
+  c->reads = 0;
+  c->writes = 0;
+  c->read_misses = 0;
+  c->write_misses = 0;
+  c->writebacks = 0;
+  c->write_throughs = 0;
+
+  c->sets = 0;
+  if (c->size == 0) {
+    return 0;
+  }
+  int lines = c->size / c->line_size;
+  if (lines < c->assoc || lines > CACHE_MAX_LINES) {
+    fprintf(stderr, "APEX_Error : A %d byte cache with %d byte lines can not be %d way, "
+            "and holds at most %d lines\n", c->size, c->line_size, c->assoc, CACHE_MAX_LINES);
+    return -1;
+  }
+  c->sets = lines / c->assoc;
+  return 0;
+}
+
+/*
+ * Looks up the byte at address, filling or updating its line
+ *
+ * Returns the cycles the access takes. Dirty evictions and write-through
+ * writes go to a write buffer and cost nothing here.
+ */
+int
+APEX_cache_access(APEX_Cache* c, int address, int is_write)
+{
+  if (c->size == 0) {
+    return 1;
+  }
+
+  unsigned block = (unsigned)address / c->line_size;
+  int set = block & (c->sets - 1);
+  int tag = block / c->sets;
+  APEX_CacheLine* ways = &c->lines[set * c->assoc];
+
+  if (is_write) {
+    c->writes++;
+  } else {
+    c->reads++;
+  }
+
+  for (int w = 0; w < c->assoc; ++w) {
+    if (ways[w].valid && ways[w].tag == tag) {
+      touch(c, set, w);
+      if (is_write) {
+        if (c->write_back) {
+          ways[w].dirty = 1;
+        } else {
+          c->write_throughs++;
+        }
+      }
+      return c->hit_latency;
+    }
+  }
+
+  if (is_write) {
+    c->write_misses++;
+    if (!c->write_back) {
+      c->write_throughs++;
+      return c->hit_latency;
+    }
+  } else {
+    c->read_misses++;
+  }
+
+  int victim = choose_victim(c, set);
+  if (ways[victim].valid && ways[victim].dirty) {
+    c->writebacks++;
+  }
+  ways[victim].valid = 1;
+  ways[victim].tag = tag;
+  ways[victim].dirty = is_write;
+  touch(c, set, victim);
+  return c->hit_latency + c->miss_latency;
+}
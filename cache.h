@@ -0,0 +1,71 @@
+#ifndef _APEX_CACHE_H_
+#define _APEX_CACHE_H_
+/**
+ *  cache.h
+ *  L1 cache model, in front of code memory as the I-cache and of data
+ *  memory as the D-cache. Only tags are modelled, the contents stay
+ *  where they are, so a cache decides how long an access takes but never
+ *  what it returns. All state is kept in fixed size
+ *  arrays so that it lives inside APEX_CPU and is carried by checkpoints.
+ */
+#include <stdint.h>
+
+/* Replacement policies, selected with --set [id]cache_replacement=<name> */
+enum
+{
+  REPL_LRU,		// Least recently used way
+  REPL_PLRU,		// Tree pseudo-LRU
+  REPL_RANDOM,		// Any way, from a fixed seed so runs repeat
+  NUM_REPLS
+};
+
+#define CACHE_MAX_LINES 4096
+#define CACHE_MAX_ASSOC 16
+#define CACHE_MAX_LINE_SIZE 256
+
+typedef struct APEX_CacheLine
+{
+  int tag;
+  uint8_t valid;
+  uint8_t dirty;	// Written since the fill, write-back only
+  uint32_t last_use;	// For LRU
+} APEX_CacheLine;
+
+typedef struct APEX_Cache
+{
+  /* Configuration, a size of 0 disables the cache and every access takes
+   * a single cycle as before */
+  int size;		// Bytes, a power of 2
+  int assoc;		// Ways per set, a power of 2
+  int line_size;	// Bytes, a power of 2
+  int hit_latency;	// Cycles of an access which hits
+  int miss_latency;	// Extra cycles of an access which misses
+  int replacement;	// One of REPL_*
+  int write_back;	// Write-back and write-allocate, else write-through
+			// without allocation. The I-cache is never written.
+
+  /* State */
+  int sets;
+  APEX_CacheLine lines[CACHE_MAX_LINES];	// Set major
+  uint16_t plru[CACHE_MAX_LINES];	// Tree bits of every set
+  uint32_t use_clock;
+  uint32_t random;
+
+  /* Stats */
+  long reads;
+  long writes;
+  long read_misses;
+  long write_misses;
+  long writebacks;	// Dirty lines evicted
+  long write_throughs;	// Writes passed on to memory
+} APEX_Cache;
+
+extern const char* const cache_repl_names[NUM_REPLS];
+
+int
+APEX_cache_reset(APEX_Cache* c);
+
+int
+APEX_cache_access(APEX_Cache* c, int address, int is_write);
+
+#endif
@@ -0,0 +1,192 @@
+/*
+ *  checkpoint.c
+ *  Contains binary save and restore of the complete APEX cpu state
+ *
+ *  A checkpoint is a small header followed by an image of the APEX_CPU
+ *  structure: register file, z flag, all five pipeline latches, pc,
+ *  clock, stats, performance counters and the interlock state. The data
+ *  memory pages which have been written follow, each as its page number
+ *  and words. Code memory is not stored, it is re-created from the
+ *  program file and checked against the hash recorded in the header.
+ */
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cpu.h"
+
+#define APEX_CHECKPOINT_MAGIC "APXC"
+
+/* Bump whenever the meaning of the saved state changes */
+#define APEX_CHECKPOINT_VERSION 2
+
+typedef struct Checkpoint_Header
+{
+  char magic[4];		// APEX_CHECKPOINT_MAGIC
+  uint32_t version;		// APEX_CHECKPOINT_VERSION
+  uint32_t cpu_size;		// sizeof(APEX_CPU), catches layout changes
+  uint32_t code_memory_size;	// Instructions in the program
+  uint64_t code_hash;		// FNV-1a hash of code memory
+  uint32_t mem_pages;		// Data memory pages after the APEX_CPU image
+  uint32_t reserved;
+} Checkpoint_Header;
+
+/* A data memory page as stored after the APEX_CPU image */
+typedef struct Checkpoint_Page
+{
+  uint32_t page;
+  int32_t words[DMEM_PAGE_WORDS];
+} Checkpoint_Page;
+
+static uint64_t
+hash_code_memory(const APEX_Instruction* code, int size)
+{
+  const unsigned char* p = (const unsigned char*)code;
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < sizeof(*code) * size; ++i) {
+    hash = (hash ^ p[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+/*
+ * Writes the full state of cpu to filename
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int
+APEX_cpu_save(const APEX_CPU* cpu, const char* filename)
+{
+  FILE* fp = fopen(filename, "wb");
+  if (!fp) {
+    fprintf(stderr, "APEX_Error : Unable to create checkpoint %s\n", filename);
+    return -1;
+  }
+
+  Checkpoint_Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, APEX_CHECKPOINT_MAGIC, 4);
+  header.version = APEX_CHECKPOINT_VERSION;
+  header.cpu_size = sizeof(APEX_CPU);
+  header.code_memory_size = cpu->code_memory_size;
+  header.code_hash = hash_code_memory(cpu->code_memory, cpu->code_memory_size);
+  header.mem_pages = cpu->data_memory.pages;
+
+  int ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+           fwrite(cpu, sizeof(*cpu), 1, fp) == 1;
+  const APEX_DataMemory* m = &cpu->data_memory;
+  for (uint32_t p = APEX_dmem_next_page(m, 0); ok && p != DMEM_NO_PAGE;
+       p = APEX_dmem_next_page(m, p + 1)) {
+    ok = fwrite(&p, sizeof(p), 1, fp) == 1 &&
+         fwrite(APEX_dmem_find_page(m, p), sizeof(int32_t), DMEM_PAGE_WORDS, fp) == DMEM_PAGE_WORDS;
+  }
+  if (fclose(fp) != 0 || !ok) {
+    fprintf(stderr, "APEX_Error : Unable to write checkpoint %s\n", filename);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Re-creates a CPU from a checkpoint written by APEX_cpu_save(). The
+ * checkpoint is mapped rather than read, program must be the input file
+ * the checkpoint was taken from.
+ *
+ * Returns NULL on failure
+ */
+APEX_CPU*
+APEX_cpu_restore(const char* filename, const char* program)
+{
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "APEX_Error : Unable to open checkpoint %s\n", filename);
+    return NULL;
+  }
+
+  struct stat st;
+  size_t size = sizeof(Checkpoint_Header) + sizeof(APEX_CPU);
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < size ||
+      ((size_t)st.st_size - size) % sizeof(Checkpoint_Page) != 0) {
+    fprintf(stderr, "APEX_Error : %s is not a checkpoint of this simulator build\n", filename);
+    close(fd);
+    return NULL;
+  }
+  size = st.st_size;
+
+  void* image = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED) {
+    fprintf(stderr, "APEX_Error : Unable to map checkpoint %s\n", filename);
+    return NULL;
+  }
+
+  const Checkpoint_Header* header = image;
+  if (memcmp(header->magic, APEX_CHECKPOINT_MAGIC, 4) != 0 ||
+      header->version != APEX_CHECKPOINT_VERSION ||
+      header->cpu_size != sizeof(APEX_CPU) ||
+      size != sizeof(*header) + sizeof(APEX_CPU) + header->mem_pages * sizeof(Checkpoint_Page)) {
+    fprintf(stderr, "APEX_Error : %s is not a checkpoint of this simulator build\n", filename);
+    munmap(image, size);
+    return NULL;
+  }
+
+  APEX_CPU* cpu = malloc(sizeof(*cpu));
+  if (!cpu) {
+    munmap(image, size);
+    return NULL;
+  }
+  memcpy(cpu, header + 1, sizeof(*cpu));
+
+  /* Pointers in the image are stale, rebuild them */
+  cpu->out = stdout;
+  cpu->trace = NULL;
+  cpu->stats = NULL;
+  cpu->blocks = NULL;
+  if (APEX_dmem_init(&cpu->data_memory, cpu->data_memory.bits) != 0) {
+    munmap(image, size);
+    free(cpu);
+    return NULL;
+  }
+  const Checkpoint_Page* pages = (const Checkpoint_Page*)((const APEX_CPU*)(header + 1) + 1);
+  for (uint32_t i = 0; i < header->mem_pages; ++i) {
+    if (pages[i].page > cpu->data_memory.mask >> DMEM_PAGE_BITS) {
+      fprintf(stderr, "APEX_Error : %s is not a checkpoint of this simulator build\n", filename);
+      APEX_dmem_free(&cpu->data_memory);
+      munmap(image, size);
+      free(cpu);
+      return NULL;
+    }
+    int32_t* words = APEX_dmem_alloc_page(&cpu->data_memory, pages[i].page);
+    if (!words) {
+      APEX_dmem_free(&cpu->data_memory);
+      munmap(image, size);
+      free(cpu);
+      return NULL;
+    }
+    memcpy(words, pages[i].words, sizeof(pages[i].words));
+  }
+
+  cpu->code_memory = load_code_memory(program, &cpu->code_memory_size,
+                                      &cpu->code_memory_mapped);
+  if (!cpu->code_memory ||
+      (uint32_t)cpu->code_memory_size != header->code_memory_size ||
+      hash_code_memory(cpu->code_memory, cpu->code_memory_size) != header->code_hash) {
+    fprintf(stderr, "APEX_Error : %s was not taken from program %s\n", filename, program);
+    munmap(image, size);
+    if (cpu->code_memory) {
+      release_code_memory(cpu->code_memory, cpu->code_memory_size,
+                          cpu->code_memory_mapped);
+    }
+    APEX_dmem_free(&cpu->data_memory);
+    free(cpu);
+    return NULL;
+  }
+
+  munmap(image, size);
+  return cpu;
+}
@@ -0,0 +1,408 @@
+/*
+ *  config.c
+ *  Contains the key=value settings of the modelled microarchitecture
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+
+static int
+parse_int(const char* key, const char* value, int min, int max, int* result)
+{
+  char* end;
+  long v = strtol(value, &end, 0);
+  if (end == value || *end != '\0' || v < min || v > max) {
+    fprintf(stderr, "APEX_Error : %s must be an integer in [%d, %d], got '%s'\n",
+            key, min, max, value);
+    return -1;
+  }
+  *result = v;
+  return 0;
+}
+
+static int
+is_power_of_2(int v)
+{
+  return v > 0 && (v & (v - 1)) == 0;
+}
+
+/* Returns the opcode with the given mnemonic, -1 if there is none */
+static int
+find_opcode(const char* name)
+{
+  for (int op = 0; op < NUM_OPCODES; ++op) {
+    if (strcmp(name, opcode_info[op].name) == 0) {
+      return op;
+    }
+  }
+  fprintf(stderr, "APEX_Error : Unknown opcode '%s'\n", name);
+  return -1;
+}
+
+/*
+ * Applies a dcache_* or icache_* setting, field is the key without its
+ * prefix. The cache is emptied whenever its shape or policy changes.
+ */
+static int
+set_cache(APEX_Cache* c, const char* key, const char* field, const char* value, int writes)
+{
+  APEX_Cache old = *c;
+
+  if (strcmp(field, "size") == 0) {
+    if (parse_int(key, value, 0, CACHE_MAX_LINES * CACHE_MAX_LINE_SIZE, &c->size) != 0) {
+      return -1;
+    }
+    if (c->size != 0 && !is_power_of_2(c->size)) {
+      fprintf(stderr, "APEX_Error : %s must be a power of 2, got %d\n", key, c->size);
+      *c = old;
+      return -1;
+    }
+  } else if (strcmp(field, "assoc") == 0) {
+    if (parse_int(key, value, 1, CACHE_MAX_ASSOC, &c->assoc) != 0) {
+      return -1;
+    }
+    if (!is_power_of_2(c->assoc)) {
+      fprintf(stderr, "APEX_Error : %s must be a power of 2, got %d\n", key, c->assoc);
+      *c = old;
+      return -1;
+    }
+  } else if (strcmp(field, "line") == 0) {
+    if (parse_int(key, value, 4, CACHE_MAX_LINE_SIZE, &c->line_size) != 0) {
+      return -1;
+    }
+    if (!is_power_of_2(c->line_size)) {
+      fprintf(stderr, "APEX_Error : %s must be a power of 2, got %d\n", key, c->line_size);
+      *c = old;
+      return -1;
+    }
+  } else if (strcmp(field, "hit_latency") == 0) {
+    return parse_int(key, value, 1, 64, &c->hit_latency);
+  } else if (strcmp(field, "miss_latency") == 0) {
+    return parse_int(key, value, 0, 1000, &c->miss_latency);
+  } else if (strcmp(field, "replacement") == 0) {
+    int i = 0;
+    while (i < NUM_REPLS && strcmp(value, cache_repl_names[i]) != 0) {
+      i++;
+    }
+    if (i == NUM_REPLS) {
+      fprintf(stderr, "APEX_Error : Unknown replacement policy '%s'\n", value);
+      return -1;
+    }
+    c->replacement = i;
+  } else if (writes && strcmp(field, "write") == 0) {
+    if (strcmp(value, "back") == 0) {
+      c->write_back = 1;
+    } else if (strcmp(value, "through") == 0) {
+      c->write_back = 0;
+    } else {
+      fprintf(stderr, "APEX_Error : %s must be back or through, got '%s'\n", key, value);
+      return -1;
+    }
+  } else {
+    fprintf(stderr, "APEX_Error : Unknown setting '%s'\n", key);
+    return -1;
+  }
+
+  if (c->size == old.size && c->assoc == old.assoc && c->line_size == old.line_size &&
+      c->replacement == old.replacement && c->write_back == old.write_back) {
+    return 0;
+  }
+  if (APEX_cache_reset(c) != 0) {
+    *c = old;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Applies a single setting. Settings which change the shape of a
+ * predictor reset what it has learnt, re-applying a value does not.
+ *
+ *   bpred=none|static|bimodal|gshare|tournament
+ *   btb_entries=<n>	power of 2, BTB size
+ *   bht_bits=<n>		log2 of the predictor tables, also the history length
+ *   resolve=drf|ex|mem	stage where BZ/BNZ/JUMP resolve
+ *   forward=none|ex|mem|ex,mem	bypasses from the output of EX and MEM
+ *			into DRF, a source whose writer has just left a
+ *			stage without one waits
+ *   dcache_size=<bytes>	power of 2, 0 disables the D-cache
+ *   dcache_assoc=<n>	power of 2, ways per set
+ *   dcache_line=<bytes>	power of 2, line size
+ *   dcache_hit_latency=<n>	cycles of a hit
+ *   dcache_miss_latency=<n>	extra cycles of a miss
+ *   dcache_replacement=lru|plru|random
+ *   dcache_write=back|through
+ *   icache_size, icache_assoc, icache_line, icache_hit_latency,
+ *   icache_miss_latency, icache_replacement	as for the D-cache
+ *   fetch_queue=<n>	instructions fetch may run ahead of decode,
+ *			0 feeds decode directly (in-order core)
+ *   mem_bits=<n>	width of a data memory word address, 1 to 32, a
+ *			LOAD or STORE outside traps
+ *   latency.<OPCODE>=<n>	cycles until the result leaves EX
+ *   ii.<OPCODE>=<n>	cycles until its unit accepts another instruction,
+ *			1 is fully pipelined, the latency not pipelined
+ *   core=inorder|superscalar|ooo	core modelled by the cycle loop
+ *   width=<n>		superscalar and out-of-order bundle width
+ *   rob_entries=<n>	out-of-order core sizes: reorder buffer,
+ *   iq_entries=<n>	issue queue
+ *   prf_entries=<n>	and physical register file
+ *
+ * The core, its sizes and the fetch queue can only be set before the
+ * first cycle.
+ *
+ * Returns 0 on success, -1 on an unknown key or a bad value
+ */
+int
+APEX_config_set(APEX_CPU* cpu, const char* key, const char* value)
+{
+  APEX_BranchPredictor* bp = &cpu->bpred;
+
+  if (strcmp(key, "bpred") == 0) {
+    for (int i = 0; i < NUM_BPREDS; ++i) {
+      if (strcmp(value, bpred_names[i]) == 0) {
+        if (bp->type != i) {
+          bp->type = i;
+          APEX_bpred_reset(bp);
+        }
+        return 0;
+      }
+    }
+    fprintf(stderr, "APEX_Error : Unknown branch predictor '%s'\n", value);
+    return -1;
+  }
+
+  if (strcmp(key, "btb_entries") == 0) {
+    int entries;
+    if (parse_int(key, value, 1, BTB_MAX_ENTRIES, &entries) != 0) {
+      return -1;
+    }
+    if (!is_power_of_2(entries)) {
+      fprintf(stderr, "APEX_Error : btb_entries must be a power of 2, got %d\n", entries);
+      return -1;
+    }
+    if (bp->btb_entries != entries) {
+      bp->btb_entries = entries;
+      APEX_bpred_reset(bp);
+    }
+    return 0;
+  }
+
+  if (strcmp(key, "bht_bits") == 0) {
+    int bits;
+    if (parse_int(key, value, 1, BHT_MAX_BITS, &bits) != 0) {
+      return -1;
+    }
+    if (bp->bht_bits != bits) {
+      bp->bht_bits = bits;
+      APEX_bpred_reset(bp);
+    }
+    return 0;
+  }
+
+  if (strncmp(key, "dcache_", 7) == 0) {
+    return set_cache(&cpu->dcache, key, key + 7, value, 1);
+  }
+  if (strncmp(key, "icache_", 7) == 0) {
+    return set_cache(&cpu->icache, key, key + 7, value, 0);
+  }
+
+  if (strcmp(key, "resolve") == 0) {
+    if (strcmp(value, "drf") == 0) {
+      cpu->resolve_stage = DRF;
+    } else if (strcmp(value, "ex") == 0) {
+      cpu->resolve_stage = EX;
+    } else if (strcmp(value, "mem") == 0) {
+      cpu->resolve_stage = MEM;
+    } else {
+      fprintf(stderr, "APEX_Error : resolve must be drf, ex or mem, got '%s'\n", value);
+      return -1;
+    }
+    return 0;
+  }
+
+  if (strcmp(key, "forward") == 0) {
+    int forward[NUM_STAGES] = { 0 };
+    if (strcmp(value, "none") != 0) {
+      /* Every comma separated token must name a stage, so an empty one
+       * before, between or after the names is rejected too */
+      const char* p = value;
+      for (;;) {
+        size_t len = strcspn(p, ",");
+        if (len == 2 && strncmp(p, "ex", 2) == 0) {
+          forward[EX] = 1;
+        } else if (len == 3 && strncmp(p, "mem", 3) == 0) {
+          forward[MEM] = 1;
+        } else {
+          fprintf(stderr, "APEX_Error : forward must be none, ex, mem or ex,mem, got '%s'\n", value);
+          return -1;
+        }
+        if (p[len] == '\0') {
+          break;
+        }
+        p += len + 1;
+      }
+    }
+    memcpy(cpu->forward, forward, sizeof(forward));
+    return 0;
+  }
+
+  if (strncmp(key, "latency.", 8) == 0 || strncmp(key, "ii.", 3) == 0) {
+    int is_latency = key[0] == 'l';
+    int op = find_opcode(strchr(key, '.') + 1);
+    int cycles;
+    if (op < 0 || parse_int(key, value, 1, FU_MAX_INFLIGHT, &cycles) != 0) {
+      return -1;
+    }
+    if (is_latency) {
+      cpu->fu_latency[op] = cycles;
+    } else {
+      cpu->fu_ii[op] = cycles;
+    }
+    return 0;
+  }
+
+  if (strcmp(key, "mem_bits") == 0) {
+    int bits;
+    if (parse_int(key, value, 1, DMEM_MAX_BITS, &bits) != 0) {
+      return -1;
+    }
+    if (APEX_dmem_resize(&cpu->data_memory, bits) != 0) {
+      fprintf(stderr, "APEX_Error : data memory already holds words outside %d address bits\n", bits);
+      return -1;
+    }
+    return 0;
+  }
+
+  if (strcmp(key, "core") == 0 || strcmp(key, "width") == 0 ||
+      strcmp(key, "rob_entries") == 0 || strcmp(key, "fetch_queue") == 0 ||
+      strcmp(key, "iq_entries") == 0 || strcmp(key, "prf_entries") == 0) {
+    if (cpu->clock != 0) {
+      fprintf(stderr, "APEX_Error : %s can only be set before the first cycle\n", key);
+      return -1;
+    }
+
+    APEX_OoO* o = &cpu->ooo;
+    if (strcmp(key, "core") == 0) {
+      if (strcmp(value, "inorder") == 0) {
+        cpu->core = CORE_INORDER;
+      } else if (strcmp(value, "superscalar") == 0) {
+        cpu->core = CORE_SUPERSCALAR;
+      } else if (strcmp(value, "ooo") == 0) {
+        cpu->core = CORE_OOO;
+      } else {
+        fprintf(stderr, "APEX_Error : core must be inorder, superscalar or ooo, got '%s'\n", value);
+        return -1;
+      }
+    } else if (strcmp(key, "width") == 0) {
+      if (parse_int(key, value, 1, APEX_MAX_WIDTH, &o->width) != 0) {
+        return -1;
+      }
+    } else if (strcmp(key, "rob_entries") == 0) {
+      if (parse_int(key, value, 1, OOO_MAX_ROB, &o->rob_entries) != 0) {
+        return -1;
+      }
+    } else if (strcmp(key, "fetch_queue") == 0) {
+      if (parse_int(key, value, 0, FETCH_QUEUE_MAX, &cpu->fetch_queue.size) != 0) {
+        return -1;
+      }
+    } else if (strcmp(key, "iq_entries") == 0) {
+      if (parse_int(key, value, 1, OOO_MAX_IQ, &o->iq_entries) != 0) {
+        return -1;
+      }
+    } else if (parse_int(key, value, OOO_ARCH_REGS + 2, OOO_MAX_PRF, &o->prf_entries) != 0) {
+      return -1;
+    }
+    APEX_ooo_reset(cpu);
+    return 0;
+  }
+
+  fprintf(stderr, "APEX_Error : Unknown setting '%s'\n", key);
+  return -1;
+}
+
+/*
+ * Applies a "key=value" setting, as given on the command line
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int
+APEX_config_parse(APEX_CPU* cpu, const char* setting)
+{
+  const char* eq = strchr(setting, '=');
+  if (!eq || eq == setting) {
+    fprintf(stderr, "APEX_Error : Expected key=value, got '%s'\n", setting);
+    return -1;
+  }
+
+  char key[64];
+  size_t len = eq - setting;
+  if (len >= sizeof(key)) {
+    fprintf(stderr, "APEX_Error : Unknown setting '%.*s'\n", (int)len, setting);
+    return -1;
+  }
+  memcpy(key, setting, len);
+  key[len] = '\0';
+  return APEX_config_set(cpu, key, eq + 1);
+}
+
+/*
+ * Applies every key=value line of a configuration file. Blank lines and
+ * lines starting with '#' are ignored, spaces around key and value too.
+ *
+ * Returns 0 on success, -1 at the first bad line
+ */
+int
+APEX_config_load(APEX_CPU* cpu, const char* filename)
+{
+  FILE* fp = fopen(filename, "r");
+  if (!fp) {
+    fprintf(stderr, "APEX_Error : Unable to open config file '%s'\n", filename);
+    return -1;
+  }
+
+  char line[256];
+  int line_no = 0;
+  int ret = 0;
+  while (ret == 0 && fgets(line, sizeof(line), fp)) {
+    line_no++;
+
+    /* Strip everything which is not part of "key=value" */
+    char* p = line;
+    while (*p == ' ' || *p == '\t') {
+      p++;
+    }
+    char* end = p + strlen(p);
+    while (end > p && (end[-1] == '\n' || end[-1] == '\r' || end[-1] == ' ' || end[-1] == '\t')) {
+      *--end = '\0';
+    }
+    if (*p == '\0' || *p == '#') {
+      continue;
+    }
+
+    char* eq = strchr(p, '=');
+    if (!eq || eq == p) {
+      fprintf(stderr, "APEX_Error : %s:%d: expected key=value\n", filename, line_no);
+      ret = -1;
+      break;
+    }
+    char* key_end = eq;
+    while (key_end > p && (key_end[-1] == ' ' || key_end[-1] == '\t')) {
+      key_end--;
+    }
+    *key_end = '\0';
+    char* value = eq + 1;
+    while (*value == ' ' || *value == '\t') {
+      value++;
+    }
+
+    if (APEX_config_set(cpu, p, value) != 0) {
+      fprintf(stderr, "APEX_Error : %s:%d: bad setting\n", filename, line_no);
+      ret = -1;
+    }
+  }
+
+  fclose(fp);
+  return ret;
+}
@@ -0,0 +1,101 @@
+/*
+ *  counters.c
+ *  Contains the JSON report of the hardware performance counters
+ */
+#include <stdio.h>
+
+#include "cpu.h"
+
+const char* const stall_names[NUM_STALLS] = {
+  "base", "fill", "load_use", "fu", "dcache", "icache", "branch", "drain", "nop"
+};
+
+static const char* stage_names[NUM_STAGES] = {
+  "fetch", "decode", "execute", "memory", "writeback"
+};
+
+/* Writes the accesses of a cache as a JSON member named name */
+static void
+write_cache(FILE* fp, const char* name, const APEX_Cache* c)
+{
+  fprintf(fp, "  \"%s\": {\n", name);
+  fprintf(fp, "    \"enabled\": %s,\n", c->size ? "true" : "false");
+  fprintf(fp, "    \"reads\": %ld,\n", c->reads);
+  fprintf(fp, "    \"writes\": %ld,\n", c->writes);
+  fprintf(fp, "    \"read_misses\": %ld,\n", c->read_misses);
+  fprintf(fp, "    \"write_misses\": %ld,\n", c->write_misses);
+  fprintf(fp, "    \"writebacks\": %ld,\n", c->writebacks);
+  fprintf(fp, "    \"write_throughs\": %ld,\n", c->write_throughs);
+  fprintf(fp, "    \"hit_rate\": %.6f\n", c->reads + c->writes ?
+          1.0 - (double)(c->read_misses + c->write_misses) / (c->reads + c->writes) : 0.0);
+  fprintf(fp, "  },\n");
+}
+
+/*
+ * Writes the counters of cpu as a JSON object: cycle and commit totals,
+ * IPC, the CPI stack (writeback cycles per committed instruction, split
+ * by stall cause), the cycles of every stage by cause, the branch
+ * predictor accuracy, the I-cache and D-cache hits and misses and the commits of
+ * every opcode
+ */
+void
+APEX_counters_write_json(const APEX_CPU* cpu, FILE* fp)
+{
+  const APEX_Counters* c = &cpu->counters;
+  long cycles = 0;
+  for (int i = 0; i < NUM_STALLS; ++i) {
+    cycles += c->stage_cycles[WB][i];
+  }
+  long committed = 0;
+  for (int op = 0; op < NUM_OPCODES; ++op) {
+    committed += c->commits[op];
+  }
+
+  fprintf(fp, "{\n");
+  fprintf(fp, "  \"cycles\": %ld,\n", cycles);
+  fprintf(fp, "  \"committed\": %ld,\n", committed);
+  fprintf(fp, "  \"ipc\": %.6f,\n", cycles ? (double)committed / cycles : 0.0);
+  fprintf(fp, "  \"cpi\": %.6f,\n", committed ? (double)cycles / committed : 0.0);
+
+  fprintf(fp, "  \"cpi_stack\": {");
+  for (int i = 0; i < NUM_STALLS; ++i) {
+    fprintf(fp, "%s\n    \"%s\": %.6f", i ? "," : "", stall_names[i],
+            committed ? (double)c->stage_cycles[WB][i] / committed : 0.0);
+  }
+  fprintf(fp, "\n  },\n");
+
+  fprintf(fp, "  \"stage_cycles\": {");
+  for (int s = 0; s < NUM_STAGES; ++s) {
+    fprintf(fp, "%s\n    \"%s\": {", s ? "," : "", stage_names[s]);
+    for (int i = 0; i < NUM_STALLS; ++i) {
+      fprintf(fp, "%s\"%s\": %ld", i ? ", " : "", stall_names[i], c->stage_cycles[s][i]);
+    }
+    fprintf(fp, "}");
+  }
+  fprintf(fp, "\n  },\n");
+
+  const APEX_BranchPredictor* bp = &cpu->bpred;
+  fprintf(fp, "  \"branch_prediction\": {\n");
+  fprintf(fp, "    \"predictor\": \"%s\",\n", bpred_names[bp->type]);
+  fprintf(fp, "    \"branches\": %ld,\n", bp->branches);
+  fprintf(fp, "    \"mispredicts\": %ld,\n", bp->mispredicts);
+  fprintf(fp, "    \"btb_misses\": %ld,\n", bp->btb_misses);
+  fprintf(fp, "    \"accuracy\": %.6f\n",
+          bp->branches ? 1.0 - (double)bp->mispredicts / bp->branches : 0.0);
+  fprintf(fp, "  },\n");
+
+  write_cache(fp, "icache", &cpu->icache);
+  write_cache(fp, "dcache", &cpu->dcache);
+
+  fprintf(fp, "  \"commits\": {");
+  int first = 1;
+  for (int op = 0; op < NUM_OPCODES; ++op) {
+    if (op == OP_NOP) {
+      continue;
+    }
+    fprintf(fp, "%s\n    \"%s\": %ld", first ? "" : ",", opcode_info[op].name, c->commits[op]);
+    first = 0;
+  }
+  fprintf(fp, "\n  }\n");
+  fprintf(fp, "}\n");
+}
@@ -11,14 +11,7 @@
 #include <string.h>
 
 #include "cpu.h"
-
-
-int MUL_INDEX=0;
-int STOP_INDEX=0;
-int INSTRUCT_INDEX=0;
-int HALT_INDEX=0;
-int RS1_INDEX=0;
-int RS2_INDEX=0;
+#include "trace.h"
 
 /* Set this flag to 1 to enable debug messages */
 #define ENABLE_DEBUG_MESSAGES 1
@@ -37,26 +30,83 @@ APEX_cpu_init(const char* filename)
     return NULL;
   }
 
-  APEX_CPU* cpu = malloc(sizeof(*cpu));
+  APEX_CPU* cpu = calloc(1, sizeof(*cpu));
   if (!cpu) {
     return NULL;
   }
 
   /* Initialize PC, Registers and all pipeline stages */
   cpu->pc = 4000;
+  cpu->mode = MODE_SIMULATE;
+  cpu->max_cycles = -1;
+  cpu->out = stdout;
 
     //z_flag
     cpu->z_flag[0]=0;
     
   memset(cpu->regs, 0, sizeof(int) * 32);
-  memset(cpu->regs_valid, 1, sizeof(int) * 32);
-  memset(cpu->stage, 0, sizeof(CPU_Stage) * NUM_STAGES);
-  memset(cpu->data_memory, 0, sizeof(int) * 4000);
+
+  /* 4096 words until mem_bits says otherwise */
+  if (APEX_dmem_init(&cpu->data_memory, 12) != 0) {
+    free(cpu);
+    return NULL;
+  }
+
+  cpu->core = CORE_INORDER;
+  cpu->ooo.width = 1;
+  cpu->ooo.rob_entries = 32;
+  cpu->ooo.iq_entries = 16;
+  cpu->ooo.prf_entries = 96;
+  APEX_cpu_reset_pipeline(cpu);
+
+  /* Without a predictor every taken branch is a mispredict, as before */
+  cpu->bpred.type = BP_NONE;
+  cpu->bpred.btb_entries = 256;
+  cpu->bpred.bht_bits = 10;
+  APEX_bpred_reset(&cpu->bpred);
+  cpu->resolve_stage = MEM;
+
+  /* Results are forwarded as they leave EX and MEM */
+  cpu->forward[EX] = 1;
+  cpu->forward[MEM] = 1;
+
+  /* No D-cache until a size is set */
+  cpu->dcache.size = 0;
+  cpu->dcache.assoc = 2;
+  cpu->dcache.line_size = 32;
+  cpu->dcache.hit_latency = 1;
+  cpu->dcache.miss_latency = 10;
+  cpu->dcache.replacement = REPL_LRU;
+  cpu->dcache.write_back = 1;
+  APEX_cache_reset(&cpu->dcache);
+
+  /* Nor an I-cache, and fetch feeds decode directly */
+  cpu->icache.size = 0;
+  cpu->icache.assoc = 2;
+  cpu->icache.line_size = 32;
+  cpu->icache.hit_latency = 1;
+  cpu->icache.miss_latency = 10;
+  cpu->icache.replacement = REPL_LRU;
+  cpu->icache.write_back = 0;
+  APEX_cache_reset(&cpu->icache);
+  cpu->fetch_queue.size = 0;
+
+  /* Single cycle ALU, MUL holds its unit for two cycles, DIV for eight */
+  for (int op = 0; op < NUM_OPCODES; ++op) {
+    cpu->fu_latency[op] = 1;
+    cpu->fu_ii[op] = 1;
+  }
+  cpu->fu_latency[OP_MUL] = 2;
+  cpu->fu_ii[OP_MUL] = 2;
+  cpu->fu_latency[OP_DIV] = 8;
+  cpu->fu_ii[OP_DIV] = 8;
 
   /* Parse input file and create code memory */
-  cpu->code_memory = create_code_memory(filename, &cpu->code_memory_size);
+  cpu->code_memory = load_code_memory(filename, &cpu->code_memory_size,
+                                      &cpu->code_memory_mapped);
 
   if (!cpu->code_memory) {
+    APEX_dmem_free(&cpu->data_memory);
     free(cpu);
     return NULL;
   }
@@ -81,15 +131,37 @@ APEX_cpu_init(const char* filename)
 //    }
 //  }
 
-    
-  /* Make all stages busy except Fetch stage, initally to start the pipeline */
-  for (int i = 1; i < NUM_STAGES; ++i) {
-    cpu->stage[i].busy = 1;
-  }
 
   return cpu;
 }
 
+/*
+ * Empties all pipeline latches and clears the interlock state, so that
+ * the pipeline restarts fetching from cpu->pc on the next cycle. The
+ * architectural state (registers, flags, data memory) is left untouched.
+ */
+void
+APEX_cpu_reset_pipeline(APEX_CPU* cpu)
+{
+  memset(cpu->stage, 0, sizeof(CPU_Stage) * NUM_STAGES);
+  memset(cpu->fu, 0, sizeof(cpu->fu));
+  memset(&cpu->scoreboard, 0, sizeof(cpu->scoreboard));
+  cpu->fu_stall = 0;
+  cpu->mem_stall = 0;
+  cpu->icache_stall = 0;
+  cpu->fetch_queue.head = 0;
+  cpu->fetch_queue.count = 0;
+  cpu->stop_index = 0;
+  cpu->halt_index = 0;
+  cpu->trapped = 0;
+  APEX_ooo_reset(cpu);
+
+  /* Every stage but Fetch waits for the pipeline to fill */
+  for (int i = 1; i < NUM_STAGES; ++i) {
+    cpu->stage[i].bubble = STALL_FILL;
+  }
+}
+
 /*
  * This function de-allocates APEX cpu.
  *
@@ -99,7 +171,10 @@ APEX_cpu_init(const char* filename)
 void
 APEX_cpu_stop(APEX_CPU* cpu)
 {
-  free(cpu->code_memory);
+  release_code_memory(cpu->code_memory, cpu->code_memory_size,
+                      cpu->code_memory_mapped);
+  APEX_dmem_free(&cpu->data_memory);
+  APEX_blocks_free(cpu);
   free(cpu);
 }
 
@@ -115,75 +190,71 @@ get_code_index(int pc)
   return (pc - 4000) / 4;
 }
 
-static void
-print_instruction_WB(CPU_Stage* stage)
+/*
+ * The pc fetch has reached once the bubbles behind the last instruction
+ * have pushed it out of the pipeline
+ */
+static int
+drain_pc(const APEX_CPU* cpu)
 {
-  if (strcmp(stage->opcode, "STORE") == 0) {
-    printf(
-      "%s,R%d,R%d,#%d MEM(%d)=%d", stage->opcode, stage->rs1, stage->rs2, stage->imm, stage->mem_address, stage->rs1_value);
-  }
+  return 4000 + 4 * (cpu->code_memory_size + 4);
+}
 
-  if (strcmp(stage->opcode, "MOVC") == 0) {
-    printf("%s,R%d,#%d R%d(%d)", stage->opcode, stage->rd, stage->imm, stage->rd, stage->buffer);
+/*
+ * 1 once the in-order pipeline has nothing left to do: fetch is past
+ * drain_pc, and no instruction is queued, in a latch or still in a
+ * functional unit, however long its latency
+ */
+static int
+inorder_drained(const APEX_CPU* cpu)
+{
+  if (cpu->pc < drain_pc(cpu) || cpu->fetch_queue.count != 0 || cpu->scoreboard.pending != 0) {
+    return 0;
   }
-    
-    if (strcmp(stage->opcode, "NOP") == 0) {
-        printf("%s", stage->opcode);
-    }
-    
-    if (strcmp(stage->opcode, "LOAD") == 0) {
-        printf("%s,R%d,R%d,#%d R(%d)=%d", stage->opcode, stage->rd, stage->rs1, stage->imm, stage->rd, stage->buffer);
-    }
-    
-    if (strcmp(stage->opcode, "ADD") == 0) {
-        printf(
-               "%s,R%d,R%d,R%d R%d(%d)", stage->opcode, stage->rd, stage->rs1, stage->rs2, stage->rd, stage->buffer);
-    }
-    
-    if (strcmp(stage->opcode, "SUB") == 0) {
-        printf(
-               "%s,R%d,R%d,R%d R%d(%d)", stage->opcode, stage->rd, stage->rs1, stage->rs2, stage->rd, stage->buffer);
-    }
-    
-    if (strcmp(stage->opcode, "AND") == 0) {
-        printf(
-               "%s,R%d,R%d,R%d R%d(%d)", stage->opcode, stage->rd, stage->rs1, stage->rs2, stage->rd, stage->buffer);
-    }
-    
-    if (strcmp(stage->opcode, "OR") == 0) {
-        printf(
-               "%s,R%d,R%d,R%d R%d(%d)", stage->opcode, stage->rd, stage->rs1, stage->rs2, stage->rd, stage->buffer);
-    }
-    
-    if (strcmp(stage->opcode, "EX-OR") == 0) {
-        printf(
-               "%s,R%d,R%d,R%d R%d(%d)", stage->opcode, stage->rd, stage->rs1, stage->rs2, stage->rd, stage->buffer);
-    }
-    
-    if (strcmp(stage->opcode, "MUL") == 0) {
-        printf(
-               "%s,R%d,R%d,R%d R%d(%d)", stage->opcode, stage->rd, stage->rs1, stage->rs2, stage->rd, stage->buffer);
-    }
-    
-    if (strcmp(stage->opcode, "BZ") == 0) {
-        printf(
-               "%s,#%d", stage->opcode, stage->imm);
-    }
-    
-    if (strcmp(stage->opcode, "BNZ") == 0) {
-        printf(
-               "%s,#%d", stage->opcode, stage->imm);
+  for (int u = 0; u < NUM_FUS; ++u) {
+    if (cpu->fu[u].count != 0) {
+      return 0;
     }
-    
-    if (strcmp(stage->opcode, "JUMP") == 0) {
-        printf(
-               "%s,#%d", stage->opcode, stage->imm);
-    }
-    
-    if (strcmp(stage->opcode, "HALT") == 0) {
-        printf(
-               "%s", stage->opcode);
+  }
+  for (int s = 0; s < NUM_STAGES; ++s) {
+    if (cpu->stage[s].opcode != OP_NOP) {
+      return 0;
     }
+  }
+  return 1;
+}
+
+static void
+print_instruction_WB(FILE* out, CPU_Stage* stage)
+{
+  const char* name = opcode_info[stage->opcode].name;
+
+  switch (opcode_info[stage->opcode].format) {
+    case FMT_RS1_RS2_IMM:
+      fprintf(out, "%s,R%d,R%d,#%d MEM(%d)=%d", name, stage->rs1, stage->rs2, stage->imm, stage->mem_address, stage->rs1_value);
+      break;
+
+    case FMT_RD_IMM:
+      fprintf(out, "%s,R%d,#%d R%d(%d)", name, stage->rd, stage->imm, stage->rd, stage->buffer);
+      break;
+
+    case FMT_RD_RS1_IMM:
+      fprintf(out, "%s,R%d,R%d,#%d R(%d)=%d", name, stage->rd, stage->rs1, stage->imm, stage->rd, stage->buffer);
+      break;
+
+    case FMT_RD_RS1_RS2:
+      fprintf(out, "%s,R%d,R%d,R%d R%d(%d)", name, stage->rd, stage->rs1, stage->rs2, stage->rd, stage->buffer);
+      break;
+
+    case FMT_IMM:
+    case FMT_RS1_IMM:
+      fprintf(out, "%s,#%d", name, stage->imm);
+      break;
+
+    case FMT_NONE:
+      fprintf(out, "%s", name);
+      break;
+  }
 }
 
 /* Debug function which dumps the cpu stage
@@ -192,84 +263,45 @@ print_instruction_WB(CPU_Stage* stage)
  * Note : You are not supposed to edit this function
  *
  */
-static void
-print_stage_content_WB(char* name, CPU_Stage* stage)
+void
+print_stage_content_WB(FILE* out, char* name, CPU_Stage* stage)
 {
-  printf("%-15s: pc(%d) ", name, stage->pc);
-  print_instruction_WB(stage);
-  printf("\n");
+  fprintf(out, "%-15s: pc(%d) ", name, stage->pc);
+  print_instruction_WB(out, stage);
+  fprintf(out, "\n");
 }
 
 static void
-print_instruction(CPU_Stage* stage)
+print_instruction(FILE* out, CPU_Stage* stage)
 {
-    if (strcmp(stage->opcode, "STORE") == 0) {
-        printf(
-               "%s,R%d,R%d,#%d ", stage->opcode, stage->rs1, stage->rs2, stage->imm);
-    }
-    
-    if (strcmp(stage->opcode, "MOVC") == 0) {
-        printf("%s,R%d,#%d ", stage->opcode, stage->rd, stage->imm);
-    }
-    
-    
-    if (strcmp(stage->opcode, "NOP") == 0) {
-        printf("%s", stage->opcode);
-    }
-    
-    if (strcmp(stage->opcode, "LOAD") == 0) {
-        printf("%s,R%d,R%d,#%d ", stage->opcode, stage->rd, stage->rs1, stage->imm);
-    }
-    
-    if (strcmp(stage->opcode, "ADD") == 0) {
-        printf(
-               "%s,R%d,R%d,R%d ", stage->opcode, stage->rd, stage->rs1, stage->rs1);
-    }
-    
-    if (strcmp(stage->opcode, "SUB") == 0) {
-        printf(
-               "%s,R%d,R%d,R%d ", stage->opcode, stage->rd, stage->rs1, stage->rs2);
-    }
-    
-    if (strcmp(stage->opcode, "AND") == 0) {
-        printf(
-               "%s,R%d,R%d,R%d ", stage->opcode, stage->rd, stage->rs1, stage->rs2);
-    }
-    
-    if (strcmp(stage->opcode, "OR") == 0) {
-        printf(
-               "%s,R%d,R%d,R%d ", stage->opcode, stage->rd, stage->rs1, stage->rs2);
-    }
-    
-    if (strcmp(stage->opcode, "EX-OR") == 0) {
-        printf(
-               "%s,R%d,R%d,R%d ", stage->opcode, stage->rd, stage->rs1, stage->rs2);
-    }
-    
-    if (strcmp(stage->opcode, "MUL") == 0) {
-        printf(
-               "%s,R%d,R%d,R%d ", stage->opcode, stage->rd, stage->rs1, stage->rs2);
-    }
-    
-    if (strcmp(stage->opcode, "BZ") == 0) {
-        printf(
-               "%s,#%d", stage->opcode, stage->imm);
-    }
-    
-    if (strcmp(stage->opcode, "BNZ") == 0) {
-        printf(
-               "%s,#%d", stage->opcode, stage->imm);
-    }
-    
-    if (strcmp(stage->opcode, "JUMP") == 0) {
-        printf(
-               "%s,#%d", stage->opcode, stage->imm);
-    }
-    
-    if (strcmp(stage->opcode, "HALT") == 0) {
-        printf(
-               "%s", stage->opcode);
-    }
+  const char* name = opcode_info[stage->opcode].name;
+
+  switch (opcode_info[stage->opcode].format) {
+    case FMT_RS1_RS2_IMM:
+      fprintf(out, "%s,R%d,R%d,#%d ", name, stage->rs1, stage->rs2, stage->imm);
+      break;
+
+    case FMT_RD_IMM:
+      fprintf(out, "%s,R%d,#%d ", name, stage->rd, stage->imm);
+      break;
+
+    case FMT_RD_RS1_IMM:
+      fprintf(out, "%s,R%d,R%d,#%d ", name, stage->rd, stage->rs1, stage->imm);
+      break;
+
+    case FMT_RD_RS1_RS2:
+      fprintf(out, "%s,R%d,R%d,R%d ", name, stage->rd, stage->rs1, stage->rs2);
+      break;
+
+    case FMT_IMM:
+    case FMT_RS1_IMM:
+      fprintf(out, "%s,#%d", name, stage->imm);
+      break;
+
+    case FMT_NONE:
+      fprintf(out, "%s", name);
+      break;
+  }
 }
 
 /* Debug function which dumps the cpu stage
@@ -278,868 +310,514 @@ print_instruction(CPU_Stage* stage)
  * Note : You are not supposed to edit this function
  *
  */
+void
+print_stage_content(FILE* out, char* name, CPU_Stage* stage)
+{
+    fprintf(out, "%-15s: pc(%d) ", name, stage->pc);
+    print_instruction(out, stage);
+    fprintf(out, "\n");
+}
+
+/*
+ * Returns the scoreboard bits of the registers ins writes
+ */
+uint64_t
+APEX_sb_writes(const CPU_Stage* ins)
+{
+  uint64_t writes = 0;
+  if (ins->rd >= 0 && opcode_info[ins->opcode].ready >= 0) {
+    writes |= 1ull << ins->rd;
+  }
+  if (APEX_sets_z(ins->opcode)) {
+    writes |= 1ull << SB_Z;
+  }
+  return writes;
+}
+
+/* Adds delta to the writer count of every register in writes */
 static void
-print_stage_content(char* name, CPU_Stage* stage)
+sb_count(int* writers, uint64_t* mask, uint64_t writes, int delta)
 {
-    printf("%-15s: pc(%d) ", name, stage->pc);
-    print_instruction(stage);
-    printf("\n");
+  while (writes) {
+    int r = __builtin_ctzll(writes);
+    writes &= writes - 1;
+    writers[r] += delta;
+    if (writers[r] != 0) {
+      *mask |= 1ull << r;
+    } else {
+      *mask &= ~(1ull << r);
+    }
+  }
+}
+
+/* Records ins as a writer of its destinations once it has issued */
+void
+APEX_sb_issue(APEX_Scoreboard* sb, const CPU_Stage* ins)
+{
+  sb_count(sb->writers, &sb->pending, APEX_sb_writes(ins), 1);
+}
+
+/* Forgets ins as a writer, when it retires or is squashed */
+void
+APEX_sb_retire(APEX_Scoreboard* sb, const CPU_Stage* ins)
+{
+  sb_count(sb->writers, &sb->pending, APEX_sb_writes(ins), -1);
+}
+
+/* Takes slot i out of fu, its result is no longer on the way */
+static void
+fu_remove(APEX_CPU* cpu, APEX_FUnit* fu, int i)
+{
+  APEX_Scoreboard* sb = &cpu->scoreboard;
+  sb_count(sb->fu_writers, &sb->in_fu, APEX_sb_writes(&fu->slot[i]), -1);
+
+  fu->count--;
+  memmove(&fu->slot[i], &fu->slot[i + 1], sizeof(fu->slot[0]) * (fu->count - i));
+  memmove(&fu->remaining[i], &fu->remaining[i + 1], sizeof(fu->remaining[0]) * (fu->count - i));
 }
 
 /*
- *  Fetch Stage of APEX Pipeline
+ * Drops every instruction younger than seq from the functional units
+ */
+static void
+fu_squash(APEX_CPU* cpu, int seq)
+{
+  for (int u = 0; u < NUM_FUS; ++u) {
+    APEX_FUnit* fu = &cpu->fu[u];
+    for (int i = fu->count - 1; i >= 0; --i) {
+      if (fu->slot[i].seq > seq) {
+        APEX_sb_retire(&cpu->scoreboard, &fu->slot[i]);
+        fu_remove(cpu, fu, i);
+      }
+    }
+  }
+}
+
+/*
+ * Squashes every instruction younger than the one in stage s and restarts
+ * fetch from next_pc. This is the only place the pipeline is flushed.
+ */
+static void
+flush_pipeline(APEX_CPU* cpu, int s, int next_pc)
+{
+  for (int i = DRF; i < s; ++i) {
+    if (i > DRF) {
+      APEX_sb_retire(&cpu->scoreboard, &cpu->stage[i]);
+    }
+    cpu->stage[i].opcode = OP_NOP;
+    cpu->stage[i].bubble = STALL_BRANCH;
+    cpu->stage[i].rd = -1;
+  }
+
+  fu_squash(cpu, cpu->stage[s].seq);
+
+  /* Everything fetched ahead is younger, including a fetch still waiting */
+  cpu->fetch_queue.head = 0;
+  cpu->fetch_queue.count = 0;
+  cpu->icache_stall = 0;
+
+  /* Interlocks held by the squashed instructions go with them */
+  if (s > DRF) {
+    cpu->stop_index = 0;
+    cpu->fu_stall = 0;
+  }
+  cpu->pc = next_pc;
+}
+
+/*
+ * Resolves the BZ/BNZ/JUMP in stage s, if s is the configured resolve
+ * stage. The z flag is written by ADD/SUB/MUL/DIV as they leave EX, and
+ * EX runs before DRF within a cycle, so a branch sees the flag of the
+ * youngest older producer wherever it resolves (decode holds branches
+ * while an older producer is still in a functional unit).
  *
- *  Note : You are free to edit this function according to your
- * 				 implementation
+ * The outcome is checked against the pc fetch went on with and trains
+ * the predictor, only a mispredict flushes.
  */
-int
-fetch(APEX_CPU* cpu)
+static void
+resolve_branch(APEX_CPU* cpu, int s)
 {
-  CPU_Stage* stage = &cpu->stage[F];
-    CPU_Stage* stage_MEM = &cpu->stage[MEM];
-  if (!stage->busy && !stage->stalled) {  
-    /* Store current PC in fetch latch */
-    stage->pc = cpu->pc;
+  if (s != cpu->resolve_stage) {
+    return;
+  }
 
-      
-      
-    /* Index into code memory using this pc and copy all instruction fields into
-     * fetch latch
-     */
-    APEX_Instruction* current_ins = &cpu->code_memory[get_code_index(cpu->pc)];
-    strcpy(stage->opcode, current_ins->opcode);
-    stage->rd = current_ins->rd;
-    stage->rs1 = current_ins->rs1;
-    stage->rs2 = current_ins->rs2;
-    stage->imm = current_ins->imm;
-    stage->rd = current_ins->rd;
-      
-      
-      INSTRUCT_INDEX++;
+  CPU_Stage* stage = &cpu->stage[s];
+  int target = stage->pc + stage->imm;
+  int taken = 1;
+  switch (stage->opcode) {
+    case OP_BZ:
+      taken = cpu->z_flag[0] == 1;
+      break;
 
+    case OP_BNZ:
+      taken = cpu->z_flag[0] == 0;
+      break;
 
+    case OP_JUMP:
+      target = stage->rs1_value + stage->imm;
+      break;
+  }
 
-    /* Update PC for next instruction */
-    cpu->pc += 4;
-      
-      if (strcmp(stage->opcode, "") == 0) {
-          strcpy(stage->opcode, "NOP");
-          stage->rs2 = -1;
-          stage->rs1 = -1;
+  int next_pc = taken ? target : stage->pc + 4;
+  int mispredicted = next_pc != stage->pred_pc;
+  APEX_bpred_update(&cpu->bpred, stage->pc, stage->opcode == OP_JUMP,
+                    taken, target, mispredicted);
+  if (mispredicted) {
+    flush_pipeline(cpu, s, next_pc);
+  }
+}
+
+/*
+ * Starts the instruction in stage on its functional unit. Decode has
+ * already checked the unit accepts it this cycle.
+ */
+static void
+fu_dispatch(APEX_CPU* cpu, const CPU_Stage* stage)
+{
+  APEX_FUnit* fu = &cpu->fu[opcode_info[stage->opcode].unit];
+
+  APEX_Scoreboard* sb = &cpu->scoreboard;
+  sb_count(sb->fu_writers, &sb->in_fu, APEX_sb_writes(stage), 1);
+
+  fu->slot[fu->count] = *stage;
+  fu->remaining[fu->count] = cpu->fu_latency[stage->opcode];
+  fu->count++;
+  fu->next_issue = cpu->clock + cpu->fu_ii[stage->opcode];
+}
+
+/*
+ * Advances every unit by a cycle and moves the oldest finished
+ * instruction into the EX latch, MEM takes one instruction per cycle.
+ * Finished instructions which lose out wait in their unit. When nothing
+ * finishes the latch keeps a bubble.
+ */
+static void
+fu_complete(APEX_CPU* cpu)
+{
+  CPU_Stage* stage = &cpu->stage[EX];
+  APEX_FUnit* best = NULL;
+  int best_slot = 0;
+
+  for (int u = 0; u < NUM_FUS; ++u) {
+    APEX_FUnit* fu = &cpu->fu[u];
+    for (int i = 0; i < fu->count; ++i) {
+      if (fu->remaining[i] > 0) {
+        fu->remaining[i]--;
       }
+      if (fu->remaining[i] == 0 &&
+          (!best || fu->slot[i].seq < best->slot[best_slot].seq)) {
+        best = fu;
+        best_slot = i;
+      }
+    }
+  }
 
-      if (cpu->pc >= (4000+ 4*(cpu->code_memory_size+1)) ){
-          strcpy(stage->opcode, "NOP");
-          stage->rs2 = -1;
-          stage->rs1 = -1;
+  if (!best) {
+    if (stage->opcode != OP_NOP) {
+      stage->opcode = OP_NOP;
+      stage->bubble = STALL_FU;
+      stage->rd = -1;
+    }
+    return;
+  }
+
+  *stage = best->slot[best_slot];
+  fu_remove(cpu, best, best_slot);
+
+  /* Units finish out of order, an older producer must not overwrite the
+   * flag of a younger one */
+  if (APEX_sets_z(stage->opcode) && stage->seq > cpu->z_seq) {
+    cpu->z_flag[0] = stage->buffer == 0;
+    cpu->z_seq = stage->seq;
+  }
+
+  if (stage->opcode == OP_BZ || stage->opcode == OP_BNZ || stage->opcode == OP_JUMP) {
+    resolve_branch(cpu, EX);
+  }
+}
+
+/*
+ * Returns 1 if the instruction in stage must wait in DRF: its unit will
+ * not accept it next cycle, one of its sources or its destination is
+ * still being computed by an older instruction, it is a BZ/BNZ and an
+ * older z flag producer is in flight, or it is a HALT and anything is
+ */
+static int
+fu_hazard(const APEX_CPU* cpu, const CPU_Stage* stage)
+{
+  if (stage->opcode == OP_NOP) {
+    return 0;
+  }
+
+  const APEX_FUnit* own = &cpu->fu[opcode_info[stage->opcode].unit];
+  if (own->count == FU_MAX_INFLIGHT || cpu->clock + 1 < own->next_issue) {
+    return 1;
+  }
+
+  if (stage->opcode == OP_HALT) {
+    for (int u = 0; u < NUM_FUS; ++u) {
+      if (cpu->fu[u].count != 0) {
+        return 1;
       }
+    }
+    return 0;
+  }
 
-      
-//      printf("%s\n",stage->opcode);
+  /* Sources, the destination and the z flag of BZ/BNZ against the
+   * registers units are still computing */
+  int sources = opcode_info[stage->opcode].sources;
+  uint64_t regs = 0;
+  if (sources & SRC_RS1) {
+    regs |= 1ull << stage->rs1;
+  }
+  if (sources & SRC_RS2) {
+    regs |= 1ull << stage->rs2;
+  }
+  if (stage->rd >= 0) {
+    regs |= 1ull << stage->rd;
+  }
+  if (stage->opcode == OP_BZ || stage->opcode == OP_BNZ) {
+    regs |= 1ull << SB_Z;
+  }
+  return (regs & cpu->scoreboard.in_fu) != 0;
+}
 
-      
-      
-      if (STOP_INDEX != 0 || MUL_INDEX != 0) {
-          cpu->pc -=4;
-      } else{
-          
-          /* Copy data from fetch latch to decode latch*/
-          cpu->stage[DRF] = cpu->stage[F];
+/*
+ * Reads the registers the instruction in stage names as sources. A
+ * register the scoreboard has no writer in flight for comes from the
+ * register file. Otherwise the youngest writer which has left EX or MEM
+ * supplies the value, if its result is ready there and DRF has a bypass
+ * from that stage. A writer still in a functional unit holds decode in
+ * fu_hazard.
+ *
+ * Returns 1 if a source has to wait for its writer to move on
+ */
+static int
+read_sources(APEX_CPU* cpu, CPU_Stage* stage)
+{
+  int sources = opcode_info[stage->opcode].sources;
+  int waits = 0;
+
+  for (int k = 0; k < 2; ++k) {
+    if (!(sources & (SRC_RS1 << k))) {
+      continue;
+    }
+    int reg = k ? stage->rs2 : stage->rs1;
+    int* value = k ? &stage->rs2_value : &stage->rs1_value;
+
+    *value = cpu->regs[reg];
+    if (!(cpu->scoreboard.pending >> reg & 1)) {
+      continue;
+    }
+
+    /* The latch after a stage holds what left it this cycle */
+    for (int s = EX; s <= MEM; ++s) {
+      const CPU_Stage* older = &cpu->stage[s + 1];
+      int ready = opcode_info[older->opcode].ready;
+      if (ready < 0 || older->rd != reg) {
+        continue;
       }
-      
-      //HALT change to NOP
-      if (strcmp(stage_MEM->opcode, "HALT") == 0) {
-          strcpy(stage->opcode, "NOP");
-          stage->rd=-1;
+      if (s < ready || !cpu->forward[s]) {
+        waits = 1;
+      } else {
+        *value = older->buffer;
       }
-//
-//      if (MUL_INDEX != 0) {
-//          cpu->pc -=4;
-//      }
-      
-    if (ENABLE_DEBUG_MESSAGES) {
-        if (Total_type == 2) {
-            
-            print_stage_content("Fetch", stage);
-        }
+      break;
     }
   }
-  return 0;
+  return waits;
 }
 
 /*
- *  Decode Stage of APEX Pipeline
+ *  Fetch Stage of APEX Pipeline
  *
  *  Note : You are free to edit this function according to your
  * 				 implementation
  */
 int
-decode(APEX_CPU* cpu)
+fetch(APEX_CPU* cpu)
 {
-  CPU_Stage* stage = &cpu->stage[DRF];
-    
-//    CPU_Stage* stage_F = &cpu->stage[F];
-    CPU_Stage* stage_EX = &cpu->stage[EX];
+  CPU_Stage* stage = &cpu->stage[F];
     CPU_Stage* stage_MEM = &cpu->stage[MEM];
-    CPU_Stage* stage_WB = &cpu->stage[WB];
-    
-    
-  if (!stage->busy && !stage->stalled) {
+  APEX_FetchQueue* q = &cpu->fetch_queue;
+  if (!APEX_latch_filling(stage)) {  
+    int hold = cpu->stop_index != 0 || cpu->fu_stall != 0;
+    int ready = 0;
+
+    if (cpu->icache_stall > 0) {
+      /* The line of the instruction in the fetch latch is still arriving */
+      cpu->icache_stall--;
+      ready = cpu->icache_stall == 0;
+    } else if (q->size == 0 || (q->count < q->size && cpu->pc != drain_pc(cpu))) {
+      /* Store current PC in fetch latch */
+      stage->pc = cpu->pc;
 
-      //BZ change to NOP
-      if (strcmp(stage_WB->opcode, "BZ") == 0) {
-          if (cpu->z_flag[0] != 0) {
-              strcpy(stage->opcode, "NOP");
-              stage->rd=-1;
-          }
-      }
-      
-      //BNZ change to NOP
-      if (strcmp(stage_WB->opcode, "BNZ") == 0) {
-          if (cpu->z_flag[0] == 0) {
-              strcpy(stage->opcode, "NOP");
-              stage->rd=-1;
-          }
-      }
-      
-      //JUMP change to NOP
-      if (strcmp(stage_WB->opcode, "JUMP") == 0) {
-              strcpy(stage->opcode, "NOP");
-              stage->rd=-1;
-      }
       
-      //HALT change to NOP
-      if (strcmp(stage_WB->opcode, "HALT") == 0) {
-          strcpy(stage->opcode, "NOP");
-          stage->rd=-1;
-      }
       
-      //HALT change to NOP
-      if (strcmp(stage_MEM->opcode, "HALT") == 0) {
-          strcpy(stage->opcode, "NOP");
-          stage->rd=-1;
+      /* Index into code memory using this pc and copy all instruction fields into
+       * fetch latch
+       */
+      int index = pc_to_index(cpu, cpu->pc);
+      if (index >= 0) {
+          APEX_Instruction* current_ins = &cpu->code_memory[index];
+          stage->opcode = current_ins->opcode;
+          stage->rd = current_ins->rd;
+          stage->rs1 = current_ins->rs1;
+          stage->rs2 = current_ins->rs2;
+          stage->imm = current_ins->imm;
+          stage->bubble = current_ins->opcode == OP_NOP ? STALL_NOP : STALL_NONE;
+          cpu->icache_stall = APEX_cache_access(&cpu->icache, cpu->pc, 0) - 1;
+      } else {
+          /* Past the end of code memory, feed bubbles */
+          stage->opcode = OP_NOP;
+          stage->bubble = STALL_DRAIN;
+          stage->rd = -1;
+          stage->rs2 = -1;
+          stage->rs1 = -1;
       }
       
       
-    /* Read data from register file for store */
-    if (strcmp(stage->opcode, "STORE") == 0) {
-        if (stage->rs1 == stage_EX->rd) {
-            if (strcmp(stage_EX->opcode, "LOAD") == 0) {
-                RS1_INDEX=1;
-                
-            }else{
-                
-                stage->rs1_value = stage_EX->buffer;
-                RS1_INDEX=0;
-//                stage->rs2_value = cpu->regs[stage->rs2];
-//
-//                /* Copy data from decode latch to execute latch*/
-//                cpu->stage[EX] = cpu->stage[DRF];
-//                STOP_INDEX=0;
-            }
+        cpu->instruct_index++;
+        stage->seq = cpu->instruct_index;
 
-            
-        } else if (stage->rs1 == stage_MEM->rd){
-            if (strcmp(stage_MEM->opcode, "LOAD") == 0) {
-                //
-                RS1_INDEX=1;
-//                strcpy(stage_EX->opcode, "NOP");
-//                //          stage_EX->pc = 0;
-//
-//                stage_EX->rd=-1;
-            }else{
-                
-                stage->rs1_value = stage_MEM->buffer;
-                RS1_INDEX=0;
-//                stage->rs2_value = cpu->regs[stage->rs2];
-//
-//                /* Copy data from decode latch to execute latch*/
-//                cpu->stage[EX] = cpu->stage[DRF];
-//                STOP_INDEX=0;
-            }
 
-            
-        } else if (stage->rs1 == stage_WB->rd){
-            
-            stage->rs1_value = stage_WB->buffer;
-            RS1_INDEX=0;
-//            stage->rs2_value = cpu->regs[stage->rs2];
-//
-//            /* Copy data from decode latch to execute latch*/
-//            cpu->stage[EX] = cpu->stage[DRF];
-//            STOP_INDEX=0;
-            
-        } else{
-            stage->rs1_value = cpu->regs[stage->rs1];
-            RS1_INDEX=0;
-        }
-            
-            
-        if (stage->rs2 == stage_EX->rd) {
-            if (strcmp(stage_EX->opcode, "LOAD") == 0) {
-                
-                RS2_INDEX=1;
-            }else{
-                
-                stage->rs2_value = stage_EX->buffer;
-                RS2_INDEX=0;
-            }
-            
-        } else if (stage->rs2 == stage_MEM->rd){
-            if (strcmp(stage_MEM->opcode, "LOAD") == 0) {
-                
-                RS2_INDEX=1;
-            }else{
-                RS2_INDEX=0;
-                stage->rs2_value = stage_MEM->buffer;
-            }
-            
-        } else if (stage->rs2 == stage_WB->rd){
-            
-            RS2_INDEX=0;
-            stage->rs2_value = stage_WB->buffer;
-            
-        }else{
-            RS2_INDEX=0;
-            stage->rs2_value = cpu->regs[stage->rs2];
-        }
-        
-        if (RS1_INDEX == 0 && RS2_INDEX == 0) {
-            STOP_INDEX=0;
-        }else{
-            STOP_INDEX=1;
-        }
-        
-        
-        if (STOP_INDEX != 0) {
-            strcpy(stage_EX->opcode, "NOP");
-            //          stage_EX->pc = 0;
-            
-            stage_EX->rd=-1;
-        }
-        else if (MUL_INDEX != 0){
-            
-        }
-        else {
-            
-            /* Copy data from decode latch to execute latch*/
-            cpu->stage[EX] = cpu->stage[DRF];
-        }
-        
-    }
 
-      /* Read data from register file for load */
-      if (strcmp(stage->opcode, "LOAD") == 0) {
-          if (stage->rs1 == stage_EX->rd) {
-              if (strcmp(stage_EX->opcode, "LOAD") != 0) {
-                  RS1_INDEX=1;
-              }else{
-                  
-                  stage->rs1_value = stage_EX->buffer;
-                  
-                  RS1_INDEX=0;
-              }
-              
-          } else if (stage->rs1 == stage_MEM->rd){
-              if (strcmp(stage_MEM->opcode, "LOAD") == 0) {
-                  RS1_INDEX=1;
-              }else{
-                  
-                  stage->rs1_value = stage_MEM->buffer;
-                  RS1_INDEX=0;
-              }
-                  
-          } else if (stage->rs1 == stage_WB->rd){
-              
-              stage->rs1_value = stage_WB->buffer;
-              
-              RS1_INDEX=0;
-
-          }else{
-              stage->rs1_value = cpu->regs[stage->rs1];
-              RS1_INDEX=0;
-          }
-          
-          if (RS1_INDEX == 0) {
-              STOP_INDEX=0;
-          }else{
-              STOP_INDEX=1;
-          }
-          
-          if (STOP_INDEX != 0) {
-              strcpy(stage_EX->opcode, "NOP");
-              stage_EX->rd=-1;
-              
-          }
-          else if (MUL_INDEX != 0){
-              
-          } else {
-              /* Copy data from decode latch to execute latch*/
-              cpu->stage[EX] = cpu->stage[DRF];          }
-      }
-      
-    /* No Register file read needed for MOVC */
-    if (strcmp(stage->opcode, "MOVC") == 0) {
-        //no instruction needed for movc
-        
-        if (MUL_INDEX == 0){
-            /* Copy data from decode latch to execute latch*/
-            cpu->stage[EX] = cpu->stage[DRF];
-        }
+      /* Update PC for next instruction, as predicted */
+      stage->pred_pc = APEX_bpred_predict(&cpu->bpred, cpu->pc);
+      cpu->pc = stage->pred_pc;
+      ready = cpu->icache_stall == 0;
+    } else {
+      /* The fetch queue is full, or fetch has run past the end of code */
+      stage->opcode = OP_NOP;
+      stage->bubble = q->count < q->size ? STALL_DRAIN : cpu->fu_stall ? STALL_FU : STALL_LOAD_USE;
+      stage->rd = -1;
+      stage->rs1 = -1;
+      stage->rs2 = -1;
     }
-      
-      /* No Register file read needed for ADD */
-      if (strcmp(stage->opcode, "ADD") == 0) {
-          if (stage->rs1 == stage_EX->rd) {
-              if (strcmp(stage_EX->opcode, "LOAD") == 0) {
-                  RS1_INDEX=1;
-                  
-              }else{
-                  
-                  stage->rs1_value = stage_EX->buffer;
-                  RS1_INDEX=0;
-              }
-              
-          } else if (stage->rs1 == stage_MEM->rd){
-              if (strcmp(stage_MEM->opcode, "LOAD") == 0) {
-                  RS1_INDEX=1;
-                  
-              }else{
-                  
-                  stage->rs1_value = stage_MEM->buffer;
-                  RS1_INDEX=0;
-              }
-              
-          } else if (stage->rs1 == stage_WB->rd){
-              
-              stage->rs1_value = stage_WB->buffer;
-              RS1_INDEX=0;
-              
-          } else{
-              stage->rs1_value = cpu->regs[stage->rs1];
-              RS1_INDEX=0;
-              
-          }
-          
-          if (stage->rs2 == stage_EX->rd) {
-              if (strcmp(stage_EX->opcode, "LOAD") == 0) {
-                  
-                  RS2_INDEX=1;
-              }else{
-                  
-                  stage->rs2_value = stage_EX->buffer;
-                  RS2_INDEX=0;
-                  
-              }
-              
-          } else if (stage->rs2 == stage_MEM->rd){
-              if (strcmp(stage_MEM->opcode, "LOAD") == 0) {
-                  
-                  RS2_INDEX=1;
-              }else{
-                  
-                  stage->rs2_value = stage_MEM->buffer;
-                  RS2_INDEX=0;
-              }
-              
-          } else if (stage->rs2 == stage_WB->rd){
-              
-              stage->rs2_value = stage_WB->buffer;
-              RS2_INDEX=0;
-              
-          } else{
-              stage->rs2_value = cpu->regs[stage->rs2];
-              RS2_INDEX=0;
-          }
-          
-          if (RS1_INDEX == 0 && RS2_INDEX == 0) {
-              STOP_INDEX=0;
-          }else{
-              STOP_INDEX=1;
-          }
-          
-          
-          if (STOP_INDEX != 0) {
-              strcpy(stage_EX->opcode, "NOP");
-              //          stage_EX->pc = 0;
-              
-              stage_EX->rd=-1;
-          }
-          else if(MUL_INDEX != 0){
-              
-          } else {
-              
-              /* Copy data from decode latch to execute latch*/
-              cpu->stage[EX] = cpu->stage[DRF];
-          }
-      }
-      
-      /* No Register file read needed for SUB */
-      if (strcmp(stage->opcode, "SUB") == 0) {
-          if (stage->rs1 == stage_EX->rd) {
-              if (strcmp(stage_EX->opcode, "LOAD") == 0) {
-                  RS1_INDEX=1;
-                  
-              }else{
-                  
-                  stage->rs1_value = stage_EX->buffer;
-                  RS1_INDEX=0;
-              }
-              
-          } else if (stage->rs1 == stage_MEM->rd){
-              if (strcmp(stage_MEM->opcode, "LOAD") == 0) {
-                  RS1_INDEX=1;
-                  
-              }else{
-                  
-                  stage->rs1_value = stage_MEM->buffer;
-                  RS1_INDEX=0;
-              }
-              
-          } else if (stage->rs1 == stage_WB->rd){
-              
-              stage->rs1_value = stage_WB->buffer;
-              RS1_INDEX=0;
-          }else{
-              stage->rs1_value = cpu->regs[stage->rs1];
-              RS1_INDEX=0;
-              
-          }
-          
-          if (stage->rs2 == stage_EX->rd) {
-              if (strcmp(stage_EX->opcode, "LOAD") == 0) {
-                  
-                  RS2_INDEX=1;
-              }else{
-                  
-                  stage->rs2_value = stage_EX->buffer;
-                  RS2_INDEX=0;
-                  
-              }
-              
-          } else if (stage->rs2 == stage_MEM->rd){
-              if (strcmp(stage_MEM->opcode, "LOAD") == 0) {
-                  
-                  RS2_INDEX=1;
-              }else{
-                  
-                  stage->rs2_value = stage_MEM->buffer;
-                  RS2_INDEX=0;
-                  
-              }
-              
-          } else if (stage->rs2 == stage_WB->rd){
-              stage->rs2_value = stage_WB->buffer;
-              RS2_INDEX=0;
-              
-          }else{
-              stage->rs2_value = cpu->regs[stage->rs2];
-              RS2_INDEX=0;
-          }
-          
-          if (RS1_INDEX == 0 && RS2_INDEX == 0) {
-              STOP_INDEX=0;
-          }else{
-              STOP_INDEX=1;
-          }
-          
-          
-          if (STOP_INDEX != 0) {
-              strcpy(stage_EX->opcode, "NOP");
-              //          stage_EX->pc = 0;
-              
-              stage_EX->rd=-1;
-          }
-          else if (MUL_INDEX != 0){
-              
-          } else {
-            
-              /* Copy data from decode latch to execute latch*/
-              cpu->stage[EX] = cpu->stage[DRF];
-          }
-      }
-      
-      /* Read data from register file for AND */
-      if (strcmp(stage->opcode, "AND") == 0) {
-          if (stage->rs1 == stage_EX->rd) {
-              if (strcmp(stage_EX->opcode, "LOAD") == 0) {
-                  RS1_INDEX=1;
-                  
-              }else{
-                  
-                  stage->rs1_value = stage_EX->buffer;
-                  RS1_INDEX=0;
-              }
-              
-          } else if (stage->rs1 == stage_MEM->rd){
-              if (strcmp(stage_MEM->opcode, "LOAD") == 0) {
-                  RS1_INDEX=1;
-                  
-              }else{
-                  
-                  stage->rs1_value = stage_MEM->buffer;
-                  RS1_INDEX=0;
-              }
-              
-          } else if (stage->rs1 == stage_WB->rd){
-              stage->rs1_value = stage_WB->buffer;
-              RS1_INDEX=0;
-              
-          }else{
-              stage->rs1_value = cpu->regs[stage->rs1];
-              RS1_INDEX=0;
-          }
-          
-          if (stage->rs2 == stage_EX->rd) {
-              if (strcmp(stage_EX->opcode, "LOAD") == 0) {
-                  
-                  RS2_INDEX=1;
-              }else{
-                  
-                  stage->rs2_value = stage_EX->buffer;
-                  RS2_INDEX=0;
-              }
-              
-          } else if (stage->rs2 == stage_MEM->rd){
-              if (strcmp(stage_MEM->opcode, "LOAD") == 0) {
-                  
-                  RS2_INDEX=1;
-              }else{
-                  
-                  stage->rs2_value = stage_MEM->buffer;
-                  RS2_INDEX=0;
-              }
-              
-          } else if (stage->rs2 == stage_WB->rd){
-              stage->rs2_value = stage_WB->buffer;
-              RS2_INDEX=0;
-              
-          }else{
-              stage->rs2_value = cpu->regs[stage->rs2];
-              RS2_INDEX=0;
-          }
-          
-          if (RS1_INDEX == 0 && RS2_INDEX == 0) {
-              STOP_INDEX=0;
-          }else{
-              STOP_INDEX=1;
-          }
-          
-          
-          if (STOP_INDEX != 0) {
-              strcpy(stage_EX->opcode, "NOP");
-              //          stage_EX->pc = 0;
-              
-              stage_EX->rd=-1;
-          }
-          else if (MUL_INDEX != 0){
-              
-          } else {
-              
-              /* Copy data from decode latch to execute latch*/
-              cpu->stage[EX] = cpu->stage[DRF];
-          }
-      }
-      
-      /* Read data from register file for OR */
-      if (strcmp(stage->opcode, "OR") == 0) {
-          if (stage->rs1 == stage_EX->rd) {
-              if (strcmp(stage_EX->opcode, "LOAD") == 0) {
-                  RS1_INDEX=1;
-                  
-              }else{
-                  
-                  stage->rs1_value = stage_EX->buffer;
-                  RS1_INDEX=0;
-              }
-              
-          } else if (stage->rs1 == stage_MEM->rd){
-              if (strcmp(stage_MEM->opcode, "LOAD") == 0) {
-                  RS1_INDEX=1;
-                  
-              }else{
-                  
-                  stage->rs1_value = stage_MEM->buffer;
-                  RS1_INDEX=0;
-              }
-              
-          } else if (stage->rs1 == stage_WB->rd){
-              stage->rs1_value = stage_WB->buffer;
-              RS1_INDEX=0;
-              
-          } else{
-              stage->rs1_value = cpu->regs[stage->rs1];
-              RS1_INDEX=0;
-          }
-          
-          if (stage->rs2 == stage_EX->rd) {
-              if (strcmp(stage_EX->opcode, "LOAD") == 0) {
-                  
-                  RS2_INDEX=1;
-              }else{
-                  
-                  stage->rs2_value = stage_EX->buffer;
-                  RS2_INDEX=0;
-              }
-              stage_EX->rd=-1;
-              
-          } else if (stage->rs2 == stage_MEM->rd){
-              if (strcmp(stage_MEM->opcode, "LOAD") == 0) {
-                  
-                  RS2_INDEX=1;
-              }else{
-                  
-                  stage->rs2_value = stage_MEM->buffer;
-                  RS2_INDEX=0;
-              }
-              
-          } else if (stage->rs2 == stage_WB->rd){
-              stage->rs2_value = stage_WB->buffer;
-              RS2_INDEX=0;
-              
-          }else{
-              stage->rs2_value = cpu->regs[stage->rs2];
-              RS2_INDEX=0;
-          }
-          
-          if (RS1_INDEX == 0 && RS2_INDEX == 0) {
-              STOP_INDEX=0;
-          }else{
-              STOP_INDEX=1;
-          }
-          
-          
-          if (STOP_INDEX != 0) {
-              strcpy(stage_EX->opcode, "NOP");
-              //          stage_EX->pc = 0;
-              
-              stage_EX->rd=-1;
-          }
-          else if (MUL_INDEX != 0){
-              
-          } else {
-              
-              /* Copy data from decode latch to execute latch*/
-              cpu->stage[EX] = cpu->stage[DRF];
-          }
-      }
-      
-      /* Read data from register file for EX-OR */
-      if (strcmp(stage->opcode, "EX-OR") == 0) {
-          if (stage->rs1 == stage_EX->rd) {
-              if (strcmp(stage_EX->opcode, "LOAD") == 0) {
-                  RS1_INDEX=1;
-                  
-              }else{
-                  
-                  stage->rs1_value = stage_EX->buffer;
-                  RS1_INDEX=0;
-              }
-              
-          } else if (stage->rs1 == stage_MEM->rd){
-              if (strcmp(stage_MEM->opcode, "LOAD") == 0) {
-                  RS1_INDEX=1;
-                  
-              }else{
-                  
-                  stage->rs1_value = stage_MEM->buffer;
-                  RS1_INDEX=0;
-              }
-              
-          } else if (stage->rs1 == stage_WB->rd){
-              stage->rs1_value = stage_WB->buffer;
-              RS1_INDEX=0;
-              
-          } else{
-              stage->rs1_value = cpu->regs[stage->rs1];
-              RS1_INDEX=0;
-              
-          }
-          
-          if (stage->rs2 == stage_EX->rd) {
-              if (strcmp(stage_EX->opcode, "LOAD") == 0) {
-                  
-                  RS2_INDEX=1;
-              }else{
-                  
-                  stage->rs2_value = stage_EX->buffer;
-                  RS2_INDEX=0;
-              }
-              
-          } else if (stage->rs2 == stage_MEM->rd){
-              if (strcmp(stage_MEM->opcode, "LOAD") == 0) {
-                  
-                  RS2_INDEX=1;
-              }else{
-                  
-                  stage->rs2_value = stage_MEM->buffer;
-                  RS2_INDEX=0;
-              }
-              
-          } else if (stage->rs2 == stage_WB->rd){
-              
-              stage->rs2_value = stage_WB->buffer;
-              RS2_INDEX=0;
-              
-          }else{
-              stage->rs2_value = cpu->regs[stage->rs2];
-              RS2_INDEX=0;
-          }
-          
-          if (RS1_INDEX == 0 && RS2_INDEX == 0) {
-              STOP_INDEX=0;
-          }else{
-              STOP_INDEX=1;
-          }
-          
-          
-          if (STOP_INDEX != 0) {
-              strcpy(stage_EX->opcode, "NOP");
-              //          stage_EX->pc = 0;
-              
-              stage_EX->rd=-1;
-          }
-          else if (MUL_INDEX != 0){
-              
+
+      if (q->size == 0) {
+          if (hold) {
+              /* Decode keeps its instruction, fetch this one again */
+              if (ready) {
+                  cpu->pc = stage->pc;
+                  cpu->icache_stall = 0;
+              }
+          } else if (ready) {
+              /* Copy data from fetch latch to decode latch*/
+              cpu->stage[DRF] = cpu->stage[F];
           } else {
-              
-              /* Copy data from decode latch to execute latch*/
-              cpu->stage[EX] = cpu->stage[DRF];
+              cpu->stage[DRF].opcode = OP_NOP;
+              cpu->stage[DRF].bubble = STALL_ICACHE;
+              cpu->stage[DRF].rd = -1;
+              cpu->stage[DRF].rs1 = -1;
+              cpu->stage[DRF].rs2 = -1;
           }
-      }
-      
-      /* No Register file read needed for MUL */
-      if (strcmp(stage->opcode, "MUL") == 0) {
-          if (stage->rs1 == stage_EX->rd) {
-              if (strcmp(stage_EX->opcode, "LOAD") == 0) {
-                  RS1_INDEX=1;
-                  
-              }else{
-                  
-                  stage->rs1_value = stage_EX->buffer;
-                  RS1_INDEX=0;
-              }
-              
-          } else if (stage->rs1 == stage_MEM->rd){
-              if (strcmp(stage_MEM->opcode, "LOAD") == 0) {
-                  RS1_INDEX=1;
-                  
-              }else{
-                  
-                  stage->rs1_value = stage_MEM->buffer;
-                  RS1_INDEX=0;
-              }
-              
-          } else if (stage->rs1 == stage_WB->rd){
-              stage->rs1_value = stage_WB->buffer;
-              RS1_INDEX=0;
-              
-          } else{
-              stage->rs1_value = cpu->regs[stage->rs1];
-              RS1_INDEX=0;
-              
+      } else {
+          /* Fetch runs ahead of decode through the queue */
+          if (ready) {
+              q->slot[(q->head + q->count) % q->size] = *stage;
+              q->count++;
           }
-          
-          if (stage->rs2 == stage_EX->rd) {
-              if (strcmp(stage_EX->opcode, "LOAD") == 0) {
-                  
-                  RS2_INDEX=1;
-              }else{
-                  
-                  stage->rs2_value = stage_EX->buffer;
-                  RS2_INDEX=0;
+          if (!hold) {
+              if (q->count > 0) {
+                  cpu->stage[DRF] = q->slot[q->head];
+                  q->head = (q->head + 1) % q->size;
+                  q->count--;
+              } else {
+                  cpu->stage[DRF].opcode = OP_NOP;
+                  cpu->stage[DRF].bubble = cpu->icache_stall ? STALL_ICACHE : STALL_DRAIN;
+                  cpu->stage[DRF].rd = -1;
+                  cpu->stage[DRF].rs1 = -1;
+                  cpu->stage[DRF].rs2 = -1;
               }
-              
-          } else if (stage->rs2 == stage_MEM->rd){
-              if (strcmp(stage_MEM->opcode, "LOAD") == 0) {
-                  
-                  RS2_INDEX=1;
-              }else{
-                  
-                  stage->rs2_value = stage_MEM->buffer;
-                  RS2_INDEX=0;
-              }
-              
-          } else if (stage->rs2 == stage_WB->rd){
-              
-              stage->rs2_value = stage_WB->buffer;
-              RS2_INDEX=0;
-              
-          }else{
-              stage->rs2_value = cpu->regs[stage->rs2];
-              RS2_INDEX=0;
-          }
-          
-          if (RS1_INDEX == 0 && RS2_INDEX == 0) {
-              STOP_INDEX=0;
-          }else{
-              STOP_INDEX=1;
-          }
-          
-          
-          if (STOP_INDEX != 0) {
-              strcpy(stage_EX->opcode, "NOP");
-              //          stage_EX->pc = 0;
-              
-              stage_EX->rd=-1;
-          }
-          else if (MUL_INDEX != 0){
-              
-          } else {
-              
-              /* Copy data from decode latch to execute latch*/
-              cpu->stage[EX] = cpu->stage[DRF];
           }
       }
       
-      /* Read data from register file for BZ */
-      if (strcmp(stage->opcode, "BZ") == 0) {
-          
-              /* Copy data from decode latch to execute latch*/
-              cpu->stage[EX] = cpu->stage[DRF];
-          
+      //HALT change to NOP
+      if (stage_MEM->opcode == OP_HALT) {
+          stage->opcode = OP_NOP;
+          stage->bubble = STALL_DRAIN;
+          stage->rd=-1;
       }
+//
+//      if (cpu->fu_stall != 0) {
+//          cpu->pc -=4;
+//      }
       
-      /* Read data from register file for BNZ */
-      if (strcmp(stage->opcode, "BNZ") == 0) {
-          
-          
-              /* Copy data from decode latch to execute latch*/
-              cpu->stage[EX] = cpu->stage[DRF];
-          
+    if (ENABLE_DEBUG_MESSAGES) {
+        if (cpu->trace) {
+            APEX_trace_append(cpu->trace, cpu->clock + 1, F, stage);
+        } else if (cpu->mode == MODE_DISPLAY) {
+            
+            print_stage_content(cpu->out, "Fetch", stage);
+        }
+    }
+  }
+  return 0;
+}
+
+/*
+ *  Decode Stage of APEX Pipeline
+ *
+ *  Note : You are free to edit this function according to your
+ * 				 implementation
+ */
+int
+decode(APEX_CPU* cpu)
+{
+  CPU_Stage* stage = &cpu->stage[DRF];
+    
+//    CPU_Stage* stage_F = &cpu->stage[F];
+    CPU_Stage* stage_EX = &cpu->stage[EX];
+    CPU_Stage* stage_MEM = &cpu->stage[MEM];
+    CPU_Stage* stage_WB = &cpu->stage[WB];
+    
+    
+  if (!APEX_latch_filling(stage)) {
+
+      //HALT change to NOP
+      if (stage_WB->opcode == OP_HALT) {
+          stage->opcode = OP_NOP;
+          stage->bubble = STALL_DRAIN;
+          stage->rd=-1;
       }
       
-      /* Read data from register file for JUMP */
-      if (strcmp(stage->opcode, "JUMP") == 0) {
-         stage->rs1_value=cpu->regs[stage->rs1]; 
-              /* Copy data from decode latch to execute latch*/
-              cpu->stage[EX] = cpu->stage[DRF];
-          
+      //HALT change to NOP
+      if (stage_MEM->opcode == OP_HALT) {
+          stage->opcode = OP_NOP;
+          stage->bubble = STALL_DRAIN;
+          stage->rd=-1;
       }
-      
-      /* No Register file read needed for HALT */
-      if (strcmp(stage->opcode, "HALT") == 0) {
-          //no instruction needed for nop
 
-              /* Copy data from decode latch to execute latch*/
-              cpu->stage[EX] = cpu->stage[DRF];
+      /* Wait while the functional units cannot take the instruction */
+      cpu->fu_stall = fu_hazard(cpu, stage);
+      if (cpu->fu_stall != 0) {
+          stage_EX->opcode = OP_NOP;
+          stage_EX->bubble = STALL_FU;
+          stage_EX->rd=-1;
       }
       
-      /* No Register file read needed for NOP */
-      if (strcmp(stage->opcode, "NOP") == 0) {
-          //no instruction needed for nop
-          
-//          printf("%d \n",MUL_INDEX);
-          if (MUL_INDEX == 0){
-              /* Copy data from decode latch to execute latch*/
-              cpu->stage[EX] = cpu->stage[DRF];
-          }
+      /* Read the sources, through the bypasses where they have a path */
+      cpu->stop_index = read_sources(cpu, stage);
 
+      if (cpu->stop_index != 0) {
+          stage_EX->opcode = OP_NOP;
+          stage_EX->bubble = STALL_LOAD_USE;
+          stage_EX->rd=-1;
+      } else if (cpu->fu_stall == 0) {
+          if (stage->opcode == OP_BZ || stage->opcode == OP_BNZ || stage->opcode == OP_JUMP) {
+              resolve_branch(cpu, DRF);
+          }
+          APEX_sb_issue(&cpu->scoreboard, stage);
+          /* Copy data from decode latch to execute latch*/
+          cpu->stage[EX] = cpu->stage[DRF];
       }
 
     if (ENABLE_DEBUG_MESSAGES) {
-        if (Total_type == 2) {
-            print_stage_content("Decode/RF", stage);
+        if (cpu->trace) {
+            APEX_trace_append(cpu->trace, cpu->clock + 1, DRF, stage);
+        } else if (cpu->mode == MODE_DISPLAY) {
+            print_stage_content(cpu->out, "Decode/RF", stage);
         }
       
     }
@@ -1159,190 +837,124 @@ execute(APEX_CPU* cpu)
   CPU_Stage* stage = &cpu->stage[EX];
 //    CPU_Stage* stage_F = &cpu->stage[F];
 //    CPU_Stage* stage_DRF = &cpu->stage[DRF];
-    CPU_Stage* stage_MEM = &cpu->stage[MEM];
     CPU_Stage* stage_WB = &cpu->stage[WB];
     
-  if (!stage->busy && !stage->stalled) {
+  if (!APEX_latch_filling(stage)) {
 
-      //BZ change to NOP
-      if (strcmp(stage_WB->opcode, "BZ") == 0) {
-          if (cpu->z_flag[0] != 0) {
-              strcpy(stage->opcode, "NOP");
-              stage->rd=-1;
-          }
-      }
-      
-      //BNZ change to NOP
-      if (strcmp(stage_WB->opcode, "BNZ") == 0) {
-          if (cpu->z_flag[0] == 0) {
-              strcpy(stage->opcode, "NOP");
-              stage->rd=-1;
-          }
-      }
-      
-      //JUMP change to NOP
-      if (strcmp(stage_WB->opcode, "JUMP") == 0) {
-              strcpy(stage->opcode, "NOP");
-              stage->rd=-1;
-      }
-      
       //HALT change to NOP
-      if (strcmp(stage_WB->opcode, "HALT") == 0) {
-          strcpy(stage->opcode, "NOP");
+      if (stage_WB->opcode == OP_HALT) {
+          APEX_sb_retire(&cpu->scoreboard, stage);
+          stage->opcode = OP_NOP;
+          stage->bubble = STALL_DRAIN;
           stage->rd=-1;
       }
       
+    switch (stage->opcode) {
     /* Store */
-    if (strcmp(stage->opcode, "STORE") == 0) {
+    case OP_STORE: {
         stage->buffer = stage->rs2_value + stage->imm;
-        
-        /* Copy data from Execute latch to Memory latch*/
-        cpu->stage[MEM] = cpu->stage[EX];
+        break;
     }
 
     /* MOVC */
-    if (strcmp(stage->opcode, "MOVC") == 0) {
+    case OP_MOVC: {
         stage->buffer = stage->imm + 0;
-        
-        /* Copy data from Execute latch to Memory latch*/
-        cpu->stage[MEM] = cpu->stage[EX];
+        break;
     }
       
       /* LOAD  */
-      if (strcmp(stage->opcode, "LOAD") == 0) {
+      case OP_LOAD: {
           stage->buffer = stage->rs1_value + stage->imm;
-          
-          /* Copy data from Execute latch to Memory latch*/
-          cpu->stage[MEM] = cpu->stage[EX];
+          break;
       }
       
       /* ADD  */
-      if (strcmp(stage->opcode, "ADD") == 0) {
+      case OP_ADD: {
           stage->buffer = stage->rs1_value + stage->rs2_value;
-          
-          //z_flag
-          if (stage->buffer == 0) {
-              cpu->z_flag[0] = 1;
-          } else{
-              cpu->z_flag[0] = 0;
-          }
-          
-          /* Copy data from Execute latch to Memory latch*/
-          cpu->stage[MEM] = cpu->stage[EX];
+          break;
       }
       
       /* SUB  */
-      if (strcmp(stage->opcode, "SUB") == 0) {
+      case OP_SUB: {
           stage->buffer = stage->rs1_value - stage->rs2_value;
-          
-          //z_flag
-          if (stage->buffer == 0) {
-              cpu->z_flag[0] = 1;
-          } else{
-              cpu->z_flag[0] = 0;
-          }
-          
-          /* Copy data from Execute latch to Memory latch*/
-          cpu->stage[MEM] = cpu->stage[EX];
+          break;
       }
       
       /* AND  */
-      if (strcmp(stage->opcode, "AND") == 0) {
+      case OP_AND: {
           stage->buffer = stage->rs1_value & stage->rs2_value;
-          
-          /* Copy data from Execute latch to Memory latch*/
-          cpu->stage[MEM] = cpu->stage[EX];
+          break;
       }
       
       /* OR  */
-      if (strcmp(stage->opcode, "OR") == 0) {
+      case OP_OR: {
           stage->buffer = stage->rs1_value | stage->rs2_value;
-          
-          /* Copy data from Execute latch to Memory latch*/
-          cpu->stage[MEM] = cpu->stage[EX];
+          break;
       }
       
       /* EX-OR  */
-      if (strcmp(stage->opcode, "EX-OR") == 0) {
+      case OP_EXOR: {
           stage->buffer = stage->rs1_value ^ stage->rs2_value;
-          
-          /* Copy data from Execute latch to Memory latch*/
-          cpu->stage[MEM] = cpu->stage[EX];
+          break;
       }
       
       /* MUL  */
-      if (strcmp(stage->opcode, "MUL") == 0) {
-//        printf("%d \n",MUL_INDEX);
-          if (MUL_INDEX == 0) {
-
-              
-              cpu->stage[DRF] = cpu->stage[F];
-//              STOP_INDEX=1;
-              strcpy(stage_MEM->opcode, "NOP");
-              stage_MEM->rd=0;
-              MUL_INDEX = 1;
-          } else {
-//              STOP_INDEX=0;
-              stage->buffer = stage->rs1_value * stage->rs2_value;
-              MUL_INDEX = 0;
-              
-              //z_flag
-              if (stage->buffer == 0) {
-                  cpu->z_flag[0] = 1;
-              } else{
-                  cpu->z_flag[0] = 0;
-              }
-              
-              /* Copy data from Execute latch to Memory latch*/
-              cpu->stage[MEM] = cpu->stage[EX];
-          }
-
-         
-//          stage->buffer = stage->rs1_value * stage->rs2_value;
+      case OP_MUL: {
+          stage->buffer = stage->rs1_value * stage->rs2_value;
+          break;
+      }
+      
+      /* DIV  */
+      case OP_DIV: {
+          stage->buffer = APEX_divide(stage->rs1_value, stage->rs2_value);
+          break;
       }
       
       /* BZ  */
-      if (strcmp(stage->opcode, "BZ") == 0) {
+      case OP_BZ: {
           stage->buffer = stage->pc + stage->imm;
-          
-          
-          /* Copy data from Execute latch to Memory latch*/
-          cpu->stage[MEM] = cpu->stage[EX];
+          break;
       }
       
       /* BNZ  */
-      if (strcmp(stage->opcode, "BNZ") == 0) {
+      case OP_BNZ: {
           stage->buffer = stage->pc + stage->imm;
-          
-          
-          /* Copy data from Execute latch to Memory latch*/
-          cpu->stage[MEM] = cpu->stage[EX];
+          break;
       }
       
       /* JUMP  */
-      if (strcmp(stage->opcode, "JUMP") == 0) {
+      case OP_JUMP: {
           stage->buffer = stage->rs1_value + stage->imm;
-          
-          /* Copy data from Execute latch to Memory latch*/
-          cpu->stage[MEM] = cpu->stage[EX];
+          break;
       }
       
       
       /* No Register file read needed for HALT */
-      if (strcmp(stage->opcode, "HALT") == 0) {
+      case OP_HALT: {
           //no instruction needed for nop
-          
-          /* Copy data from Execute latch to Memory latch*/
-          cpu->stage[MEM] = cpu->stage[EX];
+          break;
       }
       
       /* No Register file read needed for NOP */
-      if (strcmp(stage->opcode, "NOP") == 0) {
+      case OP_NOP: {
           //no instruction needed for nop
-          
-          /* Copy data from Execute latch to Memory latch*/
-          cpu->stage[MEM] = cpu->stage[EX];
+          break;
       }
+    }
+
+    /* The result is computed on entry, the unit holds it for the
+     * opcode's latency. Whatever leaves EX this cycle replaces the latch,
+     * so forwarding in decode sees it. The display shows what entered,
+     * or what left when nothing did. */
+    CPU_Stage issued = *stage;
+    if (stage->opcode != OP_NOP) {
+        fu_dispatch(cpu, stage);
+    }
+    fu_complete(cpu);
+    CPU_Stage* shown = issued.opcode != OP_NOP ? &issued : stage;
+
+    /* Copy data from Execute latch to Memory latch*/
+    cpu->stage[MEM] = cpu->stage[EX];
       
 //      if (cpu->ins_completed == (cpu->code_memory_size-2)) {
 //          strcpy(stage->opcode,"NOP");
@@ -1350,8 +962,10 @@ execute(APEX_CPU* cpu)
 
 
     if (ENABLE_DEBUG_MESSAGES) {
-        if (Total_type == 2) {
-            print_stage_content("Execute", stage);
+        if (cpu->trace) {
+            APEX_trace_append(cpu->trace, cpu->clock + 1, EX, shown);
+        } else if (cpu->mode == MODE_DISPLAY) {
+            print_stage_content(cpu->out, "Execute", shown);
         }
       
     }
@@ -1370,139 +984,132 @@ memory(APEX_CPU* cpu)
 {
   CPU_Stage* stage = &cpu->stage[MEM];
     
-    CPU_Stage* stage_DRF = &cpu->stage[DRF];
-    CPU_Stage* stage_EX = &cpu->stage[EX];
-    
-  if (!stage->busy && !stage->stalled) {
+  if (!APEX_latch_filling(stage)) {
+
+    /* A LOAD or STORE holds MEM until the D-cache answers, the access
+     * itself is made on the first of those cycles */
+    int waiting = cpu->mem_stall > 0;
+    if (waiting) {
+        cpu->mem_stall--;
+    } else if (stage->opcode == OP_LOAD || stage->opcode == OP_STORE) {
+        if (!APEX_dmem_in_range(&cpu->data_memory, stage->buffer)) {
+            APEX_cpu_trap(cpu, stage, stage->buffer);
+            return 0;
+        }
+        /* data_memory words are 4 bytes */
+        cpu->mem_stall = APEX_cache_access(&cpu->dcache, stage->buffer * 4,
+                                           stage->opcode == OP_STORE) - 1;
+    }
 
+    switch (waiting ? OP_NOP : stage->opcode) {
     /* Store */
-    if (strcmp(stage->opcode, "STORE") == 0) {
+    case OP_STORE: {
         stage->mem_address = stage->buffer;
-        cpu->data_memory[stage->mem_address] = stage->rs1_value;
+        if (APEX_dmem_write(&cpu->data_memory, stage->mem_address, stage->rs1_value) != 0) {
+            APEX_cpu_fault(cpu, stage);
+            return 0;
+        }
+        break;
     }
       
       /* LOAD */
-      if (strcmp(stage->opcode, "LOAD") == 0) {
+      case OP_LOAD: {
           stage->mem_address = stage->buffer;
-          stage->rs2_value = cpu->data_memory[stage->mem_address];
+          stage->rs2_value = APEX_dmem_read(&cpu->data_memory, stage->mem_address);
           stage->buffer=stage->rs2_value;
+          break;
       }
 
     /* MOVC */
-    if (strcmp(stage->opcode, "MOVC") == 0) {
+    case OP_MOVC: {
         //no instructions in memory
+        break;
     }
       
       /* ADD */
-      if (strcmp(stage->opcode, "ADD") == 0) {
+      case OP_ADD: {
           //no instructions in memory
           
+          break;
       }
       
       /* SUB */
-      if (strcmp(stage->opcode, "SUB") == 0) {
+      case OP_SUB: {
           //no instructions in memory
           
+          break;
       }
 
       /* AND */
-      if (strcmp(stage->opcode, "AND") == 0) {
+      case OP_AND: {
           //no instructions in memory
           
+          break;
       }
       
       /* OR */
-      if (strcmp(stage->opcode, "OR") == 0) {
+      case OP_OR: {
           //no instructions in memory
           
+          break;
       }
       
       /* EX-OR */
-      if (strcmp(stage->opcode, "EX-OR") == 0) {
+      case OP_EXOR: {
           //no instructions in memory
           
+          break;
       }
       
       /* MUL */
-      if (strcmp(stage->opcode, "MUL") == 0) {
+      case OP_MUL:
+      case OP_DIV: {
           //no instructions in memory
           
+          break;
       }
       
       /* BZ */
-      if (strcmp(stage->opcode, "BZ") == 0) {
-          //no instructions in memory
-          if (cpu->z_flag[0] == 1) {
-              MUL_INDEX =0;
-              STOP_INDEX=0;
-              
-              strcpy(stage_EX->opcode, "NOP");
-              //          stage_EX->pc = 0;
-              
-              stage_EX->rd=-1;
-              
-              strcpy(stage_DRF->opcode, "NOP");
-              //          stage_DRF->pc = 0;
-              stage_DRF->rd=-1;
-              
-              cpu->pc = stage->buffer;
-          }
-        
-
+      case OP_BZ: {
+          resolve_branch(cpu, MEM);
+          break;
       }
       
       /* BNZ */
-      if (strcmp(stage->opcode, "BNZ") == 0) {
-          //no instructions in memory
-          if (cpu->z_flag[0] == 0) {
-              MUL_INDEX =0;
-              STOP_INDEX=0;
-              
-              strcpy(stage_EX->opcode, "NOP");
-              //          stage_EX->pc = 0;
-              
-              stage_EX->rd=-1;
-              
-              strcpy(stage_DRF->opcode, "NOP");
-              //          stage_DRF->pc = 0;
-              stage_DRF->rd=-1;
-              
-              cpu->pc = stage->buffer;
-          }
-          
-          
+      case OP_BNZ: {
+          resolve_branch(cpu, MEM);
+          break;
       }
       
       /* JUMP */
-      if (strcmp(stage->opcode, "JUMP") == 0) {
-          //no instructions in memory
-              MUL_INDEX =0;
-              STOP_INDEX=0;
-              
-              strcpy(stage_EX->opcode, "NOP");
-              //          stage_EX->pc = 0;
-              
-              stage_EX->rd=-1;
-              
-              strcpy(stage_DRF->opcode, "NOP");
-              //          stage_DRF->pc = 0;
-              stage_DRF->rd=-1;
-              
-              cpu->pc = stage->buffer;
+      case OP_JUMP: {
+          resolve_branch(cpu, MEM);
+          break;
       }
       
       /* HALT */
-      if (strcmp(stage->opcode, "HALT") == 0) {
+      case OP_HALT: {
           //no instructions in memory
          
+          break;
       }
+    }
       
-    /* Copy data from decode latch to execute latch*/
-    cpu->stage[WB] = cpu->stage[MEM];
+    if (cpu->mem_stall > 0) {
+        /* Writeback gets bubbles until the access completes */
+        cpu->stage[WB].opcode = OP_NOP;
+        cpu->stage[WB].bubble = STALL_DCACHE;
+        cpu->stage[WB].rd = -1;
+    } else {
+        /* Copy data from memory latch to writeback latch*/
+        cpu->stage[WB] = cpu->stage[MEM];
+    }
 
     if (ENABLE_DEBUG_MESSAGES) {
-        if (Total_type == 2) {
-            print_stage_content("Memory", stage);
+        if (cpu->trace) {
+            APEX_trace_append(cpu->trace, cpu->clock + 1, MEM, stage);
+        } else if (cpu->mode == MODE_DISPLAY) {
+            print_stage_content(cpu->out, "Memory", stage);
         }
       
     }
@@ -1520,104 +1127,120 @@ int
 writeback(APEX_CPU* cpu)
 {
   CPU_Stage* stage = &cpu->stage[WB];
-  if (!stage->busy && !stage->stalled) {
+  if (!APEX_latch_filling(stage)) {
 
+    switch (stage->opcode) {
     /* Update register file */
-    if (strcmp(stage->opcode, "MOVC") == 0) {
-        cpu->regs_valid[stage->rd] = 1;
+    case OP_MOVC: {
         cpu->regs[stage->rd] = stage->buffer;
         
         cpu->ins_completed++;
+        break;
     }
       /* Store */
-      if (strcmp(stage->opcode, "STORE") == 0) {
+      case OP_STORE: {
           cpu->ins_completed++;
+          break;
       }
       
       /* LOAD */
-      if (strcmp(stage->opcode, "LOAD") == 0) {
-          cpu->regs_valid[stage->rd] = 1;
+      case OP_LOAD: {
           cpu->regs[stage->rd] = stage->rs2_value;
           
           cpu->ins_completed++;
+          break;
       }
       
       /* ADD */
-      if (strcmp(stage->opcode, "ADD") == 0) {
-          cpu->regs_valid[stage->rd] = 1;
+      case OP_ADD: {
           cpu->regs[stage->rd] = stage->buffer;
           
           cpu->ins_completed++;
+          break;
       }
       
       /* SUB */
-      if (strcmp(stage->opcode, "SUB") == 0) {
-          cpu->regs_valid[stage->rd] = 1;
+      case OP_SUB: {
           cpu->regs[stage->rd] = stage->buffer;
           
           cpu->ins_completed++;
+          break;
       }
       
       /* AND */
-      if (strcmp(stage->opcode, "AND") == 0) {
-          cpu->regs_valid[stage->rd] = 1;
+      case OP_AND: {
           cpu->regs[stage->rd] = stage->buffer;
           
           cpu->ins_completed++;
+          break;
       }
       
       /* OR */
-      if (strcmp(stage->opcode, "OR") == 0) {
-          cpu->regs_valid[stage->rd] = 1;
+      case OP_OR: {
           cpu->regs[stage->rd] = stage->buffer;
           
           cpu->ins_completed++;
+          break;
       }
       
       /* EX-OR */
-      if (strcmp(stage->opcode, "EX-OR") == 0) {
-          cpu->regs_valid[stage->rd] = 1;
+      case OP_EXOR: {
           cpu->regs[stage->rd] = stage->buffer;
           
           cpu->ins_completed++;
+          break;
       }
       
       /* MUL */
-      if (strcmp(stage->opcode, "MUL") == 0) {
-          cpu->regs_valid[stage->rd] = 1;
+      case OP_MUL:
+      case OP_DIV: {
           cpu->regs[stage->rd] = stage->buffer;
           
           cpu->ins_completed++;
+          break;
       }
       
       /* BZ */
-      if (strcmp(stage->opcode, "BZ") == 0) {
+      case OP_BZ: {
           cpu->ins_completed++;
+          break;
       }
       
       /* BNZ */
-      if (strcmp(stage->opcode, "BNZ") == 0) {
+      case OP_BNZ: {
           cpu->ins_completed++;
+          break;
       }
       
       /* JUMP */
-      if (strcmp(stage->opcode, "JUMP") == 0) {
+      case OP_JUMP: {
           cpu->ins_completed++;
+          break;
       }
       
       /* HALT */
-      if (strcmp(stage->opcode, "HALT") == 0) {
-          HALT_INDEX = 1;
+      case OP_HALT: {
+          cpu->halt_index = 1;
+          break;
       }
 
       /* NOP */
-      if (strcmp(stage->opcode, "NOP") == 0) {
+      case OP_NOP: {
           
+          break;
       }
+    }
+
+    if (stage->opcode != OP_NOP) {
+        cpu->counters.commits[stage->opcode]++;
+        APEX_sb_retire(&cpu->scoreboard, stage);
+    }
 
     if (ENABLE_DEBUG_MESSAGES) {
-        if (Total_type == 2) {
-            print_stage_content_WB("Writeback", stage);
+        if (cpu->trace) {
+            APEX_trace_append(cpu->trace, cpu->clock + 1, WB, stage);
+        } else if (cpu->mode == MODE_DISPLAY) {
+            print_stage_content_WB(cpu->out, "Writeback", stage);
         }
       
     }
@@ -1626,75 +1249,294 @@ writeback(APEX_CPU* cpu)
 }
 
 /*
- *  APEX CPU simulation loop
+ * Attributes this cycle of stage s to a STALL_* cause, called right after
+ * the stage has run while its latch still holds what it worked on
+ */
+static void
+count_stage(APEX_CPU* cpu, int s)
+{
+  const CPU_Stage* stage = &cpu->stage[s];
+  int cause = STALL_NONE;
+
+  if (APEX_latch_filling(stage)) {
+    cause = STALL_FILL;
+  } else if (s <= DRF && cpu->stop_index) {
+    cause = STALL_LOAD_USE;
+  } else if (s == DRF && cpu->fu_stall) {
+    cause = STALL_FU;
+  } else if (s == MEM && cpu->mem_stall) {
+    cause = STALL_DCACHE;
+  } else if (s == F && cpu->icache_stall) {
+    cause = STALL_ICACHE;
+  } else if (stage->opcode == OP_NOP) {
+    cause = stage->bubble;
+  }
+  cpu->counters.stage_cycles[s][cause]++;
+}
+
+/*
+ * Holds stage s for a cycle while MEM waits on the D-cache: its latch
+ * stays as it is and the cycle is charged to the D-cache
+ */
+static void
+hold_stage(APEX_CPU* cpu, int s, char* name)
+{
+  if (ENABLE_DEBUG_MESSAGES) {
+    if (cpu->trace) {
+      APEX_trace_append(cpu->trace, cpu->clock + 1, s, &cpu->stage[s]);
+    } else if (cpu->mode == MODE_DISPLAY) {
+      print_stage_content(cpu->out, name, &cpu->stage[s]);
+    }
+  }
+  cpu->counters.stage_cycles[s][STALL_DCACHE]++;
+}
+
+/*
+ * Prints the table of an enabled cache after the run
+ */
+static void
+print_cache(FILE* out, const char* title, const APEX_Cache* c)
+{
+  if (c->size == 0) {
+    return;
+  }
+
+  long misses = c->read_misses + c->write_misses;
+  fprintf(out, "\n============== %s (%dB, %d way, %dB lines, %s) =============\n",
+          title, c->size, c->assoc, c->line_size, cache_repl_names[c->replacement]);
+  fprintf(out, "|   Reads        |   %8ld  |\n", c->reads);
+  fprintf(out, "|   Writes       |   %8ld  |\n", c->writes);
+  fprintf(out, "|   Misses       |   %8ld  |\n", misses);
+  fprintf(out, "|   Writebacks   |   %8ld  |\n", c->writebacks);
+  fprintf(out, "|   Hit rate     |   %7.2f%%  |\n",
+          c->reads + c->writes ? 100.0 * (c->reads + c->writes - misses) / (c->reads + c->writes) : 0.0);
+}
+
+/*
+ *  Advances the APEX pipeline by a single clock cycle
  *
- *  Note : You are free to edit this function according to your
- * 				 implementation
+ *  Returns 1 once the simulation has finished, 0 otherwise. Every piece
+ *  of state lives in the APEX_CPU, so independent CPUs can be stepped
+ *  side by side, including from different threads.
  */
 int
-APEX_cpu_run(APEX_CPU* cpu)
+APEX_cpu_step(APEX_CPU* cpu)
 {
-  while (1) {
+    if (cpu->finished) {
+      return 1;
+    }
 
     /* All the instructions committed, so exit */
-    if (cpu->pc == (4000+ 4*(cpu->code_memory_size+4)) || cpu->clock == Total_cycle) {
-      printf("(apex) >> Simulation Complete");
-//        printf("\n%d \n",cpu->code_memory_size);
-//        printf("%d \n",cpu->ins_completed);
-      break;
+    int drained = cpu->core != CORE_INORDER ? APEX_ooo_idle(cpu) : inorder_drained(cpu);
+    if (drained || cpu->clock == cpu->max_cycles) {
+      fprintf(cpu->out, "(apex) >> Simulation Complete");
+      cpu->finished = 1;
+      return 1;
     }
       
-      if (Total_type == 2) {
+      if (cpu->trace) {
+          APEX_trace_append(cpu->trace, cpu->clock + 1, TRACE_CYCLE, NULL);
+      } else if (cpu->mode == MODE_DISPLAY) {
           if (ENABLE_DEBUG_MESSAGES) {
-              printf("--------------------------------\n");
-              printf("Clock Cycle #: %d\n", (cpu->clock+1));
-              printf("--------------------------------\n");
+              fprintf(cpu->out, "--------------------------------\n");
+              fprintf(cpu->out, "Clock Cycle #: %d\n", (cpu->clock+1));
+              fprintf(cpu->out, "--------------------------------\n");
           }
       }
 
 
-    writeback(cpu);
-    memory(cpu);
-    execute(cpu);
-    decode(cpu);
-    fetch(cpu);
+    if (cpu->core != CORE_INORDER) {
+        APEX_ooo_cycle(cpu);
+    } else {
+        writeback(cpu);
+        count_stage(cpu, WB);
+        memory(cpu);
+        count_stage(cpu, MEM);
+        if (cpu->trapped) {
+            /* Nothing younger than the faulting LOAD/STORE moves on */
+        } else if (cpu->mem_stall > 0) {
+            hold_stage(cpu, EX, "Execute");
+            hold_stage(cpu, DRF, "Decode/RF");
+            hold_stage(cpu, F, "Fetch");
+        } else {
+            execute(cpu);
+            count_stage(cpu, EX);
+            decode(cpu);
+            count_stage(cpu, DRF);
+            fetch(cpu);
+            count_stage(cpu, F);
+        }
+    }
     cpu->clock++;
       
-      if (HALT_INDEX != 0) {
-          break;
-      }
+    cpu->finished = cpu->halt_index != 0 || cpu->trapped;
+    return cpu->finished;
+}
+
+/*
+ * Stops the simulation at ins after a runtime error already reported,
+ * ins has not completed and everything older has
+ */
+void
+APEX_cpu_fault(APEX_CPU* cpu, const CPU_Stage* ins)
+{
+  cpu->pc = ins->pc;
+  cpu->trapped = 1;
+  cpu->finished = 1;
+}
+
+/*
+ * Stops the simulation at a LOAD or STORE to an address outside data
+ * memory
+ */
+void
+APEX_cpu_trap(APEX_CPU* cpu, const CPU_Stage* ins, int address)
+{
+  fprintf(stderr, "APEX_Error : %s at pc(%d) accessed address %d, outside the %d-bit data memory\n",
+          opcode_info[ins->opcode].name, ins->pc, address, cpu->data_memory.bits);
+  APEX_cpu_fault(cpu, ins);
+}
+
+/*
+ * Returns how many of the coming cycles are known to leave the in-order
+ * pipeline frozen: only the D-cache or I-cache wait counts down and every
+ * stage is charged to the same cause in each of them
+ */
+static int
+frozen_cycles(const APEX_CPU* cpu)
+{
+  if (cpu->mem_stall > 0) {
+    /* MEM holds everything behind it, WB sees D-cache bubbles */
+    return cpu->mem_stall - 1;
+  }
+  if (cpu->icache_stall < 2 || cpu->stop_index || cpu->fu_stall ||
+      cpu->fetch_queue.count != 0) {
+    return 0;
+  }
+
+  /* Fetch waits with nothing left behind it but its own bubbles */
+  for (int u = 0; u < NUM_FUS; ++u) {
+    if (cpu->fu[u].count != 0) {
+      return 0;
+    }
+  }
+  const CPU_Stage* drf = &cpu->stage[DRF];
+  if (drf->opcode != OP_NOP || drf->bubble != STALL_ICACHE) {
+    return 0;
+  }
+  for (int s = EX; s < NUM_STAGES; ++s) {
+    if (memcmp(&cpu->stage[s], drf, sizeof(*drf)) != 0) {
+      return 0;
+    }
+  }
+  return cpu->icache_stall - 1;
+}
+
+/*
+ * Jumps over a run of frozen cycles: the first one is stepped, the rest
+ * only move the clock and the wait counters on and repeat its counts.
+ * The result is the same as stepping every cycle. Runs which print or
+ * trace every cycle are always stepped.
+ */
+static void
+skip_frozen_cycles(APEX_CPU* cpu)
+{
+  if (cpu->trace || cpu->mode == MODE_DISPLAY) {
+    return;
+  }
+
+  int cycles = cpu->core != CORE_INORDER ? APEX_ooo_frozen_cycles(cpu) : frozen_cycles(cpu);
+  if (cpu->max_cycles >= 0 && cycles > cpu->max_cycles - cpu->clock) {
+    cycles = cpu->max_cycles - cpu->clock;
+  }
+  if (cycles < 2) {
+    return;
+  }
+
+  APEX_Counters before = cpu->counters;
+  if (APEX_cpu_step(cpu)) {
+    return;
+  }
+  cycles--;
+
+  APEX_Counters* c = &cpu->counters;
+  for (int s = 0; s < NUM_STAGES; ++s) {
+    for (int i = 0; i < NUM_STALLS; ++i) {
+      c->stage_cycles[s][i] += cycles * (c->stage_cycles[s][i] - before.stage_cycles[s][i]);
+    }
+  }
+  cpu->clock += cycles;
+  if (cpu->core != CORE_INORDER) {
+    APEX_ooo_advance(cpu, cycles);
+  } else if (cpu->mem_stall > 0) {
+    cpu->mem_stall -= cycles;
+  } else {
+    cpu->icache_stall -= cycles;
+  }
+}
+
+/*
+ *  APEX CPU simulation loop
+ *
+ *  Note : You are free to edit this function according to your
+ * 				 implementation
+ */
+int
+APEX_cpu_run(APEX_CPU* cpu)
+{
+  while (!APEX_cpu_step(cpu)) {
+    skip_frozen_cycles(cpu);
   }
     
-    if (Total_type != 0) {
-        printf("\n=============== STATE OF ARCHITECTURAL REGISTER FILE ==========\n");
+    if (cpu->mode != MODE_NONE) {
+        fprintf(cpu->out, "\n=============== STATE OF ARCHITECTURAL REGISTER FILE ==========\n");
         
         for (int a=0; a<16; a++) {
             char str[10];
-            if (cpu->regs_valid[a] == 1) {
+            if (!(cpu->scoreboard.pending >> a & 1)) {
                 strcpy(str, "Valid");
             } else{
                 strcpy(str, "Invalid");
             }
             
             if (a<10) {
-                printf("|   REG[0%d]  |   Value = %4d  |   Status = %10s    |\n",a, cpu->regs[a], str);
+                fprintf(cpu->out, "|   REG[0%d]  |   Value = %4d  |   Status = %10s    |\n",a, cpu->regs[a], str);
             } else{
-                printf("|   REG[%d]  |   Value = %4d  |   Status = %10s    |\n",a, cpu->regs[a], str);
+                fprintf(cpu->out, "|   REG[%d]  |   Value = %4d  |   Status = %10s    |\n",a, cpu->regs[a], str);
             }
         }
         
-        printf("\n============== STATE OF DATA MEMORY =============\n");
+        fprintf(cpu->out, "\n============== STATE OF DATA MEMORY =============\n");
         
-        for (int a=0; a<100; a++) {
-            
+        for (int a=0; a<100 && APEX_dmem_in_range(&cpu->data_memory, a); a++) {
+            int value = APEX_dmem_read(&cpu->data_memory, a);
             if (a<10) {
-                printf("|   MEM[0%d]  |   Value = %4d  |\n",a, cpu->data_memory[a]);
+                fprintf(cpu->out, "|   MEM[0%d]  |   Value = %4d  |\n",a, value);
             } else{
-                printf("|   REG[%d]  |   Value = %4d  |\n",a, cpu->data_memory[a]);
+                fprintf(cpu->out, "|   REG[%d]  |   Value = %4d  |\n",a, value);
             }
         }
         
     }
+
+    if (cpu->mode != MODE_NONE && cpu->bpred.type != BP_NONE) {
+        const APEX_BranchPredictor* bp = &cpu->bpred;
+        fprintf(cpu->out, "\n============== BRANCH PREDICTION (%s) =============\n", bpred_names[bp->type]);
+        fprintf(cpu->out, "|   Branches     |   %8ld  |\n", bp->branches);
+        fprintf(cpu->out, "|   Mispredicts  |   %8ld  |\n", bp->mispredicts);
+        fprintf(cpu->out, "|   BTB misses   |   %8ld  |\n", bp->btb_misses);
+        fprintf(cpu->out, "|   Accuracy     |   %7.2f%%  |\n",
+                bp->branches ? 100.0 * (bp->branches - bp->mispredicts) / bp->branches : 0.0);
+    }
+
+    if (cpu->mode != MODE_NONE) {
+        print_cache(cpu->out, "I-CACHE", &cpu->icache);
+        print_cache(cpu->out, "D-CACHE", &cpu->dcache);
+    }
+
+    if (cpu->stats) {
+        APEX_counters_write_json(cpu, cpu->stats);
+    }
     
     
   return 0;
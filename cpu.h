@@ -8,17 +8,20 @@
  *  Gaurav Kothari (gkothar1@binghamton.edu)
  *  State University of New York, Binghamton
  */
+#include <stdint.h>
+#include <stdio.h>
 
-//int rename_index[16]=
-//    {0,0,0,0,
-//        0,0,0,0,
-//        0,0,0,0,
-//        0,0,0,0
-//};
-
-int Total_type;
-int Total_cycle;
+#include "bpred.h"
+#include "cache.h"
+#include "dmem.h"
 
+/* Output modes selected on the command line */
+enum
+{
+  MODE_NONE,
+  MODE_SIMULATE,
+  MODE_DISPLAY
+};
 
 enum
 {
@@ -30,43 +33,276 @@ enum
   NUM_STAGES
 };
 
-/* Format of an APEX instruction  */
+/* Decoded APEX opcodes, resolved once by the file parser */
+enum
+{
+  OP_NOP,
+  OP_MOVC,
+  OP_STORE,
+  OP_LOAD,
+  OP_ADD,
+  OP_SUB,
+  OP_AND,
+  OP_OR,
+  OP_EXOR,
+  OP_MUL,
+  OP_BZ,
+  OP_BNZ,
+  OP_JUMP,
+  OP_HALT,
+  OP_DIV,		// Appended so existing program images keep their opcodes
+  NUM_OPCODES
+};
+
+/* Functional units of the EX stage */
+enum
+{
+  FU_ALU,		// Everything except MUL and DIV
+  FU_MUL,
+  FU_DIV,
+  NUM_FUS
+};
+
+/* Operand formats, drives both parsing and printing of an instruction */
+enum
+{
+  FMT_NONE,		// HALT
+  FMT_RD_IMM,		// MOVC,Rd,#imm
+  FMT_RS1_RS2_IMM,	// STORE,Rs1,Rs2,#imm
+  FMT_RD_RS1_IMM,	// LOAD,Rd,Rs1,#imm
+  FMT_RD_RS1_RS2,	// ADD,Rd,Rs1,Rs2
+  FMT_IMM,		// BZ,#imm
+  FMT_RS1_IMM		// JUMP,Rs1,#imm
+};
+
+/* Reasons for a pipeline stage not passing a useful instruction on */
+enum
+{
+  STALL_NONE,		// Stage advanced a real instruction
+  STALL_FILL,		// Pipeline refilling after reset
+  STALL_LOAD_USE,	// Decode interlocked on a result it can not forward yet
+  STALL_FU,		// Functional unit busy or an operand still in flight
+  STALL_DCACHE,		// Waiting on a D-cache access
+  STALL_ICACHE,		// Waiting on an I-cache miss
+  STALL_BRANCH,		// Squashed by a mispredicted BZ/BNZ/JUMP
+  STALL_DRAIN,		// Draining behind a HALT, or fetching past the code
+  STALL_NOP,		// NOP in the program
+  NUM_STALLS
+};
+
+/* Names of the STALL_* causes in reports, STALL_NONE is "base" */
+extern const char* const stall_names[NUM_STALLS];
+
+/* Registers an opcode reads in DRF */
+enum
+{
+  SRC_RS1 = 1 << 0,
+  SRC_RS2 = 1 << 1
+};
+
+/* Per-opcode descriptor, indexed by the opcode enum */
+typedef struct APEX_OpInfo
+{
+  const char* name;	// Mnemonic as written in the input file
+  int format;		// Operand format
+  int unit;		// Functional unit executing it, one of FU_*
+  int sources;		// SRC_* bits
+  int ready;		// Stage rd can first be forwarded from, -1 if none
+} APEX_OpInfo;
+
+extern const APEX_OpInfo opcode_info[NUM_OPCODES];
+
+/* DIV truncates towards zero, dividing by zero gives 0 and INT_MIN / -1
+ * wraps around instead of trapping */
+static inline int
+APEX_divide(int a, int b)
+{
+  if (b == 0) {
+    return 0;
+  }
+  if (b == -1) {
+    return (int)(0u - (unsigned)a);
+  }
+  return a / b;
+}
+
+/* ADD, SUB, MUL and DIV set the z flag */
+static inline int
+APEX_sets_z(int opcode)
+{
+  return opcode == OP_ADD || opcode == OP_SUB || opcode == OP_MUL ||
+         opcode == OP_DIV;
+}
+
+/* Architectural registers, R0 to R31 */
+#define REG_FILE_SIZE 32
+
+/* Format of an APEX instruction, 8 bytes so that a binary program image
+ * can be mapped straight into code memory */
 typedef struct APEX_Instruction
 {
-  char opcode[128];	// Operation Code
-  int rd;		    // Destination Register Address
-  int rs1;		    // Source-1 Register Address
-  int rs2;		    // Source-2 Register Address
-  int imm;		    // Literal Value
-//    //rename table
-//    int rename_rd;
-//    int rename_rs1;
-//    int rename_rs2;
+  uint8_t opcode;	// Operation Code
+  int8_t rd;		// Destination Register Address
+  int8_t rs1;		// Source-1 Register Address
+  int8_t rs2;		// Source-2 Register Address
+  int32_t imm;		// Literal Value
 } APEX_Instruction;
 
-/* Model of CPU stage latch */
+/* Model of CPU stage latch, 32 bytes so that the five latches sit in a
+ * few cache lines. A latch holding OP_NOP carries no operands, bubble
+ * says why it is empty. Fields no opcode needs at the same time share
+ * storage. */
 typedef struct CPU_Stage
 {
-  int pc;		    // Program Counter
-  char opcode[128];	// Operation Code
-  int rs1;		    // Source-1 Register Address
-  int rs2;		    // Source-2 Register Address
-  int rd;		    // Destination Register Address
-  int imm;		    // Literal Value
-  int rs1_value;	// Source-1 Register Value
-  int rs2_value;	// Source-2 Register Value
-  int buffer;		// Latch to hold some value
-  int mem_address;	// Computed Memory Address
-  int busy;		    // Flag to indicate, stage is performing some action
-  int stalled;		// Flag to indicate, stage is stalled
-   
-//    //rename table
-//    int rename_rd;
-//    int rename_rs1;
-//    int rename_rs2;
-//
+  int32_t pc;		// Program Counter
+  int32_t imm;		// Literal Value
+  int32_t rs1_value;	// Source-1 Register Value
+  union {
+    int32_t rs2_value;	// Source-2 Register Value
+    int32_t bubble;	// OP_NOP: why the latch is empty, one of STALL_*
+  };
+  int32_t buffer;	// Latch to hold some value
+  union {
+    int32_t pred_pc;	// BZ/BNZ/JUMP: next pc fetch went on with
+    int32_t mem_address;	// LOAD/STORE: Computed Memory Address
+  };
+  int32_t seq;		// Fetch order, orders instructions in flight in EX
+  uint8_t opcode;	// Operation Code
+  int8_t rd;		// Destination Register Address
+  int8_t rs1;		// Source-1 Register Address
+  int8_t rs2;		// Source-2 Register Address
 } CPU_Stage;
 
+_Static_assert(sizeof(CPU_Stage) == 32, "CPU_Stage is not 32 bytes");
+
+/* A latch still holding the bubble it was reset with, its stage has
+ * nothing to work on yet */
+static inline int
+APEX_latch_filling(const CPU_Stage* stage)
+{
+  return stage->opcode == OP_NOP && stage->bubble == STALL_FILL;
+}
+
+/* Decoupling queue between F and DRF of the pipeline */
+#define FETCH_QUEUE_MAX 32
+
+typedef struct APEX_FetchQueue
+{
+  CPU_Stage slot[FETCH_QUEUE_MAX];	// Circular, oldest at head
+  int size;		// 0 when F feeds DRF directly
+  int head;
+  int count;
+} APEX_FetchQueue;
+
+/* Most instructions one functional unit can have in flight */
+#define FU_MAX_INFLIGHT 16
+
+/* A functional unit, pipelined or not depending on the initiation
+ * interval of what it executes */
+typedef struct APEX_FUnit
+{
+  CPU_Stage slot[FU_MAX_INFLIGHT];	// In flight, oldest first
+  int remaining[FU_MAX_INFLIGHT];	// Cycles until the result is ready
+  int count;
+  int next_issue;	// First cycle the unit accepts another instruction
+} APEX_FUnit;
+
+/* Registers tracked by the scoreboard, R0-R31 and the z flag */
+#define SB_REGS 33
+#define SB_Z 32
+
+/* Writers in flight per register. A bit of a mask is set while the count
+ * behind it is not 0, so a hazard check is one test against a mask. */
+typedef struct APEX_Scoreboard
+{
+  uint64_t pending;	// Written by an issued instruction which has not retired
+  uint64_t in_fu;	// Written by an instruction still in a functional unit
+  int writers[SB_REGS];
+  int fu_writers[SB_REGS];
+} APEX_Scoreboard;
+
+/* Cores the cycle loop can model */
+enum
+{
+  CORE_INORDER,		// The 5 stage pipeline
+  CORE_SUPERSCALAR,	// W-wide, issues in order on the out-of-order back end
+  CORE_OOO		// W-wide, issues out of order
+};
+
+/* Widest bundle the superscalar and out-of-order cores handle */
+#define APEX_MAX_WIDTH 8
+
+/* The out-of-order core renames R0-R31 and the z flag */
+#define OOO_ARCH_REGS 33
+#define OOO_Z 32
+#define OOO_MAX_ROB 64
+#define OOO_MAX_IQ 32
+#define OOO_MAX_PRF 160
+
+/* Reorder buffer entry, one per renamed instruction */
+typedef struct APEX_RobEntry
+{
+  CPU_Stage ins;	// Instruction, buffer holds the result once issued
+  int pd;		// Physical register written for rd, -1 if none
+  int old_pd;		// Previous mapping of rd, freed at commit
+  int pz;		// Physical register written for the z flag, -1 if none
+  int old_pz;		// Previous mapping of the z flag, freed at commit
+  int ps1;		// Physical source registers, -1 if unused
+  int ps2;
+  int psz;		// z flag read by BZ/BNZ
+  int issued;		// Left the issue queue
+  int done;		// Result written back, may commit
+  int remaining;	// Cycles until the result is written back
+  int next_pc;		// Resolved successor of a BZ/BNZ/JUMP
+  int trap;		// LOAD/STORE address outside data memory, taken at commit
+} APEX_RobEntry;
+
+/* State of the out-of-order core, all fixed size so checkpoints stay a
+ * plain image of the APEX_CPU */
+typedef struct APEX_OoO
+{
+  /* Sizes, only changed before the first cycle */
+  int width;		// Instructions fetched, renamed, issued and committed per cycle
+  int rob_entries;
+  int iq_entries;
+  int prf_entries;
+
+  int map[OOO_ARCH_REGS];	// Rename table, architectural to physical
+  int prf[OOO_MAX_PRF];		// Physical register file
+  uint8_t prf_ready[OOO_MAX_PRF];
+  int free_list[OOO_MAX_PRF];	// Circular queue of unmapped registers
+  int free_head;
+  int free_count;
+
+  APEX_RobEntry rob[OOO_MAX_ROB];	// Circular, oldest at rob_head
+  int rob_head;
+  int rob_count;
+
+  int iq[OOO_MAX_IQ];	// ROB indices waiting to issue, oldest first
+  int iq_count;
+  /* First cycle each unit accepts an instruction, there is an ALU per
+   * issue slot and a single MUL and DIV unit */
+  int next_issue[NUM_FUS][APEX_MAX_WIDTH];
+
+  CPU_Stage drf[APEX_MAX_WIDTH];	// Fetched bundle, waiting to be renamed
+  int drf_count;
+  int fetch_paid;	// The I-cache access for pc has already been made
+  int fetch_stopped;	// HALT fetched or pc left the code, until a redirect
+  int bubble;		// Why fetch has nothing to rename, one of STALL_*
+} APEX_OoO;
+
+/* Hardware performance counters, updated every cycle */
+typedef struct APEX_Counters
+{
+  /* Cycles each stage spent on a real instruction (STALL_NONE) or on
+   * nothing useful, split by cause. Every row sums to the cycle count,
+   * the WB row is the CPI stack. */
+  long stage_cycles[NUM_STAGES][NUM_STALLS];
+
+  /* Instructions leaving writeback, by opcode */
+  long commits[NUM_OPCODES];
+} APEX_Counters;
+
 /* Model of APEX CPU */
 typedef struct APEX_CPU
 {
@@ -78,7 +314,6 @@ typedef struct APEX_CPU
 
   /* Integer register file */
   int regs[32];
-  int regs_valid[32];
     
     int z_flag[1];
 
@@ -88,27 +323,173 @@ typedef struct APEX_CPU
   /* Code Memory where instructions are stored */
   APEX_Instruction* code_memory;
   int code_memory_size;
+  int code_memory_mapped;	// Code memory is a mapped binary image
+  struct APEX_BlockCache* blocks;	// Functional model translations, built on
+				// the first fast-forward
 
-  /* Data Memory */
-  int data_memory[4096];
+  /* Data Memory, sparse, 2^data_memory.bits words */
+  APEX_DataMemory data_memory;
 
   /* Some stats */
   int ins_completed;
+  APEX_Counters counters;
+
+  /* Branch prediction unit, consulted by fetch */
+  APEX_BranchPredictor bpred;
+  int resolve_stage;	// Stage where BZ/BNZ/JUMP resolve: DRF, EX or MEM
+  int forward[NUM_STAGES];	// 1 if DRF has a bypass from the output of that stage
+
+  /* L1 caches, the I-cache is consulted by fetch, the D-cache by LOAD
+   * and STORE */
+  APEX_Cache icache;
+  APEX_Cache dcache;
+  APEX_FetchQueue fetch_queue;
+
+  /* Functional units of the EX stage, latencies and initiation intervals
+   * per opcode */
+  APEX_FUnit fu[NUM_FUS];
+  int fu_latency[NUM_OPCODES];
+  int fu_ii[NUM_OPCODES];
+  int z_seq;		// seq of the instruction which last wrote the z flag
+  APEX_Scoreboard scoreboard;
+
+  /* Core modelled by the cycle loop, one of CORE_* */
+  int core;
+  APEX_OoO ooo;
+
+  /* Run configuration */
+  int mode;		// One of MODE_NONE, MODE_SIMULATE, MODE_DISPLAY
+  int max_cycles;	// Stop after this many cycles
+  FILE* out;		// Destination of the pipeline and state dumps
+  struct APEX_Trace* trace;	// Binary pipeline trace, replaces the display dump
+  FILE* stats;		// Performance counters are written here as JSON
+
+  /* Pipeline control state */
+  int fu_stall;		// Decode held by a busy unit or an operand in flight
+  int mem_stall;	// Cycles MEM still waits on the D-cache
+  int icache_stall;	// Cycles F still waits on the I-cache
+  int stop_index;	// Decode interlocked on a LOAD result
+  int halt_index;	// HALT reached writeback
+  int trapped;		// A LOAD or STORE went outside data memory
+  int finished;		// Simulation has completed
+  int instruct_index;	// Instructions fetched
+  long ff_completed;	// Instructions retired by the functional model
 
 } APEX_CPU;
 
+/* Index into code memory of the instruction at pc, -1 outside code
+ * memory. Like get_code_index a pc between two instructions selects the
+ * one below it, but pcs under 4000 never select the first */
+static inline int
+pc_to_index(const APEX_CPU* cpu, int pc)
+{
+  if (pc < 4000) {
+    return -1;
+  }
+  int index = (pc - 4000) / 4;
+  return index < cpu->code_memory_size ? index : -1;
+}
+
 APEX_Instruction*
 create_code_memory(const char* filename, int* size);
 
+APEX_Instruction*
+map_code_image(const char* filename, int* size);
+
+APEX_Instruction*
+load_code_memory(const char* filename, int* size, int* mapped);
+
+void
+release_code_memory(APEX_Instruction* code_memory, int size, int mapped);
+
+int
+write_code_image(const char* filename, const APEX_Instruction* code_memory, int size);
+
 APEX_CPU*
 APEX_cpu_init(const char* filename);
 
+void
+APEX_cpu_reset_pipeline(APEX_CPU* cpu);
+
+long
+APEX_cpu_fastforward(APEX_CPU* cpu, long max_ins, int stop_pc);
+
+void
+APEX_blocks_free(APEX_CPU* cpu);
+
+int
+APEX_cpu_save(const APEX_CPU* cpu, const char* filename);
+
+int
+APEX_cpu_write_state(const APEX_CPU* cpu, const char* filename);
+
+int
+APEX_state_write(const char* filename, const int* regs, int z_flag, int pc, int trapped,
+                 const APEX_DataMemory* m);
+
+APEX_CPU*
+APEX_cpu_restore(const char* filename, const char* program);
+
+void
+APEX_ooo_reset(APEX_CPU* cpu);
+
+void
+APEX_ooo_cycle(APEX_CPU* cpu);
+
+int
+APEX_ooo_idle(const APEX_CPU* cpu);
+
+uint64_t
+APEX_sb_writes(const CPU_Stage* ins);
+
+void
+APEX_sb_issue(APEX_Scoreboard* sb, const CPU_Stage* ins);
+
+void
+APEX_sb_retire(APEX_Scoreboard* sb, const CPU_Stage* ins);
+
+int
+APEX_ooo_frozen_cycles(const APEX_CPU* cpu);
+
+void
+APEX_ooo_advance(APEX_CPU* cpu, int cycles);
+
+int
+APEX_config_set(APEX_CPU* cpu, const char* key, const char* value);
+
+int
+APEX_config_parse(APEX_CPU* cpu, const char* setting);
+
+int
+APEX_config_load(APEX_CPU* cpu, const char* filename);
+
+void
+APEX_counters_write_json(const APEX_CPU* cpu, FILE* fp);
+
+int
+get_code_index(int pc);
+
+int
+APEX_cpu_step(APEX_CPU* cpu);
+
+void
+APEX_cpu_fault(APEX_CPU* cpu, const CPU_Stage* ins);
+
+void
+APEX_cpu_trap(APEX_CPU* cpu, const CPU_Stage* ins, int address);
+
 int
 APEX_cpu_run(APEX_CPU* cpu);
 
 void
 APEX_cpu_stop(APEX_CPU* cpu);
 
+void
+print_stage_content(FILE* out, char* name, CPU_Stage* stage);
+
+void
+print_stage_content_WB(FILE* out, char* name, CPU_Stage* stage);
+
 int
 fetch(APEX_CPU* cpu);
 
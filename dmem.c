@@ -0,0 +1,253 @@
+/*
+ *  dmem.c
+ *  Contains the sparse data memory: the page table walk and the lazy
+ *  allocation behind the fast path in dmem.h
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dmem.h"
+
+/*
+ * Sets up an empty memory of 2^bits words, any previous contents must
+ * have been released with APEX_dmem_free()
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int
+APEX_dmem_init(APEX_DataMemory* m, int bits)
+{
+  if (bits < 1 || bits > DMEM_MAX_BITS) {
+    return -1;
+  }
+
+  int page_bits = bits > DMEM_PAGE_BITS ? bits - DMEM_PAGE_BITS : 0;
+  int dir_bits = page_bits > DMEM_TABLE_BITS ? page_bits - DMEM_TABLE_BITS : 0;
+
+  memset(m, 0, sizeof(*m));
+  m->bits = bits;
+  m->mask = bits == 32 ? UINT32_MAX : (1u << bits) - 1;
+  m->dir_entries = 1u << dir_bits;
+  m->table_entries = 1u << (page_bits < DMEM_TABLE_BITS ? page_bits : DMEM_TABLE_BITS);
+  m->dir = calloc(m->dir_entries, sizeof(*m->dir));
+  m->last_page = DMEM_NO_PAGE;
+  return m->dir ? 0 : -1;
+}
+
+/* Returns a second level table of m with no pages, NULL on failure */
+static int32_t**
+new_table(const APEX_DataMemory* m)
+{
+  return calloc(m->table_entries, sizeof(int32_t*));
+}
+
+/* 1 if words is a page of the mapped data image */
+static int
+in_image(const APEX_DataMemory* m, const int32_t* words)
+{
+  return m->image && (const char*)words >= m->image &&
+         (const char*)words < m->image + m->image_size;
+}
+
+void
+APEX_dmem_free(APEX_DataMemory* m)
+{
+  if (!m->dir) {
+    return;
+  }
+  for (uint32_t d = 0; d < m->dir_entries; ++d) {
+    if (m->dir[d]) {
+      for (uint32_t t = 0; t < m->table_entries; ++t) {
+        if (!in_image(m, m->dir[d][t])) {
+          free(m->dir[d][t]);
+        }
+      }
+      free(m->dir[d]);
+    }
+  }
+  free(m->dir);
+  if (m->image) {
+    munmap(m->image, m->image_size);
+    m->image = NULL;
+  }
+  m->dir = NULL;
+  m->pages = 0;
+  m->last_page = DMEM_NO_PAGE;
+  m->last = NULL;
+}
+
+/*
+ * Changes the address width to bits, keeping the contents. Fails if a
+ * page already written would fall outside.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int
+APEX_dmem_resize(APEX_DataMemory* m, int bits)
+{
+  APEX_DataMemory resized;
+  if (APEX_dmem_init(&resized, bits) != 0) {
+    return -1;
+  }
+
+  uint32_t last = resized.mask >> DMEM_PAGE_BITS;
+  for (uint32_t p = APEX_dmem_next_page(m, 0); p != DMEM_NO_PAGE;
+       p = APEX_dmem_next_page(m, p + 1)) {
+    if (p > last) {
+      APEX_dmem_free(&resized);
+      return -1;
+    }
+  }
+
+  /* Move the pages over rather than copy them */
+  for (uint32_t p = APEX_dmem_next_page(m, 0); p != DMEM_NO_PAGE;
+       p = APEX_dmem_next_page(m, p + 1)) {
+    int32_t** table = m->dir[p >> DMEM_TABLE_BITS];
+    int32_t** words = &table[p & ((1 << DMEM_TABLE_BITS) - 1)];
+    int32_t*** dest = &resized.dir[p >> DMEM_TABLE_BITS];
+    if (!*dest) {
+      *dest = new_table(&resized);
+      if (!*dest) {
+        APEX_dmem_free(&resized);
+        return -1;
+      }
+    }
+    (*dest)[p & ((1 << DMEM_TABLE_BITS) - 1)] = *words;
+    resized.pages++;
+  }
+
+  /* Only the tables of the old memory are left to release */
+  for (uint32_t d = 0; d < m->dir_entries; ++d) {
+    free(m->dir[d]);
+  }
+  free(m->dir);
+  resized.image = m->image;
+  resized.image_size = m->image_size;
+  *m = resized;
+  return 0;
+}
+
+/*
+ * Maps filename, raw 32-bit words in host byte order, as the contents of
+ * data memory from address 0. Nothing is read up front: LOADs read the
+ * file through the mapping, and the first STORE to a page gets a private
+ * copy of it. The image must fit the address space and the pages it
+ * covers must not have been written yet.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int
+APEX_dmem_map_image(APEX_DataMemory* m, const char* filename)
+{
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "APEX_Error : Unable to open data image %s\n", filename);
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size % sizeof(int32_t) != 0) {
+    fprintf(stderr, "APEX_Error : %s is not a whole number of 32-bit words\n", filename);
+    close(fd);
+    return -1;
+  }
+  uint64_t words = st.st_size / sizeof(int32_t);
+  uint64_t pages = (words + DMEM_PAGE_WORDS - 1) / DMEM_PAGE_WORDS;
+  if (words > (uint64_t)m->mask + 1) {
+    fprintf(stderr, "APEX_Error : %s holds %llu words, more than the %d-bit data memory, see mem_bits\n",
+            filename, (unsigned long long)words, m->bits);
+    close(fd);
+    return -1;
+  }
+  if (m->image || (pages > 0 && APEX_dmem_next_page(m, 0) < pages)) {
+    fprintf(stderr, "APEX_Error : data memory is not empty where %s would go\n", filename);
+    close(fd);
+    return -1;
+  }
+  if (pages == 0) {
+    close(fd);
+    return 0;
+  }
+
+  /* Whole pages, the tail of the last one reads as zeros */
+  size_t size = pages * DMEM_PAGE_WORDS * sizeof(int32_t);
+  char* image = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED) {
+    fprintf(stderr, "APEX_Error : Unable to map data image %s\n", filename);
+    return -1;
+  }
+
+  m->image = image;
+  m->image_size = size;
+  for (uint32_t p = 0; p < pages; ++p) {
+    int32_t*** table = &m->dir[p >> DMEM_TABLE_BITS];
+    if (!*table) {
+      *table = new_table(m);
+      if (!*table) {
+        fprintf(stderr, "APEX_Error : Unable to allocate data memory page %u\n", p);
+        return -1;
+      }
+    }
+    (*table)[p & ((1 << DMEM_TABLE_BITS) - 1)] = (int32_t*)(image + (size_t)p * DMEM_PAGE_WORDS * sizeof(int32_t));
+    m->pages++;
+  }
+  return 0;
+}
+
+/* Returns the words of page, NULL if it was never written */
+int32_t*
+APEX_dmem_find_page(const APEX_DataMemory* m, uint32_t page)
+{
+  int32_t** table = m->dir[page >> DMEM_TABLE_BITS];
+  return table ? table[page & ((1 << DMEM_TABLE_BITS) - 1)] : NULL;
+}
+
+/* Returns the words of page, allocating it zero filled if need be. NULL
+ * if it can not be allocated */
+int32_t*
+APEX_dmem_alloc_page(APEX_DataMemory* m, uint32_t page)
+{
+  int32_t*** table = &m->dir[page >> DMEM_TABLE_BITS];
+  if (!*table) {
+    *table = new_table(m);
+  }
+  int32_t** words = *table ? &(*table)[page & ((1 << DMEM_TABLE_BITS) - 1)] : NULL;
+  if (words && !*words) {
+    *words = calloc(DMEM_PAGE_WORDS, sizeof(int32_t));
+    m->pages += *words != NULL;
+  }
+  if (!words || !*words) {
+    fprintf(stderr, "APEX_Error : Unable to allocate data memory page %u\n", page);
+    return NULL;
+  }
+  return *words;
+}
+
+/*
+ * Returns the first allocated page at or after page, DMEM_NO_PAGE if
+ * there is none. Walks tables rather than pages, so that visiting every
+ * page of a large address space stays cheap.
+ */
+uint32_t
+APEX_dmem_next_page(const APEX_DataMemory* m, uint32_t page)
+{
+  uint32_t last = m->mask >> DMEM_PAGE_BITS;
+  while (page <= last) {
+    int32_t** table = m->dir[page >> DMEM_TABLE_BITS];
+    if (!table) {
+      page = (page | ((1u << DMEM_TABLE_BITS) - 1)) + 1;
+      continue;
+    }
+    if (table[page & ((1 << DMEM_TABLE_BITS) - 1)]) {
+      return page;
+    }
+    page++;
+  }
+  return DMEM_NO_PAGE;
+}
@@ -0,0 +1,102 @@
+#ifndef _APEX_DMEM_H_
+#define _APEX_DMEM_H_
+/**
+ *  dmem.h
+ *  Sparse data memory. Words are kept in pages which are allocated, zero
+ *  filled, on the first STORE to them; a LOAD from a page never written
+ *  reads 0 without allocating it. Pages are found through a two level
+ *  table sized by the width of a word address, so a program touching a
+ *  few words costs a few pages whatever the address space.
+ *
+ *  An initial data image is mapped privately and its pages point into
+ *  the mapping, the kernel copies a page the first time it is written.
+ */
+#include <stdint.h>
+
+#define DMEM_PAGE_BITS 10	// 1024 words, 4 KB, per page
+#define DMEM_PAGE_WORDS (1 << DMEM_PAGE_BITS)
+#define DMEM_TABLE_BITS 11	// Pages per second level table
+#define DMEM_MAX_BITS 32
+#define DMEM_NO_PAGE UINT32_MAX
+
+typedef struct APEX_DataMemory
+{
+  int bits;		// Width of a word address, 1 to DMEM_MAX_BITS
+  uint32_t mask;	// Addresses with a bit outside it trap
+  int32_t*** dir;	// Second level tables, NULL until a page in them exists
+  uint32_t dir_entries;
+  uint32_t table_entries;	// Pages per table, up to 1 << DMEM_TABLE_BITS
+  uint32_t pages;	// Pages allocated or mapped
+
+  /* Mapped data image, its pages are not freed one by one */
+  char* image;
+  size_t image_size;
+
+  /* Last page accessed, the fast path of both LOAD and STORE */
+  uint32_t last_page;
+  int32_t* last;
+} APEX_DataMemory;
+
+int
+APEX_dmem_init(APEX_DataMemory* m, int bits);
+
+void
+APEX_dmem_free(APEX_DataMemory* m);
+
+int
+APEX_dmem_resize(APEX_DataMemory* m, int bits);
+
+int
+APEX_dmem_map_image(APEX_DataMemory* m, const char* filename);
+
+int32_t*
+APEX_dmem_find_page(const APEX_DataMemory* m, uint32_t page);
+
+int32_t*
+APEX_dmem_alloc_page(APEX_DataMemory* m, uint32_t page);
+
+uint32_t
+APEX_dmem_next_page(const APEX_DataMemory* m, uint32_t page);
+
+/* 1 if a LOAD or STORE may use address, every other access traps */
+static inline int
+APEX_dmem_in_range(const APEX_DataMemory* m, int address)
+{
+  return ((uint32_t)address & ~m->mask) == 0;
+}
+
+/* Word at address, which must be in range */
+static inline int32_t
+APEX_dmem_read(APEX_DataMemory* m, int address)
+{
+  uint32_t page = (uint32_t)address >> DMEM_PAGE_BITS;
+  if (page != m->last_page) {
+    int32_t* words = APEX_dmem_find_page(m, page);
+    if (!words) {
+      return 0;
+    }
+    m->last_page = page;
+    m->last = words;
+  }
+  return m->last[address & (DMEM_PAGE_WORDS - 1)];
+}
+
+/* Sets the word at address, which must be in range. Returns -1 if its
+ * page can not be allocated */
+static inline int
+APEX_dmem_write(APEX_DataMemory* m, int address, int32_t value)
+{
+  uint32_t page = (uint32_t)address >> DMEM_PAGE_BITS;
+  if (page != m->last_page) {
+    int32_t* words = APEX_dmem_alloc_page(m, page);
+    if (!words) {
+      return -1;
+    }
+    m->last = words;
+    m->last_page = page;
+  }
+  m->last[address & (DMEM_PAGE_WORDS - 1)] = value;
+  return 0;
+}
+
+#endif
@@ -7,147 +7,290 @@
  *  Gaurav Kothari (gkothar1@binghamton.edu)
  *  State University of New York, Binghamton
  */
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "cpu.h"
 
+#define APEX_IMAGE_MAGIC "APXB"
+#define APEX_IMAGE_VERSION 1
+
+/* Header of a binary program image, followed by the instructions exactly
+ * as they are laid out in code memory */
+typedef struct Code_Image_Header
+{
+  char magic[4];	// APEX_IMAGE_MAGIC
+  uint32_t version;	// APEX_IMAGE_VERSION
+  uint32_t size;	// Number of instructions
+  uint32_t reserved;	// Keeps the instructions 8 byte aligned
+} Code_Image_Header;
+
+/* Opcode descriptors, indexed by the opcode enum in cpu.h */
+const APEX_OpInfo opcode_info[NUM_OPCODES] = {
+  [OP_NOP] = { "NOP", FMT_NONE, FU_ALU, 0, -1 },
+  [OP_MOVC] = { "MOVC", FMT_RD_IMM, FU_ALU, 0, EX },
+  [OP_STORE] = { "STORE", FMT_RS1_RS2_IMM, FU_ALU, SRC_RS1 | SRC_RS2, -1 },
+  [OP_LOAD] = { "LOAD", FMT_RD_RS1_IMM, FU_ALU, SRC_RS1, MEM },
+  [OP_ADD] = { "ADD", FMT_RD_RS1_RS2, FU_ALU, SRC_RS1 | SRC_RS2, EX },
+  [OP_SUB] = { "SUB", FMT_RD_RS1_RS2, FU_ALU, SRC_RS1 | SRC_RS2, EX },
+  [OP_AND] = { "AND", FMT_RD_RS1_RS2, FU_ALU, SRC_RS1 | SRC_RS2, EX },
+  [OP_OR] = { "OR", FMT_RD_RS1_RS2, FU_ALU, SRC_RS1 | SRC_RS2, EX },
+  [OP_EXOR] = { "EX-OR", FMT_RD_RS1_RS2, FU_ALU, SRC_RS1 | SRC_RS2, EX },
+  [OP_MUL] = { "MUL", FMT_RD_RS1_RS2, FU_MUL, SRC_RS1 | SRC_RS2, EX },
+  [OP_BZ] = { "BZ", FMT_IMM, FU_ALU, 0, -1 },
+  [OP_BNZ] = { "BNZ", FMT_IMM, FU_ALU, 0, -1 },
+  [OP_JUMP] = { "JUMP", FMT_RS1_IMM, FU_ALU, SRC_RS1, -1 },
+  [OP_HALT] = { "HALT", FMT_NONE, FU_ALU, 0, -1 },
+  [OP_DIV] = { "DIV", FMT_RD_RS1_RS2, FU_DIV, SRC_RS1 | SRC_RS2, EX },
+};
+
+/* Operand kinds expected by each format, in source order */
+enum
+{
+  OPND_END,
+  OPND_RD,
+  OPND_RS1,
+  OPND_RS2,
+  OPND_IMM
+};
+
+static const char format_operands[][4] = {
+  [FMT_NONE] = { OPND_END },
+  [FMT_RD_IMM] = { OPND_RD, OPND_IMM, OPND_END },
+  [FMT_RS1_RS2_IMM] = { OPND_RS1, OPND_RS2, OPND_IMM, OPND_END },
+  [FMT_RD_RS1_IMM] = { OPND_RD, OPND_RS1, OPND_IMM, OPND_END },
+  [FMT_RD_RS1_RS2] = { OPND_RD, OPND_RS1, OPND_RS2, OPND_END },
+  [FMT_IMM] = { OPND_IMM, OPND_END },
+  [FMT_RS1_IMM] = { OPND_RS1, OPND_IMM, OPND_END },
+};
+
+/* Cursor over the assembly text, which is not NUL terminated */
+typedef struct Parser
+{
+  const char* p;
+  const char* end;
+  const char* filename;
+  int line;
+  int errors;
+} Parser;
+
+static void
+parse_error(Parser* ps, const char* msg)
+{
+  if (ps->errors < 20) {
+    fprintf(stderr, "APEX_Error : %s:%d: %s\n", ps->filename, ps->line, msg);
+  }
+  ps->errors++;
+}
+
+static int
+at_line_end(const Parser* ps)
+{
+  return ps->p == ps->end || *ps->p == '\n';
+}
+
+static void
+skip_blanks(Parser* ps)
+{
+  while (ps->p < ps->end && (*ps->p == ' ' || *ps->p == '\t' || *ps->p == '\r')) {
+    ps->p++;
+  }
+}
+
 /*
- * This function is related to parsing input file
+ * Maps a mnemonic onto its opcode enum
  *
- * Note : You are not supposed to edit this function
+ * Returns -1 for unknown mnemonics
  */
 static int
-get_num_from_string(char* buffer)
+lookup_opcode(const char* name, size_t len)
 {
-  char str[16];
-  int j = 0;
-  for (int i = 1; buffer[i] != '\0'; ++i) {
-    str[j] = buffer[i];
-    j++;
+  for (int op = 0; op < NUM_OPCODES; ++op) {
+    const char* candidate = opcode_info[op].name;
+    if (candidate[0] == name[0] && strlen(candidate) == len &&
+        memcmp(candidate, name, len) == 0) {
+      return op;
+    }
   }
-  str[j] = '\0';
-  return atoi(str);
+  return -1;
 }
 
 /*
- * This function is related to parsing input file
+ * Parses a register ("R<n>") or literal ("#<n>") operand
  *
- * Note : you can edit this function to add new instructions
+ * Returns 0 on success, -1 on a malformed operand
  */
-static void
-create_APEX_instruction(APEX_Instruction* ins, char* buffer)
-{
-  char* token = strtok(buffer, ",");
-  int token_num = 0;
-  char tokens[6][128];
-  while (token != NULL) {
-    strcpy(tokens[token_num], token);
-    token_num++;
-    token = strtok(NULL, ",");
-  }
-
-  strcpy(ins->opcode, tokens[0]);
-
-  if (strcmp(ins->opcode, "MOVC") == 0) {
-    ins->rd = get_num_from_string(tokens[1]);
-    ins->imm = get_num_from_string(tokens[2]);
-      ins->rs1=-1;
-      ins->rs2=-1;
-      
-  }
-
-  if (strcmp(ins->opcode, "STORE") == 0) {
-      ins->rd = -1;
-    ins->rs1 = get_num_from_string(tokens[1]);
-    ins->rs2 = get_num_from_string(tokens[2]);
-    ins->imm = get_num_from_string(tokens[3]);
-  }
-    
-    if (strcmp(ins->opcode, "LOAD") == 0) {
-        ins->rd = get_num_from_string(tokens[1]);
-        ins->rs1= get_num_from_string(tokens[2]);
-        ins->imm = get_num_from_string(tokens[3]);
-        ins->rs2=-1;
-        
-    }
+static int
+parse_operand(Parser* ps, char prefix, int* value)
+{
+  skip_blanks(ps);
+  if (ps->p == ps->end || (*ps->p != prefix && *ps->p != (prefix | 0x20))) {
+    return -1;
+  }
+  ps->p++;
 
-    if (strcmp(ins->opcode, "ADD") == 0) {
-        ins->rd = get_num_from_string(tokens[1]);
-        ins->rs1 = get_num_from_string(tokens[2]);
-        ins->rs2 = get_num_from_string(tokens[3]);
-        ins->imm = -1;
-    }
-    
-    if (strcmp(ins->opcode, "SUB") == 0) {
-        ins->rd = get_num_from_string(tokens[1]);
-        ins->rs1 = get_num_from_string(tokens[2]);
-        ins->rs2 = get_num_from_string(tokens[3]);
-        ins->imm = -1;
-    }
-    
-    if (strcmp(ins->opcode, "AND") == 0) {
-        ins->rd = get_num_from_string(tokens[1]);
-        ins->rs1 = get_num_from_string(tokens[2]);
-        ins->rs2 = get_num_from_string(tokens[3]);
-        ins->imm = -1;
-    }
-    
-    if (strcmp(ins->opcode, "OR") == 0) {
-        ins->rd = get_num_from_string(tokens[1]);
-        ins->rs1 = get_num_from_string(tokens[2]);
-        ins->rs2 = get_num_from_string(tokens[3]);
-        ins->imm = -1;
+  int negative = 0;
+  if (ps->p < ps->end && (*ps->p == '-' || *ps->p == '+')) {
+    negative = *ps->p == '-';
+    ps->p++;
+  }
+
+  const char* digits = ps->p;
+  long long v = 0;
+  while (ps->p < ps->end && *ps->p >= '0' && *ps->p <= '9') {
+    v = v * 10 + (*ps->p - '0');
+    if (v > 0x80000000LL) {
+      return -1;
     }
-    
-    if (strcmp(ins->opcode, "EX-OR") == 0) {
-        ins->rd = get_num_from_string(tokens[1]);
-        ins->rs1 = get_num_from_string(tokens[2]);
-        ins->rs2 = get_num_from_string(tokens[3]);
-        ins->imm = -1;
+    ps->p++;
+  }
+  if (ps->p == digits) {
+    return -1;
+  }
+  v = negative ? -v : v;
+  if (v > 0x7fffffffLL) {
+    return -1;
+  }
+  *value = (int)v;
+  skip_blanks(ps);
+  return 0;
+}
+
+/*
+ * Parses the line at the cursor into ins and leaves the cursor at the
+ * start of the next line. Blank lines become NOPs so that instruction
+ * addresses still follow line numbers.
+ */
+static void
+parse_line(Parser* ps, APEX_Instruction* ins)
+{
+  ins->opcode = OP_NOP;
+  ins->rd = -1;
+  ins->rs1 = -1;
+  ins->rs2 = -1;
+  ins->imm = -1;
+
+  skip_blanks(ps);
+  const char* name = ps->p;
+  while (ps->p < ps->end && *ps->p != ',' && *ps->p != '\n' &&
+         *ps->p != ' ' && *ps->p != '\t' && *ps->p != '\r') {
+    ps->p++;
+  }
+
+  if (ps->p != name) {
+    int op = lookup_opcode(name, ps->p - name);
+    if (op < 0) {
+      char msg[64];
+      snprintf(msg, sizeof(msg), "unknown opcode '%.*s'",
+               (int)(ps->p - name > 32 ? 32 : ps->p - name), name);
+      parse_error(ps, msg);
+      goto next_line;
     }
-    
-    if (strcmp(ins->opcode, "MUL") == 0) {
-        ins->rd = get_num_from_string(tokens[1]);
-        ins->rs1 = get_num_from_string(tokens[2]);
-        ins->rs2 = get_num_from_string(tokens[3]);
-        ins->imm = -1;
+    ins->opcode = op;
+
+    const char* operands = format_operands[opcode_info[op].format];
+    for (int i = 0; operands[i] != OPND_END; ++i) {
+      skip_blanks(ps);
+      if (ps->p == ps->end || *ps->p != ',') {
+        parse_error(ps, "missing operand");
+        goto next_line;
+      }
+      ps->p++;
+
+      int value;
+      if (parse_operand(ps, operands[i] == OPND_IMM ? '#' : 'R', &value) != 0) {
+        parse_error(ps, operands[i] == OPND_IMM ? "expected literal #<n>"
+                                                : "expected register R<n>");
+        goto next_line;
+      }
+      if (operands[i] != OPND_IMM && (value < 0 || value >= REG_FILE_SIZE)) {
+        parse_error(ps, "register out of range");
+        goto next_line;
+      }
+
+      switch (operands[i]) {
+        case OPND_RD:
+          ins->rd = value;
+          break;
+        case OPND_RS1:
+          ins->rs1 = value;
+          break;
+        case OPND_RS2:
+          ins->rs2 = value;
+          break;
+        case OPND_IMM:
+          ins->imm = value;
+          break;
+      }
     }
-    
-    if (strcmp(ins->opcode, "BZ") == 0) {
-        ins->rd = -1;
-        ins->rs1 = -1;
-        ins->rs2 = -1;
-        ins->imm = get_num_from_string(tokens[1]);
+
+    /* A trailing comma is accepted, as in "HALT," */
+    skip_blanks(ps);
+    if (ps->p < ps->end && *ps->p == ',') {
+      ps->p++;
+      skip_blanks(ps);
     }
-    
-    if (strcmp(ins->opcode, "BNZ") == 0) {
-        ins->rd = -1;
-        ins->rs1 = -1;
-        ins->rs2 = -1;
-        ins->imm = get_num_from_string(tokens[1]);
+  }
+
+  if (!at_line_end(ps)) {
+    parse_error(ps, "unexpected text after instruction");
+  }
+
+next_line:
+  while (!at_line_end(ps)) {
+    ps->p++;
+  }
+  if (ps->p < ps->end) {
+    ps->p++;
+  }
+  ps->line++;
+}
+
+/*
+ * Reads a whole file which can not be mapped (a pipe, for instance)
+ */
+static char*
+read_all(int fd, size_t* size)
+{
+  size_t capacity = 1 << 20;
+  size_t used = 0;
+  char* buf = malloc(capacity);
+
+  while (buf) {
+    if (used == capacity) {
+      capacity *= 2;
+      char* grown = realloc(buf, capacity);
+      if (!grown) {
+        free(buf);
+        return NULL;
+      }
+      buf = grown;
     }
-    
-    if (strcmp(ins->opcode, "JUMP") == 0) {
-        ins->rd = -1;
-        ins->rs1 = get_num_from_string(tokens[1]);
-        ins->rs2 = -1;
-        ins->imm = get_num_from_string(tokens[2]);
+    ssize_t n = read(fd, buf + used, capacity - used);
+    if (n < 0) {
+      free(buf);
+      return NULL;
     }
-    
-    if (strcmp(ins->opcode, "HALT") == 0) {
-        ins->rd = -1;
-        ins->rs1 = -1;
-        ins->rs2 = -1;
-        ins->imm = -1;
+    if (n == 0) {
+      break;
     }
+    used += n;
+  }
+  *size = used;
+  return buf;
 }
 
 /*
- * This function is related to parsing input file
+ * Assembles a text program into code memory, in a single pass over the
+ * mapped file. Malformed lines are reported with their line number.
  *
- * Note : You are not supposed to edit this function
+ * Returns NULL if the file can not be read, is empty or has errors
  */
 APEX_Instruction*
 create_code_memory(const char* filename, int* size)
@@ -156,40 +299,218 @@ create_code_memory(const char* filename, int* size)
     return NULL;
   }
 
-  FILE* fp = fopen(filename, "r");
-  if (!fp) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  struct stat st;
+  size_t text_size = 0;
+  char* text = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    text_size = st.st_size;
+    text = mmap(NULL, text_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (text != MAP_FAILED) {
+      madvise(text, text_size, MADV_SEQUENTIAL);
+    }
+  }
+  int mapped = text != MAP_FAILED;
+  if (!mapped) {
+    text = read_all(fd, &text_size);
+  }
+  close(fd);
+  if (!text) {
     return NULL;
   }
 
-  char* line = NULL;
-  size_t len = 0;
-  ssize_t nread;
-  int code_memory_size = 0;
+  Parser ps;
+  ps.p = text;
+  ps.end = text + text_size;
+  ps.filename = filename;
+  ps.line = 1;
+  ps.errors = 0;
+
+  /* Roughly 16 characters per instruction, grown geometrically after that */
+  size_t capacity = text_size / 16 + 16;
+  size_t count = 0;
+  APEX_Instruction* code_memory = malloc(sizeof(*code_memory) * capacity);
 
-  while ((nread = getline(&line, &len, fp)) != -1) {
-    code_memory_size++;
+  while (code_memory && ps.p < ps.end) {
+    if (count == capacity) {
+      capacity *= 2;
+      APEX_Instruction* grown = realloc(code_memory, sizeof(*code_memory) * capacity);
+      if (!grown) {
+        free(code_memory);
+        code_memory = NULL;
+        break;
+      }
+      code_memory = grown;
+    }
+    parse_line(&ps, &code_memory[count++]);
   }
-  *size = code_memory_size;
-  if (!code_memory_size) {
-    fclose(fp);
+
+  if (mapped) {
+    munmap(text, text_size);
+  } else {
+    free(text);
+  }
+
+  if (ps.errors > 20) {
+    fprintf(stderr, "APEX_Error : %s: %d errors in total\n", filename, ps.errors);
+  }
+  if (!code_memory || ps.errors || count == 0 || count > 0x7fffffff) {
+    free(code_memory);
     return NULL;
   }
 
-  APEX_Instruction* code_memory =
-    malloc(sizeof(*code_memory) * code_memory_size);
-  if (!code_memory) {
-    fclose(fp);
+  *size = count;
+  return code_memory;
+}
+
+/*
+ * Writes code memory out as a binary program image, which
+ * map_code_image() can load without any parsing
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int
+write_code_image(const char* filename, const APEX_Instruction* code_memory, int size)
+{
+  FILE* fp = fopen(filename, "wb");
+  if (!fp) {
+    return -1;
+  }
+
+  Code_Image_Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, APEX_IMAGE_MAGIC, 4);
+  header.version = APEX_IMAGE_VERSION;
+  header.size = size;
+
+  int ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+           fwrite(code_memory, sizeof(*code_memory), size, fp) == (size_t)size;
+  if (fclose(fp) != 0 || !ok) {
+    return -1;
+  }
+  return 0;
+}
+
+/* 1 if reg is a register when the format has the operand, else -1 */
+static int
+valid_register(int reg, int used)
+{
+  return used ? reg >= 0 && reg < REG_FILE_SIZE : reg == -1;
+}
+
+/*
+ * 1 if ins could have come from the parser: a known opcode, and exactly
+ * the registers its format names. The stages index opcode_info with the
+ * opcode and the register file and scoreboard masks with the registers.
+ */
+static int
+valid_instruction(const APEX_Instruction* ins)
+{
+  if (ins->opcode >= NUM_OPCODES) {
+    return 0;
+  }
+
+  int used[OPND_IMM + 1] = { 0 };
+  for (const char* op = format_operands[opcode_info[ins->opcode].format]; *op != OPND_END; ++op) {
+    used[(int)*op] = 1;
+  }
+  return valid_register(ins->rd, used[OPND_RD]) &&
+         valid_register(ins->rs1, used[OPND_RS1]) &&
+         valid_register(ins->rs2, used[OPND_RS2]);
+}
+
+/*
+ * Maps a binary program image written by write_code_image(). The
+ * returned code memory points into the read-only mapping, nothing is
+ * copied.
+ */
+APEX_Instruction*
+map_code_image(const char* filename, int* size)
+{
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
     return NULL;
   }
 
-  rewind(fp);
-  int current_instruction = 0;
-  while ((nread = getline(&line, &len, fp)) != -1) {
-    create_APEX_instruction(&code_memory[current_instruction], line);
-    current_instruction++;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Code_Image_Header)) {
+    close(fd);
+    return NULL;
+  }
+
+  char* image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED) {
+    return NULL;
   }
 
-  free(line);
-  fclose(fp);
+  const Code_Image_Header* header = (const Code_Image_Header*)image;
+  APEX_Instruction* code_memory = (APEX_Instruction*)(image + sizeof(*header));
+  int ok = memcmp(header->magic, APEX_IMAGE_MAGIC, 4) == 0 &&
+           header->version == APEX_IMAGE_VERSION &&
+           header->size > 0 && header->size <= INT_MAX &&
+           (size_t)st.st_size == sizeof(*header) + sizeof(*code_memory) * (size_t)header->size;
+
+  /* Only the instructions the header claims, now known to be in the file */
+  for (uint32_t i = 0; ok && i < header->size; ++i) {
+    ok = valid_instruction(&code_memory[i]);
+  }
+
+  if (!ok) {
+    fprintf(stderr, "APEX_Error : %s is a corrupt program image\n", filename);
+    munmap(image, st.st_size);
+    return NULL;
+  }
+
+  madvise(image, st.st_size, MADV_SEQUENTIAL);
+  *size = header->size;
   return code_memory;
 }
+
+/*
+ * Creates code memory from either a binary program image or assembly
+ * text, whichever the file holds. *mapped tells release_code_memory()
+ * how to free it.
+ */
+APEX_Instruction*
+load_code_memory(const char* filename, int* size, int* mapped)
+{
+  if (!filename) {
+    return NULL;
+  }
+
+  /* Only regular files are sniffed, a pipe can not be read twice */
+  char magic[4] = { 0 };
+  size_t nread = 0;
+  struct stat st;
+  if (stat(filename, &st) == 0 && S_ISREG(st.st_mode)) {
+    FILE* fp = fopen(filename, "rb");
+    if (!fp) {
+      return NULL;
+    }
+    nread = fread(magic, 1, sizeof(magic), fp);
+    fclose(fp);
+  }
+
+  if (nread == sizeof(magic) && memcmp(magic, APEX_IMAGE_MAGIC, 4) == 0) {
+    *mapped = 1;
+    return map_code_image(filename, size);
+  }
+  *mapped = 0;
+  return create_code_memory(filename, size);
+}
+
+void
+release_code_memory(APEX_Instruction* code_memory, int size, int mapped)
+{
+  if (mapped) {
+    munmap((char*)code_memory - sizeof(Code_Image_Header),
+           sizeof(Code_Image_Header) + sizeof(*code_memory) * (size_t)size);
+  } else {
+    free(code_memory);
+  }
+}
@@ -0,0 +1,440 @@
+/*
+ *  functional.c
+ *  Contains the functional (ISA level) model of the APEX cpu, used to
+ *  fast-forward through code whose timing is of no interest
+ *
+ *  Code memory is split into basic blocks ending at BZ, BNZ, JUMP or
+ *  HALT, or after BLOCK_MAX instructions. Each block is translated once, on first entry, into micro-ops
+ *  which hold the address of their handler, so that executing a block
+ *  is a chain of indirect jumps with no decoding. A block keeps pointers
+ *  to the blocks it branched to, so a loop goes from block to block
+ *  without looking its successor up again.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+
+/* Pre-decoded instruction, op is the label of its handler */
+typedef struct APEX_Uop
+{
+  const void* op;
+  int8_t rd;
+  int8_t rs1;
+  int8_t rs2;
+  int32_t imm;		// BZ/BNZ: the taken target pc
+} APEX_Uop;
+
+typedef struct APEX_Block
+{
+  int pc;		// pc of the first instruction
+  int count;		// Instructions, the block ends with one more uop
+			// which falls through if no branch ends it
+  struct APEX_Block* next[2];	// Fall-through and taken successors, once known
+  APEX_Uop uops[];
+} APEX_Block;
+
+/* Blocks by the code memory index they start at */
+typedef struct APEX_BlockCache
+{
+  const APEX_Instruction* code;	// Code memory the blocks were translated from
+  int size;
+  APEX_Block** blocks;
+} APEX_BlockCache;
+
+/* Handler labels of the opcodes, then of falling out of a block */
+#define UOP_END NUM_OPCODES
+
+/* Bounds the cost of translating a block which is entered part way */
+#define BLOCK_MAX 64
+
+/*
+ * Translates the block starting at code memory index
+ *
+ * Returns NULL on failure
+ */
+static APEX_Block*
+translate(const APEX_CPU* cpu, int index, const void* const* labels)
+{
+  int end = index;
+  while (end < cpu->code_memory_size && end - index < BLOCK_MAX) {
+    int opcode = cpu->code_memory[end++].opcode;
+    if (opcode == OP_BZ || opcode == OP_BNZ || opcode == OP_JUMP || opcode == OP_HALT) {
+      break;
+    }
+  }
+  int count = end - index;
+  int last = cpu->code_memory[end - 1].opcode;
+  int ends_code = !(last == OP_BZ || last == OP_BNZ || last == OP_JUMP || last == OP_HALT);
+
+  APEX_Block* b = calloc(1, sizeof(*b) + (count + 1) * sizeof(APEX_Uop));
+  if (!b) {
+    return NULL;
+  }
+  b->pc = 4000 + 4 * index;
+  b->count = count;
+  for (int i = 0; i < count; ++i) {
+    const APEX_Instruction* ins = &cpu->code_memory[index + i];
+    APEX_Uop* u = &b->uops[i];
+    u->op = labels[ins->opcode];
+    u->rd = ins->rd;
+    u->rs1 = ins->rs1;
+    u->rs2 = ins->rs2;
+    u->imm = ins->imm;
+    if (ins->opcode == OP_BZ || ins->opcode == OP_BNZ) {
+      u->imm = b->pc + 4 * i + ins->imm;
+    }
+  }
+  if (ends_code) {
+    b->uops[count].op = labels[UOP_END];
+  }
+  return b;
+}
+
+/*
+ * Returns the block starting at pc, translating it on first use. NULL if
+ * pc is outside code memory or the block can not be translated.
+ */
+static APEX_Block*
+lookup(const APEX_CPU* cpu, APEX_BlockCache* cache, int pc, const void* const* labels)
+{
+  int index = pc_to_index(cpu, pc);
+  if (!cache || index < 0) {
+    return NULL;
+  }
+  if (!cache->blocks[index]) {
+    cache->blocks[index] = translate(cpu, index, labels);
+  }
+  return cache->blocks[index];
+}
+
+/* Returns the translations of cpu's code memory, NULL on failure */
+static APEX_BlockCache*
+block_cache(APEX_CPU* cpu)
+{
+  APEX_BlockCache* cache = cpu->blocks;
+  if (cache && cache->code == cpu->code_memory && cache->size == cpu->code_memory_size) {
+    return cache;
+  }
+
+  /* Code memory was reloaded, its old translations are stale */
+  APEX_blocks_free(cpu);
+  cache = calloc(1, sizeof(*cache));
+  if (!cache) {
+    return NULL;
+  }
+  cache->blocks = calloc(cpu->code_memory_size + 1, sizeof(*cache->blocks));
+  if (!cache->blocks) {
+    free(cache);
+    return NULL;
+  }
+  cache->code = cpu->code_memory;
+  cache->size = cpu->code_memory_size;
+  cpu->blocks = cache;
+  return cache;
+}
+
+/* Releases the translations of cpu's code memory */
+void
+APEX_blocks_free(APEX_CPU* cpu)
+{
+  APEX_BlockCache* cache = cpu->blocks;
+  if (!cache) {
+    return;
+  }
+  for (int i = 0; i < cache->size; ++i) {
+    free(cache->blocks[i]);
+  }
+  free(cache->blocks);
+  free(cache);
+  cpu->blocks = NULL;
+}
+
+/*
+ * Executes the instruction at pc, whose code memory index is index
+ *
+ * Returns the next pc, or -1 to stop before the instruction
+ */
+static int
+step(APEX_CPU* cpu, int index, int pc, int* z)
+{
+  const APEX_Instruction* ins = &cpu->code_memory[index];
+  int* regs = cpu->regs;
+  APEX_DataMemory* mem = &cpu->data_memory;
+  int next_pc = pc + 4;
+
+  switch (ins->opcode) {
+    case OP_MOVC:
+      regs[ins->rd] = ins->imm;
+      break;
+
+    case OP_STORE: {
+      int address = regs[ins->rs2] + ins->imm;
+      if (!APEX_dmem_in_range(mem, address) || APEX_dmem_write(mem, address, regs[ins->rs1]) != 0) {
+        return -1;
+      }
+      break;
+    }
+
+    case OP_LOAD: {
+      int address = regs[ins->rs1] + ins->imm;
+      if (!APEX_dmem_in_range(mem, address)) {
+        return -1;
+      }
+      regs[ins->rd] = APEX_dmem_read(mem, address);
+      break;
+    }
+
+    case OP_ADD:
+      regs[ins->rd] = regs[ins->rs1] + regs[ins->rs2];
+      *z = regs[ins->rd] == 0;
+      break;
+
+    case OP_SUB:
+      regs[ins->rd] = regs[ins->rs1] - regs[ins->rs2];
+      *z = regs[ins->rd] == 0;
+      break;
+
+    case OP_MUL:
+      regs[ins->rd] = regs[ins->rs1] * regs[ins->rs2];
+      *z = regs[ins->rd] == 0;
+      break;
+
+    case OP_DIV:
+      regs[ins->rd] = APEX_divide(regs[ins->rs1], regs[ins->rs2]);
+      *z = regs[ins->rd] == 0;
+      break;
+
+    case OP_AND:
+      regs[ins->rd] = regs[ins->rs1] & regs[ins->rs2];
+      break;
+
+    case OP_OR:
+      regs[ins->rd] = regs[ins->rs1] | regs[ins->rs2];
+      break;
+
+    case OP_EXOR:
+      regs[ins->rd] = regs[ins->rs1] ^ regs[ins->rs2];
+      break;
+
+    case OP_BZ:
+      if (*z) {
+        next_pc = pc + ins->imm;
+      }
+      break;
+
+    case OP_BNZ:
+      if (!*z) {
+        next_pc = pc + ins->imm;
+      }
+      break;
+
+    case OP_JUMP:
+      next_pc = regs[ins->rs1] + ins->imm;
+      break;
+
+    case OP_HALT:
+      /* Leave the HALT for the pipeline to drain */
+      return -1;
+
+    case OP_NOP:
+      break;
+  }
+  return next_pc;
+}
+
+/*
+ * Executes instructions straight from code memory into the architectural
+ * state (regs, z_flag, data_memory) without modelling the pipeline.
+ *
+ * Stops before executing the instruction at stop_pc, before a HALT or a
+ * LOAD/STORE outside data memory (both are left for the pipeline), when
+ * the pc leaves code memory, or once max_ins instructions have executed.
+ * Pass -1 for either limit to disable it. The pipeline is then emptied so
+ * APEX_cpu_run() continues cycle-accurately from the current pc.
+ *
+ * Whole blocks run as translated code, a block which would cross one of
+ * the limits is stepped an instruction at a time instead.
+ *
+ * Returns the number of instructions executed
+ */
+long
+APEX_cpu_fastforward(APEX_CPU* cpu, long max_ins, int stop_pc)
+{
+  static const void* const labels[NUM_OPCODES + 1] = {
+    [OP_NOP] = &&op_nop,
+    [OP_MOVC] = &&op_movc,
+    [OP_STORE] = &&op_store,
+    [OP_LOAD] = &&op_load,
+    [OP_ADD] = &&op_add,
+    [OP_SUB] = &&op_sub,
+    [OP_MUL] = &&op_mul,
+    [OP_DIV] = &&op_div,
+    [OP_AND] = &&op_and,
+    [OP_OR] = &&op_or,
+    [OP_EXOR] = &&op_exor,
+    [OP_BZ] = &&op_bz,
+    [OP_BNZ] = &&op_bnz,
+    [OP_JUMP] = &&op_jump,
+    [OP_HALT] = &&op_stop,
+    [UOP_END] = &&op_end,
+  };
+
+  int pc = cpu->pc;
+  int* regs = cpu->regs;
+  APEX_DataMemory* mem = &cpu->data_memory;
+  int z = cpu->z_flag[0];
+  long count = 0;
+  APEX_BlockCache* cache = block_cache(cpu);
+  int stop_index = (stop_pc - 4000) % 4 == 0 ? pc_to_index(cpu, stop_pc) : -1;
+  APEX_Block* b = NULL;
+  const APEX_Uop* u;
+
+  while (count != max_ins && pc != stop_pc) {
+    int index = pc_to_index(cpu, pc);
+    if (index < 0) {
+      break;
+    }
+
+    if (!b || b->pc != pc) {
+      b = lookup(cpu, cache, pc, labels);
+    }
+    if (!b || b->pc != pc || (max_ins >= 0 && max_ins - count < b->count) ||
+        (stop_index > index && stop_index < index + b->count)) {
+      /* No translation, or the block runs past a limit */
+      int next_pc = step(cpu, index, pc, &z);
+      if (next_pc < 0) {
+        break;
+      }
+      pc = next_pc;
+      count++;
+      b = NULL;
+      continue;
+    }
+
+    u = b->uops;
+    goto *u->op;
+
+#define NEXT() goto *(++u)->op
+
+  op_nop:
+    NEXT();
+
+  op_movc:
+    regs[u->rd] = u->imm;
+    NEXT();
+
+  op_store: {
+      int address = regs[u->rs2] + u->imm;
+      if (!APEX_dmem_in_range(mem, address) || APEX_dmem_write(mem, address, regs[u->rs1]) != 0) {
+        goto op_stop;
+      }
+      NEXT();
+    }
+
+  op_load: {
+      int address = regs[u->rs1] + u->imm;
+      if (!APEX_dmem_in_range(mem, address)) {
+        goto op_stop;
+      }
+      regs[u->rd] = APEX_dmem_read(mem, address);
+      NEXT();
+    }
+
+  op_add:
+    regs[u->rd] = regs[u->rs1] + regs[u->rs2];
+    z = regs[u->rd] == 0;
+    NEXT();
+
+  op_sub:
+    regs[u->rd] = regs[u->rs1] - regs[u->rs2];
+    z = regs[u->rd] == 0;
+    NEXT();
+
+  op_mul:
+    regs[u->rd] = regs[u->rs1] * regs[u->rs2];
+    z = regs[u->rd] == 0;
+    NEXT();
+
+  op_div:
+    regs[u->rd] = APEX_divide(regs[u->rs1], regs[u->rs2]);
+    z = regs[u->rd] == 0;
+    NEXT();
+
+  op_and:
+    regs[u->rd] = regs[u->rs1] & regs[u->rs2];
+    NEXT();
+
+  op_or:
+    regs[u->rd] = regs[u->rs1] | regs[u->rs2];
+    NEXT();
+
+  op_exor:
+    regs[u->rd] = regs[u->rs1] ^ regs[u->rs2];
+    NEXT();
+
+#undef NEXT
+
+  op_bz:
+    count += b->count;
+    if (z) {
+      pc = u->imm;
+      goto taken;
+    }
+    pc = b->pc + 4 * b->count;
+    goto fall_through;
+
+  op_bnz:
+    count += b->count;
+    if (!z) {
+      pc = u->imm;
+      goto taken;
+    }
+    pc = b->pc + 4 * b->count;
+    goto fall_through;
+
+  taken:
+    /* Chain the successor, it is checked against the limits as usual */
+    if (!b->next[1]) {
+      b->next[1] = lookup(cpu, cache, pc, labels);
+    }
+    b = b->next[1];
+    continue;
+
+  fall_through:
+    if (!b->next[0]) {
+      b->next[0] = lookup(cpu, cache, pc, labels);
+    }
+    b = b->next[0];
+    continue;
+
+  op_jump:
+    if (regs[u->rs1] + u->imm < 0) {
+      goto op_stop;
+    }
+    count += b->count;
+    pc = regs[u->rs1] + u->imm;
+    b = NULL;
+    continue;
+
+  op_end:
+    /* Straight line code continues in the next block, if any */
+    count += b->count;
+    pc = b->pc + 4 * b->count;
+    goto fall_through;
+
+  op_stop:
+    /* Stop before the HALT, a LOAD/STORE outside data memory, a STORE
+     * whose page can not be allocated or a JUMP to a negative pc */
+    count += u - b->uops;
+    pc = b->pc + 4 * (int)(u - b->uops);
+    break;
+  }
+
+  cpu->pc = pc;
+  cpu->z_flag[0] = z;
+  cpu->ff_completed += count;
+  APEX_cpu_reset_pipeline(cpu);
+  return count;
+}
@@ -0,0 +1,399 @@
+/*
+ *  lockstep.c
+ *  Contains the lockstep engine: one program run functionally by
+ *  LOCKSTEP_LANES instances at a time, which share every fetch and decode
+ *
+ *  When the lanes of a group branch different ways they split, and the
+ *  lanes with the lowest pc always run next. Lanes which took the shorter
+ *  path thus wait where the paths join until the others catch up, and
+ *  the group runs as one vector again from there.
+ */
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "lockstep.h"
+
+typedef int32_t APEX_Vec __attribute__((vector_size(LOCKSTEP_LANES * sizeof(int32_t))));
+
+typedef struct APEX_Group
+{
+  APEX_Vec regs[32];
+  APEX_Vec z;			// -1 in the lanes whose flag is set
+  APEX_Instance* lane[LOCKSTEP_LANES];
+  int pc[LOCKSTEP_LANES];
+  long count[LOCKSTEP_LANES];
+  unsigned running;		// Lanes not stopped yet
+
+  /* Lanes executing together from pc_active. Their pc and count are only
+   * written back by settle(), epoch is the steps taken since. */
+  unsigned active;
+  APEX_Vec mask;		// -1 in the active lanes
+  int pc_active;
+  long epoch;
+  long budget;			// Steps before an active lane reaches max_ins
+  int pc_waiting;		// Lowest pc of the running lanes not active
+} APEX_Group;
+
+/* a in the lanes of mask, b elsewhere. A macro, as a function returning
+ * a vector wider than the build's vector registers changes the ABI. */
+#define blend(mask, a, b) (((a) & (mask)) | ((b) & ~(mask)))
+
+/* Writes back the pc and count of the active lanes, none is active after */
+static void
+settle(APEX_Group* g)
+{
+  for (int l = 0; l < LOCKSTEP_LANES; ++l) {
+    if (g->active >> l & 1) {
+      g->pc[l] = g->pc_active;
+      g->count[l] += g->epoch;
+    }
+  }
+  g->active = 0;
+  g->epoch = 0;
+}
+
+static void
+stop(APEX_Group* g, unsigned lanes, int status)
+{
+  for (int l = 0; l < LOCKSTEP_LANES; ++l) {
+    if (lanes >> l & 1) {
+      g->lane[l]->status = status;
+    }
+  }
+  g->running &= ~lanes;
+}
+
+/*
+ * Ends the current instruction with the active lanes going separate ways:
+ * the lanes in stopped stop before it with status, the others continue at
+ * their next pc
+ */
+static void
+diverge(APEX_Group* g, const int* next_pc, unsigned stopped, int status)
+{
+  unsigned lanes = g->active & ~stopped;
+  settle(g);
+  stop(g, stopped, status);
+  for (int l = 0; l < LOCKSTEP_LANES; ++l) {
+    if (lanes >> l & 1) {
+      g->pc[l] = next_pc[l];
+      g->count[l]++;
+    }
+  }
+}
+
+/*
+ * Makes the running lanes with the lowest pc active, after stopping those
+ * which reached max_ins
+ *
+ * Returns 0 once no lane is running
+ */
+static int
+schedule(APEX_Group* g, long max_ins)
+{
+  for (int l = 0; l < LOCKSTEP_LANES; ++l) {
+    if ((g->running >> l & 1) && max_ins >= 0 && g->count[l] >= max_ins) {
+      stop(g, 1u << l, LANE_LIMIT);
+    }
+  }
+  if (!g->running) {
+    return 0;
+  }
+
+  int low = INT_MAX;
+  for (int l = 0; l < LOCKSTEP_LANES; ++l) {
+    if ((g->running >> l & 1) && g->pc[l] < low) {
+      low = g->pc[l];
+    }
+  }
+
+  g->pc_active = low;
+  g->pc_waiting = INT_MAX;
+  g->budget = LONG_MAX;
+  for (int l = 0; l < LOCKSTEP_LANES; ++l) {
+    g->mask[l] = 0;
+    if (!(g->running >> l & 1)) {
+      continue;
+    }
+    if (g->pc[l] != low) {
+      g->pc_waiting = g->pc[l] < g->pc_waiting ? g->pc[l] : g->pc_waiting;
+      continue;
+    }
+    g->active |= 1u << l;
+    g->mask[l] = -1;
+    if (max_ins >= 0 && max_ins - g->count[l] < g->budget) {
+      g->budget = max_ins - g->count[l];
+    }
+  }
+  return 1;
+}
+
+/*
+ * Runs the lanes of g until all have stopped
+ *
+ * Returns the number of instructions issued, each for all active lanes
+ */
+static long
+run_group(const APEX_CPU* cpu, APEX_Group* g, long max_ins)
+{
+  APEX_Vec* regs = g->regs;
+  int next_pc[LOCKSTEP_LANES];
+  long steps = 0;
+
+  while (g->active || schedule(g, max_ins)) {
+    int pc = g->pc_active;
+    int index = pc_to_index(cpu, pc);
+
+    /* Let the waiting lanes join in once caught up with */
+    if (g->epoch == g->budget || pc >= g->pc_waiting) {
+      settle(g);
+      continue;
+    }
+    if (index < 0) {
+      unsigned lanes = g->active;
+      settle(g);
+      stop(g, lanes, LANE_LEFT_CODE);
+      continue;
+    }
+
+    const APEX_Instruction* ins = &cpu->code_memory[index];
+    APEX_Vec m = g->mask;
+    APEX_Vec r;
+    unsigned trap = 0;
+    int branch_pc = pc + 4;
+    steps++;
+
+    switch (ins->opcode) {
+      case OP_MOVC:
+        regs[ins->rd] = blend(m, (APEX_Vec){} + ins->imm, regs[ins->rd]);
+        break;
+
+      case OP_STORE:
+        for (int l = 0; l < LOCKSTEP_LANES; ++l) {
+          if (g->active >> l & 1) {
+            APEX_DataMemory* mem = &g->lane[l]->data_memory;
+            int address = regs[ins->rs2][l] + ins->imm;
+            if (!APEX_dmem_in_range(mem, address) ||
+                APEX_dmem_write(mem, address, regs[ins->rs1][l]) != 0) {
+              trap |= 1u << l;
+            }
+          }
+        }
+        break;
+
+      case OP_LOAD:
+        r = regs[ins->rd];
+        for (int l = 0; l < LOCKSTEP_LANES; ++l) {
+          if (g->active >> l & 1) {
+            APEX_DataMemory* mem = &g->lane[l]->data_memory;
+            int address = regs[ins->rs1][l] + ins->imm;
+            if (!APEX_dmem_in_range(mem, address)) {
+              trap |= 1u << l;
+            } else {
+              r[l] = APEX_dmem_read(mem, address);
+            }
+          }
+        }
+        regs[ins->rd] = blend(m, r, regs[ins->rd]);
+        break;
+
+      case OP_ADD:
+        r = regs[ins->rs1] + regs[ins->rs2];
+        regs[ins->rd] = blend(m, r, regs[ins->rd]);
+        g->z = blend(m, r == 0, g->z);
+        break;
+
+      case OP_SUB:
+        r = regs[ins->rs1] - regs[ins->rs2];
+        regs[ins->rd] = blend(m, r, regs[ins->rd]);
+        g->z = blend(m, r == 0, g->z);
+        break;
+
+      case OP_MUL:
+        r = regs[ins->rs1] * regs[ins->rs2];
+        regs[ins->rd] = blend(m, r, regs[ins->rd]);
+        g->z = blend(m, r == 0, g->z);
+        break;
+
+      case OP_DIV:
+        /* No vector divide, and APEX_divide() has its own corner cases */
+        r = regs[ins->rd];
+        for (int l = 0; l < LOCKSTEP_LANES; ++l) {
+          if (g->active >> l & 1) {
+            r[l] = APEX_divide(regs[ins->rs1][l], regs[ins->rs2][l]);
+          }
+        }
+        regs[ins->rd] = blend(m, r, regs[ins->rd]);
+        g->z = blend(m, r == 0, g->z);
+        break;
+
+      case OP_AND:
+        regs[ins->rd] = blend(m, regs[ins->rs1] & regs[ins->rs2], regs[ins->rd]);
+        break;
+
+      case OP_OR:
+        regs[ins->rd] = blend(m, regs[ins->rs1] | regs[ins->rs2], regs[ins->rd]);
+        break;
+
+      case OP_EXOR:
+        regs[ins->rd] = blend(m, regs[ins->rs1] ^ regs[ins->rs2], regs[ins->rd]);
+        break;
+
+      case OP_BZ:
+      case OP_BNZ: {
+        unsigned taken = 0;
+        for (int l = 0; l < LOCKSTEP_LANES; ++l) {
+          if ((g->active >> l & 1) && (g->z[l] != 0) == (ins->opcode == OP_BZ)) {
+            taken |= 1u << l;
+          }
+        }
+        if (taken == g->active) {
+          branch_pc = pc + ins->imm;
+        } else if (taken) {
+          for (int l = 0; l < LOCKSTEP_LANES; ++l) {
+            next_pc[l] = taken >> l & 1 ? pc + ins->imm : pc + 4;
+          }
+          diverge(g, next_pc, 0, LANE_RUNNING);
+          continue;
+        }
+        break;
+      }
+
+      case OP_JUMP: {
+        APEX_Vec target = regs[ins->rs1] + ins->imm;
+        int same = 1;
+        branch_pc = INT_MIN;
+        for (int l = 0; l < LOCKSTEP_LANES; ++l) {
+          if (g->active >> l & 1) {
+            next_pc[l] = target[l];
+            same &= branch_pc == INT_MIN || branch_pc == target[l];
+            branch_pc = target[l];
+          }
+        }
+        if (!same) {
+          diverge(g, next_pc, 0, LANE_RUNNING);
+          continue;
+        }
+        break;
+      }
+
+      case OP_HALT: {
+        unsigned lanes = g->active;
+        steps--;
+        settle(g);
+        stop(g, lanes, LANE_HALTED);
+        continue;
+      }
+
+      case OP_NOP:
+        break;
+    }
+
+    if (trap) {
+      for (int l = 0; l < LOCKSTEP_LANES; ++l) {
+        next_pc[l] = pc + 4;
+      }
+      diverge(g, next_pc, trap, LANE_TRAPPED);
+      continue;
+    }
+    g->pc_active = branch_pc;
+    g->epoch++;
+  }
+  return steps;
+}
+
+/*
+ * Runs the program of cpu on every instance, from the registers, flag and
+ * pc each one holds, until it stops or has executed max_ins instructions
+ * (-1 for no limit). Groups of LOCKSTEP_LANES instances run one after the
+ * other, and every instance keeps its own data memory.
+ *
+ * Returns the number of instructions issued, each to a whole group
+ */
+long
+APEX_lockstep_run(const APEX_CPU* cpu, APEX_Instance* instances, int num_instances, long max_ins)
+{
+  long steps = 0;
+
+  for (int first = 0; first < num_instances; first += LOCKSTEP_LANES) {
+    APEX_Group g;
+    memset(&g, 0, sizeof(g));
+    for (int l = 0; l < LOCKSTEP_LANES && first + l < num_instances; ++l) {
+      APEX_Instance* inst = &instances[first + l];
+      g.lane[l] = inst;
+      g.pc[l] = inst->pc;
+      g.count[l] = inst->ins_completed;
+      g.z[l] = inst->z_flag ? -1 : 0;
+      for (int i = 0; i < 32; ++i) {
+        g.regs[i][l] = inst->regs[i];
+      }
+      g.running |= 1u << l;
+      inst->status = LANE_RUNNING;
+    }
+
+    steps += run_group(cpu, &g, max_ins);
+
+    for (int l = 0; l < LOCKSTEP_LANES && first + l < num_instances; ++l) {
+      APEX_Instance* inst = g.lane[l];
+      inst->pc = g.pc[l];
+      inst->ins_completed = g.count[l];
+      inst->z_flag = g.z[l] != 0;
+      for (int i = 0; i < 32; ++i) {
+        inst->regs[i] = g.regs[i][l];
+      }
+    }
+  }
+  return steps;
+}
+
+static const char*
+status_name(int status)
+{
+  switch (status) {
+    case LANE_RUNNING:
+      return "running";
+    case LANE_HALTED:
+      return "halted";
+    case LANE_TRAPPED:
+      return "trapped";
+    case LANE_LEFT_CODE:
+      return "left code";
+    case LANE_LIMIT:
+      return "limit";
+  }
+  return "?";
+}
+
+/* Prints where every instance stopped, and how full the vectors ran */
+void
+APEX_lockstep_report(FILE* fp, const APEX_Instance* instances, int num_instances, long steps,
+                     double seconds)
+{
+  long long total_ins = 0;
+  int trapped = 0;
+
+  fprintf(fp, "=============== LOCKSTEP SUMMARY ===============\n");
+  fprintf(fp, "| %8s | %-30s | %-9s | %12s | %8s |\n",
+          "Instance", "Data image", "Status", "Retired", "PC");
+  for (int i = 0; i < num_instances; ++i) {
+    const APEX_Instance* inst = &instances[i];
+    fprintf(fp, "| %8d | %-30s | %-9s | %12ld | %8d |\n",
+            i, inst->image ? inst->image : "-", status_name(inst->status),
+            inst->ins_completed, inst->pc);
+    total_ins += inst->ins_completed;
+    trapped += inst->status == LANE_TRAPPED;
+  }
+
+  fprintf(fp, "\nInstances        : %d (%d trapped)\n", num_instances, trapped);
+  fprintf(fp, "Lanes            : %d\n", LOCKSTEP_LANES);
+  fprintf(fp, "Issued           : %ld", steps);
+  if (steps > 0) {
+    fprintf(fp, " (%.1f%% of lanes busy)", 100.0 * total_ins / ((double)steps * LOCKSTEP_LANES));
+  }
+  fprintf(fp, "\nRetired          : %lld\n", total_ins);
+  fprintf(fp, "Wall time        : %.3f s\n", seconds);
+  if (seconds > 0) {
+    fprintf(fp, "Throughput       : %.0f instructions/s\n", total_ins / seconds);
+  }
+}
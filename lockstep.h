@@ -0,0 +1,46 @@
+#ifndef _APEX_LOCKSTEP_H_
+#define _APEX_LOCKSTEP_H_
+/**
+ *  lockstep.h
+ *  Runs one APEX program functionally over many data images at once.
+ *  Instances are packed LOCKSTEP_LANES to a group, whose registers are
+ *  kept as vectors with one lane per instance, so an instruction is
+ *  decoded once and executed for the whole group.
+ */
+#include "cpu.h"
+
+/* 8 lanes of 32 bits fill an AVX2 register, build with
+ * -DLOCKSTEP_LANES=16 for AVX-512 */
+#ifndef LOCKSTEP_LANES
+#define LOCKSTEP_LANES 8
+#endif
+
+enum
+{
+  LANE_RUNNING,
+  LANE_HALTED,		// Stopped at a HALT
+  LANE_TRAPPED,		// Stopped at a LOAD/STORE outside data memory
+  LANE_LEFT_CODE,	// The pc left code memory
+  LANE_LIMIT,		// Executed the maximum number of instructions
+};
+
+/* One instance of the program and its own data */
+typedef struct APEX_Instance
+{
+  const char* image;		// Data image it started from, NULL for none
+  APEX_DataMemory data_memory;
+  int regs[32];
+  int z_flag;
+  int pc;			// Once stopped, the instruction it stopped before
+  int status;			// One of LANE_*
+  long ins_completed;
+} APEX_Instance;
+
+long
+APEX_lockstep_run(const APEX_CPU* cpu, APEX_Instance* instances, int num_instances, long max_ins);
+
+void
+APEX_lockstep_report(FILE* fp, const APEX_Instance* instances, int num_instances, long steps,
+                     double seconds);
+
+#endif
@@ -8,54 +8,357 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "batch.h"
 #include "cpu.h"
+#include "lockstep.h"
+#include "sweep.h"
+#include "trace.h"
 
-char *allocCat(const char* const s1){
-    char* str = (char*)malloc(strlen(s1)+1);
-    strcpy(str, s1);
-    return str;
+static void
+usage(const char* prog)
+{
+  fprintf(stderr, "APEX_Help : Usage %s <input_file> simulate|display <cycles> [options]\n", prog);
+  fprintf(stderr, "            --ff <n>       fast-forward <n> instructions functionally first\n");
+  fprintf(stderr, "            --ff-pc <pc>   fast-forward functionally until <pc> is reached\n");
+  fprintf(stderr, "            --save <file>  write a checkpoint, see --save-at\n");
+  fprintf(stderr, "            --save-at <n>  cycle at which --save is taken (default 0)\n");
+  fprintf(stderr, "            --restore <file> resume from a checkpoint of <input_file>\n");
+  fprintf(stderr, "            --trace <file> write a binary pipeline trace, see apex_trace\n");
+  fprintf(stderr, "            --stats <file> write the performance counters as JSON\n");
+  fprintf(stderr, "            --data-in <file> map a raw image of 32-bit words as data memory\n");
+  fprintf(stderr, "            --state-out <file> write the final registers and data memory\n");
+  fprintf(stderr, "            --config <file> configure the model from key=value lines\n");
+  fprintf(stderr, "            --set <key>=<value> configure the model, e.g. bpred=gshare\n");
+  fprintf(stderr, "            %s --batch <jobs_file> [-j <threads>]\n", prog);
+  fprintf(stderr, "            %s --sweep <sweep_file> [-j <threads>] [--json]\n", prog);
+  fprintf(stderr, "            %s --assemble <input_file> <image_file>\n", prog);
+  fprintf(stderr, "            %s --lockstep <input_file> <max_ins> [--config <file>] [--set <key>=<value>]\n", prog);
+  fprintf(stderr, "                       [--state-out <prefix>] <data_image>...\n");
+  exit(1);
+}
+
+/*
+ * Batch mode, runs every job of the batch file in this process and prints
+ * one aggregated report
+ */
+static int
+run_batch(int argc, char const* argv[])
+{
+  const char* jobs_file = argv[2];
+  int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+  for (int i = 3; i < argc; ++i) {
+    if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      num_threads = atoi(argv[++i]);
+    } else {
+      usage(argv[0]);
+    }
+  }
+
+  int num_jobs = 0;
+  APEX_Job* jobs = APEX_batch_load(jobs_file, &num_jobs);
+  if (!jobs) {
+    exit(1);
+  }
+
+  double seconds = APEX_batch_run(jobs, num_jobs, num_threads);
+  APEX_batch_report(stdout, jobs, num_jobs, seconds);
+  APEX_batch_free(jobs, num_jobs);
+  return 0;
+}
+
+/*
+ * Sweep mode, runs the programs of the sweep file at every point of its
+ * grid of settings and prints a CSV or JSON row per point
+ */
+static int
+run_sweep(int argc, char const* argv[])
+{
+  int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int json = 0;
+
+  for (int i = 3; i < argc; ++i) {
+    if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      num_threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--json") == 0) {
+      json = 1;
+    } else {
+      usage(argv[0]);
+    }
+  }
+
+  APEX_Sweep* sweep = APEX_sweep_load(argv[2]);
+  if (!sweep) {
+    exit(1);
+  }
+  int num_jobs = 0;
+  APEX_Job* jobs = APEX_sweep_jobs(sweep, &num_jobs);
+  if (!jobs) {
+    exit(1);
+  }
+
+  APEX_batch_run(jobs, num_jobs, num_threads);
+  if (json) {
+    APEX_sweep_write_json(stdout, sweep, jobs);
+  } else {
+    APEX_sweep_write_csv(stdout, sweep, jobs);
+  }
+  APEX_batch_free(jobs, num_jobs);
+  APEX_sweep_free(sweep);
+  return 0;
+}
+
+/*
+ * Assembles a text program into a binary program image, which later runs
+ * load directly by mapping it
+ */
+static int
+run_assemble(int argc, char const* argv[])
+{
+  if (argc != 4) {
+    usage(argv[0]);
+  }
+
+  int size = 0;
+  APEX_Instruction* code_memory = create_code_memory(argv[2], &size);
+  if (!code_memory) {
+    fprintf(stderr, "APEX_Error : Unable to parse %s\n", argv[2]);
+    exit(1);
+  }
+  if (write_code_image(argv[3], code_memory, size) != 0) {
+    fprintf(stderr, "APEX_Error : Unable to write %s\n", argv[3]);
+    exit(1);
+  }
+  free(code_memory);
+  return 0;
+}
+
+/*
+ * Lockstep mode, runs the program functionally once per data image, many
+ * images at a time, and prints where each one stopped. --state-out writes
+ * the state of instance i to <prefix>.<i>.
+ */
+static int
+run_lockstep(int argc, char const* argv[])
+{
+  if (argc < 4) {
+    usage(argv[0]);
+  }
+
+  APEX_CPU* cpu = APEX_cpu_init(argv[2]);
+  if (!cpu) {
+    fprintf(stderr, "APEX_Error : Unable to initialize CPU\n");
+    exit(1);
+  }
+  long max_ins = atol(argv[3]);
+
+  const char* state_prefix = NULL;
+  const char* images[argc];
+  int num_instances = 0;
+  for (int i = 4; i < argc; ++i) {
+    if (strcmp(argv[i], "--config") == 0 && i + 1 < argc) {
+      if (APEX_config_load(cpu, argv[++i]) != 0) {
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "--set") == 0 && i + 1 < argc) {
+      if (APEX_config_parse(cpu, argv[++i]) != 0) {
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "--state-out") == 0 && i + 1 < argc) {
+      state_prefix = argv[++i];
+    } else if (argv[i][0] == '-') {
+      usage(argv[0]);
+    } else {
+      images[num_instances++] = argv[i];
+    }
+  }
+  if (num_instances == 0) {
+    usage(argv[0]);
+  }
+
+  APEX_Instance* instances = calloc(num_instances, sizeof(*instances));
+  if (!instances) {
+    fprintf(stderr, "APEX_Error : Unable to allocate %d instances\n", num_instances);
+    exit(1);
+  }
+  for (int i = 0; i < num_instances; ++i) {
+    APEX_Instance* inst = &instances[i];
+    inst->image = images[i];
+    if (APEX_dmem_init(&inst->data_memory, cpu->data_memory.bits) != 0 ||
+        APEX_dmem_map_image(&inst->data_memory, images[i]) != 0) {
+      exit(1);
+    }
+    memcpy(inst->regs, cpu->regs, sizeof(inst->regs));
+    inst->z_flag = cpu->z_flag[0];
+    inst->pc = cpu->pc;
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  long steps = APEX_lockstep_run(cpu, instances, num_instances, max_ins);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  APEX_lockstep_report(stdout, instances, num_instances, steps, seconds);
+
+  int status = 0;
+  for (int i = 0; i < num_instances; ++i) {
+    APEX_Instance* inst = &instances[i];
+    if (state_prefix) {
+      char filename[strlen(state_prefix) + 16];
+      snprintf(filename, sizeof(filename), "%s.%d", state_prefix, i);
+      if (APEX_state_write(filename, inst->regs, inst->z_flag, inst->pc,
+                           inst->status == LANE_TRAPPED, &inst->data_memory) != 0) {
+        status = 1;
+      }
+    }
+    status |= inst->status == LANE_TRAPPED;
+    APEX_dmem_free(&inst->data_memory);
+  }
+  free(instances);
+  APEX_cpu_stop(cpu);
+  return status;
 }
 
 int
 main(int argc, char const* argv[])
 {
-//    printf("%d\n",argc);
-//    printf("%s\n",argv[2]);
-//    printf("%s\n",argv[3]);
-  if (argc != 4) {
-    fprintf(stderr, "APEX_Help : Usage %s <input_file>\n", argv[0]);
-    exit(1);
-  }
-    char type1[10];
-    strcpy(type1,argv[2]);
-//    printf("%s\n",type1);
-    
-    if (strcmp(type1, "simulate") == 0) {
-        Total_type = 1;
-    }else if (strcmp(type1, "display") == 0){
-        Total_type = 2;
-    }else{
-        Total_type =0;
-    }
-//    printf("%d\n",Total_type);
-    
-    char cyle[5];
-    strcpy(cyle,argv[3]);
-//    printf("%s\n",cyle);
-    
-    Total_cycle=atoi(cyle);
-    
-//    printf("%d\n",Total_cycle);
-    
-
-  APEX_CPU* cpu = APEX_cpu_init(argv[1]);
+  if (argc >= 3 && strcmp(argv[1], "--batch") == 0) {
+    return run_batch(argc, argv);
+  }
+  if (argc >= 3 && strcmp(argv[1], "--sweep") == 0) {
+    return run_sweep(argc, argv);
+  }
+  if (argc >= 2 && strcmp(argv[1], "--assemble") == 0) {
+    return run_assemble(argc, argv);
+  }
+  if (argc >= 2 && strcmp(argv[1], "--lockstep") == 0) {
+    return run_lockstep(argc, argv);
+  }
+
+  if (argc < 4) {
+    usage(argv[0]);
+  }
+
+  long ff_ins = -1;
+  int ff_pc = -1;
+  const char* save_file = NULL;
+  int save_at = 0;
+  const char* restore_file = NULL;
+  const char* trace_file = NULL;
+  const char* stats_file = NULL;
+  const char* data_file = NULL;
+  const char* state_file = NULL;
+  const char* config_file = NULL;
+  const char* settings[argc];
+  int num_settings = 0;
+  for (int i = 4; i < argc; ++i) {
+    if (strcmp(argv[i], "--ff") == 0 && i + 1 < argc) {
+      ff_ins = atol(argv[++i]);
+    } else if (strcmp(argv[i], "--ff-pc") == 0 && i + 1 < argc) {
+      ff_pc = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+      save_file = argv[++i];
+    } else if (strcmp(argv[i], "--save-at") == 0 && i + 1 < argc) {
+      save_at = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--restore") == 0 && i + 1 < argc) {
+      restore_file = argv[++i];
+    } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+      trace_file = argv[++i];
+    } else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+      stats_file = argv[++i];
+    } else if (strcmp(argv[i], "--data-in") == 0 && i + 1 < argc) {
+      data_file = argv[++i];
+    } else if (strcmp(argv[i], "--state-out") == 0 && i + 1 < argc) {
+      state_file = argv[++i];
+    } else if (strcmp(argv[i], "--config") == 0 && i + 1 < argc) {
+      config_file = argv[++i];
+    } else if (strcmp(argv[i], "--set") == 0 && i + 1 < argc) {
+      settings[num_settings++] = argv[++i];
+    } else {
+      usage(argv[0]);
+    }
+  }
+
+  APEX_CPU* cpu;
+  if (restore_file) {
+    cpu = APEX_cpu_restore(restore_file, argv[1]);
+  } else {
+    cpu = APEX_cpu_init(argv[1]);
+  }
   if (!cpu) {
     fprintf(stderr, "APEX_Error : Unable to initialize CPU\n");
     exit(1);
   }
 
+  if (strcmp(argv[2], "simulate") == 0) {
+    cpu->mode = MODE_SIMULATE;
+  } else if (strcmp(argv[2], "display") == 0) {
+    cpu->mode = MODE_DISPLAY;
+  } else {
+    cpu->mode = MODE_NONE;
+  }
+  /* --set overrides the config file */
+  if (config_file && APEX_config_load(cpu, config_file) != 0) {
+    exit(1);
+  }
+  for (int i = 0; i < num_settings; ++i) {
+    if (APEX_config_parse(cpu, settings[i]) != 0) {
+      exit(1);
+    }
+  }
+
+  /* After the settings, mem_bits decides whether the image fits */
+  if (data_file && APEX_dmem_map_image(&cpu->data_memory, data_file) != 0) {
+    exit(1);
+  }
+
+  /* Cycle budget counts from where this run starts, 0 unless restored */
+  cpu->max_cycles = cpu->clock + atoi(argv[3]);
+
+  if (trace_file) {
+    cpu->trace = APEX_trace_open(trace_file, cpu->core);
+    if (!cpu->trace) {
+      exit(1);
+    }
+  }
+
+  if (stats_file) {
+    cpu->stats = fopen(stats_file, "w");
+    if (!cpu->stats) {
+      fprintf(stderr, "APEX_Error : Unable to create %s\n", stats_file);
+      exit(1);
+    }
+  }
+
+  if (ff_ins >= 0 || ff_pc >= 0) {
+    long done = APEX_cpu_fastforward(cpu, ff_ins, ff_pc);
+    if (cpu->mode != MODE_NONE) {
+      fprintf(cpu->out, "(apex) >> Fast-forwarded %ld instructions, resuming at pc(%d)\n", done, cpu->pc);
+    }
+  }
+
+  if (save_file) {
+    while (cpu->clock < save_at && !APEX_cpu_step(cpu)) {
+    }
+    if (APEX_cpu_save(cpu, save_file) != 0) {
+      exit(1);
+    }
+  }
+
   APEX_cpu_run(cpu);
+  if (cpu->trace && APEX_trace_close(cpu->trace) != 0) {
+    fprintf(stderr, "APEX_Error : Unable to write trace %s\n", trace_file);
+  }
+  if (cpu->stats) {
+    fclose(cpu->stats);
+  }
+  if (state_file && APEX_cpu_write_state(cpu, state_file) != 0) {
+    exit(1);
+  }
+  int status = cpu->trapped ? 1 : 0;
   APEX_cpu_stop(cpu);
-  return 0;
+  return status;
 }
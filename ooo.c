@@ -0,0 +1,722 @@
+/*
+ *  ooo.c
+ *  Contains the W-wide out-of-order core, selected with core=ooo:
+ *  registers are renamed onto a physical register file, renamed
+ *  instructions wait in an issue queue until their operands are ready and
+ *  a reorder buffer commits them to the architectural state in program
+ *  order. core=superscalar is the same machine issuing in program order.
+ */
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "trace.h"
+
+static inline int
+rob_index(const APEX_OoO* o, int age)
+{
+  return (o->rob_head + age) % o->rob_entries;
+}
+
+static inline int
+rob_age(const APEX_OoO* o, int index)
+{
+  return (index - o->rob_head + o->rob_entries) % o->rob_entries;
+}
+
+static void
+free_push(APEX_OoO* o, int p)
+{
+  o->free_list[(o->free_head + o->free_count) % o->prf_entries] = p;
+  o->free_count++;
+}
+
+static int
+free_pop(APEX_OoO* o)
+{
+  int p = o->free_list[o->free_head];
+  o->free_head = (o->free_head + 1) % o->prf_entries;
+  o->free_count--;
+  return p;
+}
+
+/*
+ * Prints or traces what stage s worked on this cycle, ins is NULL when
+ * it had nothing
+ */
+static void
+show(APEX_CPU* cpu, int s, char* name, CPU_Stage* ins)
+{
+  if (cpu->trace) {
+    APEX_trace_append(cpu->trace, cpu->clock + 1, s, ins);
+  } else if (cpu->mode == MODE_DISPLAY) {
+    if (ins) {
+      print_stage_content(cpu->out, name, ins);
+    } else {
+      fprintf(cpu->out, "%-15s: Empty\n", name);
+    }
+  }
+}
+
+/*
+ * Returns the STALL_* cause of a back end stage with nothing to do: the
+ * front end's reason when the ROB is empty, otherwise what the oldest
+ * instruction waits for
+ */
+static int
+wait_cause(const APEX_OoO* o)
+{
+  if (o->rob_count == 0) {
+    return o->bubble;
+  }
+
+  const APEX_RobEntry* head = &o->rob[o->rob_head];
+  if (head->ins.opcode == OP_LOAD) {
+    return STALL_LOAD_USE;
+  }
+  for (int age = 1; age < o->rob_count; ++age) {
+    const APEX_RobEntry* e = &o->rob[rob_index(o, age)];
+    if (e->ins.opcode == OP_LOAD && e->pd >= 0 &&
+        (e->pd == head->ps1 || e->pd == head->ps2)) {
+      return STALL_LOAD_USE;
+    }
+  }
+  return STALL_FU;
+}
+
+static inline void
+count(APEX_CPU* cpu, int s, int cause)
+{
+  cpu->counters.stage_cycles[s][cause]++;
+}
+
+/*
+ * Returns the value a LOAD from address reads, or clears *ready if it has
+ * to wait: the youngest older STORE to the same address forwards its
+ * data, memory holds everything older which has committed. A LOAD never
+ * issues ahead of a STORE whose address is not known yet.
+ */
+static int
+load_value(APEX_CPU* cpu, int age, int address, int* ready)
+{
+  const APEX_OoO* o = &cpu->ooo;
+  int value = APEX_dmem_read(&cpu->data_memory, address);
+
+  *ready = 1;
+  for (int i = 0; i < age; ++i) {
+    const APEX_RobEntry* e = &o->rob[rob_index(o, i)];
+    if (e->ins.opcode != OP_STORE) {
+      continue;
+    }
+    if (!e->issued) {
+      *ready = 0;
+      return 0;
+    }
+    if (e->ins.mem_address == address) {
+      value = e->ins.rs1_value;
+    }
+  }
+  return value;
+}
+
+/*
+ * Computes the result of the entry at age, all its operands are ready.
+ * Returns 0 if it cannot issue yet.
+ */
+static int
+execute_entry(APEX_CPU* cpu, int age)
+{
+  APEX_OoO* o = &cpu->ooo;
+  APEX_RobEntry* e = &o->rob[rob_index(o, age)];
+  CPU_Stage* ins = &e->ins;
+  int a = e->ps1 >= 0 ? o->prf[e->ps1] : 0;
+  int b = e->ps2 >= 0 ? o->prf[e->ps2] : 0;
+
+  switch (ins->opcode) {
+    case OP_MOVC:
+      ins->buffer = ins->imm;
+      break;
+
+    case OP_STORE:
+      ins->mem_address = b + ins->imm;
+      e->trap = !APEX_dmem_in_range(&cpu->data_memory, ins->mem_address);
+      break;
+
+    case OP_LOAD: {
+      /* A LOAD outside data memory may be on the wrong path, it only
+       * traps if it reaches commit */
+      if (!APEX_dmem_in_range(&cpu->data_memory, a + ins->imm)) {
+        ins->mem_address = a + ins->imm;
+        ins->buffer = 0;
+        e->trap = 1;
+        break;
+      }
+      int ready;
+      int value = load_value(cpu, age, a + ins->imm, &ready);
+      if (!ready) {
+        return 0;
+      }
+      ins->mem_address = a + ins->imm;
+      ins->buffer = value;
+      break;
+    }
+
+    case OP_ADD:
+      ins->buffer = a + b;
+      break;
+
+    case OP_SUB:
+      ins->buffer = a - b;
+      break;
+
+    case OP_AND:
+      ins->buffer = a & b;
+      break;
+
+    case OP_OR:
+      ins->buffer = a | b;
+      break;
+
+    case OP_EXOR:
+      ins->buffer = a ^ b;
+      break;
+
+    case OP_MUL:
+      ins->buffer = a * b;
+      break;
+
+    case OP_DIV:
+      ins->buffer = APEX_divide(a, b);
+      break;
+
+    case OP_BZ:
+    case OP_BNZ: {
+      int z = o->prf[e->psz];
+      int taken = ins->opcode == OP_BZ ? z : !z;
+      ins->buffer = ins->pc + ins->imm;
+      e->next_pc = taken ? ins->buffer : ins->pc + 4;
+      break;
+    }
+
+    case OP_JUMP:
+      ins->buffer = a + ins->imm;
+      e->next_pc = ins->buffer;
+      break;
+  }
+
+  ins->rs1_value = a;
+  ins->rs2_value = b;
+  e->issued = 1;
+
+  /* A LOAD reads the D-cache once its address is known */
+  e->remaining = cpu->fu_latency[ins->opcode];
+  if (ins->opcode == OP_LOAD && !e->trap) {
+    e->remaining += APEX_cache_access(&cpu->dcache, ins->mem_address * 4, 0);
+  }
+  return 1;
+}
+
+/*
+ * Squashes everything younger than the entry at age and restarts fetch
+ * from next_pc. Renames are undone youngest first, which leaves the
+ * rename table as it was right after the entry was renamed.
+ */
+static void
+recover(APEX_CPU* cpu, int age, int next_pc)
+{
+  APEX_OoO* o = &cpu->ooo;
+
+  while (o->rob_count > age + 1) {
+    APEX_RobEntry* e = &o->rob[rob_index(o, o->rob_count - 1)];
+    APEX_sb_retire(&cpu->scoreboard, &e->ins);
+    if (e->pz >= 0) {
+      o->map[OOO_Z] = e->old_pz;
+      free_push(o, e->pz);
+    }
+    if (e->pd >= 0) {
+      o->map[e->ins.rd] = e->old_pd;
+      free_push(o, e->pd);
+    }
+    o->rob_count--;
+  }
+
+  /* The issue queue is in age order, the squashed entries are its tail */
+  while (o->iq_count > 0 && rob_age(o, o->iq[o->iq_count - 1]) > age) {
+    o->iq_count--;
+  }
+
+  o->drf_count = 0;
+  o->fetch_stopped = 0;
+  o->fetch_paid = 0;
+  cpu->icache_stall = 0;
+  o->bubble = STALL_BRANCH;
+  cpu->pc = next_pc;
+}
+
+/*
+ * Retires up to width of the oldest instructions which are done, this is
+ * the only place the architectural registers, z flag, data memory and
+ * branch predictor change. Nothing retires past a HALT.
+ */
+static void
+commit(APEX_CPU* cpu)
+{
+  APEX_OoO* o = &cpu->ooo;
+  int committed = 0;
+
+  while (committed < o->width && o->rob_count > 0 && !cpu->halt_index &&
+         o->rob[o->rob_head].done) {
+    APEX_RobEntry* e = &o->rob[o->rob_head];
+    if (e->trap) {
+      APEX_cpu_trap(cpu, &e->ins, e->ins.mem_address);
+      break;
+    }
+    if (e->pd >= 0) {
+      cpu->regs[e->ins.rd] = o->prf[e->pd];
+      free_push(o, e->old_pd);
+    }
+    if (e->pz >= 0) {
+      cpu->z_flag[0] = o->prf[e->pz];
+      free_push(o, e->old_pz);
+    }
+    if (e->ins.opcode == OP_STORE) {
+      /* Committed stores drain through a write buffer, they update the
+       * D-cache without holding up commit */
+      APEX_cache_access(&cpu->dcache, e->ins.mem_address * 4, 1);
+      if (APEX_dmem_write(&cpu->data_memory, e->ins.mem_address, e->ins.rs1_value) != 0) {
+        APEX_cpu_fault(cpu, &e->ins);
+        break;
+      }
+    }
+    int opcode = e->ins.opcode;
+    if (opcode == OP_BZ || opcode == OP_BNZ || opcode == OP_JUMP) {
+      /* Trained in program order, wrong path branches never get here */
+      APEX_bpred_update(&cpu->bpred, e->ins.pc, opcode == OP_JUMP,
+                        e->next_pc == e->ins.buffer, e->ins.buffer,
+                        e->next_pc != e->ins.pred_pc);
+    }
+    APEX_sb_retire(&cpu->scoreboard, &e->ins);
+    if (e->ins.opcode == OP_HALT) {
+      cpu->halt_index = 1;
+    } else {
+      cpu->ins_completed++;
+    }
+    cpu->counters.commits[e->ins.opcode]++;
+
+    show(cpu, WB, "Commit", &e->ins);
+    o->rob_head = rob_index(o, 1);
+    o->rob_count--;
+    committed++;
+  }
+
+  if (committed) {
+    count(cpu, WB, STALL_NONE);
+  } else {
+    count(cpu, WB, wait_cause(o));
+    show(cpu, WB, "Commit", NULL);
+  }
+}
+
+/*
+ * Writes back every instruction whose latency has elapsed, which wakes up
+ * its dependents for this cycle's select. A mispredicted branch recovers
+ * here, even one on a wrong path which an older branch squashes later.
+ */
+static void
+complete(APEX_CPU* cpu)
+{
+  APEX_OoO* o = &cpu->ooo;
+  int completed = 0;
+
+  for (int age = 0; age < o->rob_count; ++age) {
+    APEX_RobEntry* e = &o->rob[rob_index(o, age)];
+    if (!e->issued || e->done || --e->remaining > 0) {
+      continue;
+    }
+
+    e->done = 1;
+    if (e->pd >= 0) {
+      o->prf[e->pd] = e->ins.buffer;
+      o->prf_ready[e->pd] = 1;
+    }
+    if (e->pz >= 0) {
+      o->prf[e->pz] = e->ins.buffer == 0;
+      o->prf_ready[e->pz] = 1;
+    }
+    completed++;
+    show(cpu, MEM, "Complete", &e->ins);
+
+    int opcode = e->ins.opcode;
+    if ((opcode == OP_BZ || opcode == OP_BNZ || opcode == OP_JUMP) &&
+        e->next_pc != e->ins.pred_pc) {
+      recover(cpu, age, e->next_pc);
+    }
+  }
+
+  if (completed) {
+    count(cpu, MEM, STALL_NONE);
+  } else {
+    count(cpu, MEM, wait_cause(o));
+    show(cpu, MEM, "Complete", NULL);
+  }
+}
+
+/*
+ * Returns the instance of unit free to start an instruction this cycle,
+ * -1 if all of them are busy
+ */
+static int
+free_unit(const APEX_CPU* cpu, int unit)
+{
+  const APEX_OoO* o = &cpu->ooo;
+  int instances = unit == FU_ALU ? o->width : 1;
+
+  for (int k = 0; k < instances; ++k) {
+    if (cpu->clock >= o->next_issue[unit][k]) {
+      return k;
+    }
+  }
+  return -1;
+}
+
+/*
+ * Selects up to width instructions, the oldest ready ones first, each on
+ * a free instance of its unit. The superscalar core stops at the first
+ * instruction which cannot issue.
+ */
+static void
+issue(APEX_CPU* cpu)
+{
+  APEX_OoO* o = &cpu->ooo;
+  int issued = 0;
+
+  for (int i = 0; i < o->iq_count && issued < o->width;) {
+    APEX_RobEntry* e = &o->rob[o->iq[i]];
+    int unit = opcode_info[e->ins.opcode].unit;
+    int instance = free_unit(cpu, unit);
+    int ready = instance >= 0 &&
+                (e->ps1 < 0 || o->prf_ready[e->ps1]) &&
+                (e->ps2 < 0 || o->prf_ready[e->ps2]) &&
+                (e->psz < 0 || o->prf_ready[e->psz]);
+
+    if (!ready || !execute_entry(cpu, rob_age(o, o->iq[i]))) {
+      if (cpu->core == CORE_SUPERSCALAR) {
+        break;
+      }
+      i++;
+      continue;
+    }
+
+    o->next_issue[unit][instance] = cpu->clock + cpu->fu_ii[e->ins.opcode];
+    o->iq_count--;
+    memmove(&o->iq[i], &o->iq[i + 1], sizeof(o->iq[0]) * (o->iq_count - i));
+    issued++;
+    show(cpu, EX, "Issue", &e->ins);
+  }
+
+  if (issued) {
+    count(cpu, EX, STALL_NONE);
+  } else {
+    count(cpu, EX, wait_cause(o));
+    show(cpu, EX, "Issue", NULL);
+  }
+}
+
+/*
+ * Renames ins and allocates its ROB and issue queue entries. Returns 0,
+ * changing nothing, if any of them is full.
+ */
+static int
+rename_one(APEX_OoO* o, const CPU_Stage* ins)
+{
+  int queued = ins->opcode != OP_HALT;
+  int writes_z = APEX_sets_z(ins->opcode);
+  if (o->rob_count == o->rob_entries ||
+      (queued && o->iq_count == o->iq_entries) ||
+      o->free_count < (ins->rd >= 0) + writes_z) {
+    return 0;
+  }
+
+  int index = rob_index(o, o->rob_count);
+  APEX_RobEntry* e = &o->rob[index];
+  memset(e, 0, sizeof(*e));
+  e->ins = *ins;
+
+  /* Sources first, an instruction may overwrite its own source. Older
+   * instructions of the bundle have already updated the map, which takes
+   * care of dependencies inside the bundle. */
+  e->ps1 = ins->rs1 >= 0 ? o->map[ins->rs1] : -1;
+  e->ps2 = ins->rs2 >= 0 ? o->map[ins->rs2] : -1;
+  e->psz = ins->opcode == OP_BZ || ins->opcode == OP_BNZ ? o->map[OOO_Z] : -1;
+
+  e->pd = -1;
+  if (ins->rd >= 0) {
+    e->old_pd = o->map[ins->rd];
+    e->pd = free_pop(o);
+    o->prf_ready[e->pd] = 0;
+    o->map[ins->rd] = e->pd;
+  }
+  e->pz = -1;
+  if (writes_z) {
+    e->old_pz = o->map[OOO_Z];
+    e->pz = free_pop(o);
+    o->prf_ready[e->pz] = 0;
+    o->map[OOO_Z] = e->pz;
+  }
+
+  /* HALT has nothing to execute, it only has to reach the ROB head */
+  if (queued) {
+    o->iq[o->iq_count++] = index;
+  } else {
+    e->done = 1;
+  }
+  o->rob_count++;
+  return 1;
+}
+
+/*
+ * Renames the fetched bundle in program order, NOPs go no further. What
+ * does not fit waits for the next cycle.
+ */
+static void
+rename_stage(APEX_CPU* cpu)
+{
+  APEX_OoO* o = &cpu->ooo;
+  int done = 0;
+  int renamed = 0;
+
+  if (o->drf_count == 0) {
+    count(cpu, DRF, o->bubble);
+    show(cpu, DRF, "Rename", NULL);
+    return;
+  }
+
+  while (done < o->drf_count) {
+    CPU_Stage* ins = &o->drf[done];
+    if (ins->opcode != OP_NOP) {
+      if (!rename_one(o, ins)) {
+        break;
+      }
+      APEX_sb_issue(&cpu->scoreboard, ins);
+      renamed++;
+    }
+    show(cpu, DRF, "Rename", ins);
+    done++;
+  }
+
+  if (renamed) {
+    count(cpu, DRF, STALL_NONE);
+  } else {
+    count(cpu, DRF, done ? STALL_NOP : STALL_FU);
+  }
+
+  o->drf_count -= done;
+  memmove(&o->drf[0], &o->drf[done], sizeof(o->drf[0]) * o->drf_count);
+}
+
+/*
+ * Fetches a bundle of up to width instructions along the predicted path,
+ * a predicted taken branch ends it. Fetch stops after a HALT or at the
+ * end of the code until a mispredict redirects it.
+ *
+ * The I-cache is read once per line the bundle touches. A read slower
+ * than a cycle ends the bundle, fetch picks up from that line once it
+ * has arrived.
+ */
+static void
+fetch_stage(APEX_CPU* cpu)
+{
+  APEX_OoO* o = &cpu->ooo;
+
+  if (cpu->icache_stall > 0) {
+    cpu->icache_stall--;
+  }
+  if (o->drf_count || o->fetch_stopped) {
+    count(cpu, F, o->drf_count ? STALL_FU : STALL_DRAIN);
+    show(cpu, F, "Fetch", NULL);
+    return;
+  }
+  if (cpu->icache_stall > 0) {
+    count(cpu, F, STALL_ICACHE);
+    show(cpu, F, "Fetch", NULL);
+    return;
+  }
+
+  int fetched = 0;
+  int line = -1;
+  while (o->drf_count < o->width) {
+    int index = pc_to_index(cpu, cpu->pc);
+    if (index < 0) {
+      o->fetch_stopped = 1;
+      o->bubble = STALL_DRAIN;
+      break;
+    }
+
+    if (cpu->icache.size != 0 && cpu->pc / cpu->icache.line_size != line) {
+      line = cpu->pc / cpu->icache.line_size;
+      if (!o->fetch_paid) {
+        int latency = APEX_cache_access(&cpu->icache, cpu->pc, 0);
+        if (latency > 1) {
+          cpu->icache_stall = latency - 1;
+          o->fetch_paid = 1;
+          o->bubble = STALL_ICACHE;
+          break;
+        }
+      }
+      o->fetch_paid = 0;
+    }
+
+    const APEX_Instruction* code = &cpu->code_memory[index];
+    CPU_Stage* ins = &o->drf[o->drf_count++];
+    memset(ins, 0, sizeof(*ins));
+    ins->pc = cpu->pc;
+    ins->opcode = code->opcode;
+    ins->rd = code->rd;
+    ins->rs1 = code->rs1;
+    ins->rs2 = code->rs2;
+    ins->imm = code->imm;
+    ins->bubble = code->opcode == OP_NOP ? STALL_NOP : STALL_NONE;
+    cpu->instruct_index++;
+    ins->seq = cpu->instruct_index;
+    ins->pred_pc = APEX_bpred_predict(&cpu->bpred, cpu->pc);
+    cpu->pc = ins->pred_pc;
+    fetched += code->opcode != OP_NOP;
+    show(cpu, F, "Fetch", ins);
+
+    if (ins->opcode == OP_HALT) {
+      o->fetch_stopped = 1;
+      o->bubble = STALL_DRAIN;
+      break;
+    }
+    if (ins->pred_pc != ins->pc + 4) {
+      break;
+    }
+  }
+
+  if (fetched) {
+    count(cpu, F, STALL_NONE);
+  } else if (cpu->icache_stall > 0) {
+    count(cpu, F, STALL_ICACHE);
+    show(cpu, F, "Fetch", NULL);
+  } else {
+    count(cpu, F, o->drf_count ? STALL_NOP : STALL_DRAIN);
+    if (!o->drf_count) {
+      show(cpu, F, "Fetch", NULL);
+    }
+  }
+}
+
+/*
+ * Empties the core and maps every architectural register onto the
+ * physical register of the same number, holding its current value
+ */
+void
+APEX_ooo_reset(APEX_CPU* cpu)
+{
+  APEX_OoO* o = &cpu->ooo;
+
+  for (int r = 0; r < OOO_ARCH_REGS; ++r) {
+    o->map[r] = r;
+    o->prf[r] = r == OOO_Z ? cpu->z_flag[0] : cpu->regs[r];
+    o->prf_ready[r] = 1;
+  }
+  o->free_head = 0;
+  o->free_count = 0;
+  for (int p = OOO_ARCH_REGS; p < o->prf_entries; ++p) {
+    free_push(o, p);
+  }
+
+  o->rob_head = 0;
+  o->rob_count = 0;
+  o->iq_count = 0;
+  memset(o->next_issue, 0, sizeof(o->next_issue));
+  o->drf_count = 0;
+  o->fetch_stopped = 0;
+  o->fetch_paid = 0;
+  o->bubble = STALL_FILL;
+}
+
+/*
+ * Advances the out-of-order core by a single clock cycle. As in the
+ * pipeline, stages run from the back so each one sees what the next
+ * freed up this cycle.
+ */
+void
+APEX_ooo_cycle(APEX_CPU* cpu)
+{
+  commit(cpu);
+  if (cpu->trapped) {
+    return;
+  }
+  complete(cpu);
+  issue(cpu);
+  rename_stage(cpu);
+  fetch_stage(cpu);
+}
+
+/*
+ * Returns 1 once fetch has run off the code and everything fetched has
+ * committed
+ */
+int
+APEX_ooo_idle(const APEX_CPU* cpu)
+{
+  const APEX_OoO* o = &cpu->ooo;
+  return o->fetch_stopped && !o->drf_count && o->rob_count == 0;
+}
+
+/*
+ * Returns how many of the coming cycles are known to do nothing but count
+ * down the in-flight instructions and the I-cache wait, each charged to
+ * the same causes as the first of them. 0 if the next cycle may commit,
+ * complete, issue, rename or fetch something.
+ */
+int
+APEX_ooo_frozen_cycles(const APEX_CPU* cpu)
+{
+  const APEX_OoO* o = &cpu->ooo;
+  int frozen = INT_MAX;
+
+  if (o->iq_count != 0 || (o->rob_count > 0 && o->rob[o->rob_head].done)) {
+    return 0;
+  }
+
+  /* Rename stuck on a full ROB, or fetch waiting on the I-cache */
+  if (o->drf_count > 0) {
+    if (o->drf[0].opcode == OP_NOP || o->rob_count < o->rob_entries) {
+      return 0;
+    }
+  } else if (!o->fetch_stopped) {
+    if (cpu->icache_stall < 2) {
+      return 0;
+    }
+    frozen = cpu->icache_stall - 1;
+  }
+
+  /* Nothing completes until the first in-flight instruction is done */
+  for (int age = 0; age < o->rob_count; ++age) {
+    const APEX_RobEntry* e = &o->rob[rob_index(o, age)];
+    if (e->issued && !e->done && e->remaining - 1 < frozen) {
+      frozen = e->remaining - 1;
+    }
+  }
+  return frozen == INT_MAX ? 0 : frozen;
+}
+
+/*
+ * Moves the countdowns on by cycles frozen cycles, as running them would
+ */
+void
+APEX_ooo_advance(APEX_CPU* cpu, int cycles)
+{
+  APEX_OoO* o = &cpu->ooo;
+
+  for (int age = 0; age < o->rob_count; ++age) {
+    APEX_RobEntry* e = &o->rob[rob_index(o, age)];
+    if (e->issued && !e->done) {
+      e->remaining -= cycles;
+    }
+  }
+  cpu->icache_stall = cpu->icache_stall > cycles ? cpu->icache_stall - cycles : 0;
+}
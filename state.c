@@ -0,0 +1,75 @@
+/*
+ *  state.c
+ *  Contains the final state image written by --state-out: the
+ *  architectural registers and data memory, laid out in state.h
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cpu.h"
+#include "state.h"
+
+/*
+ * Writes an architectural state to filename: regs holds the 32 registers.
+ * Data memory runs up to the end of the last page written, pages in
+ * between which were never written are skipped over and read back as
+ * zeros.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int
+APEX_state_write(const char* filename, const int* regs, int z_flag, int pc, int trapped,
+                 const APEX_DataMemory* m)
+{
+  FILE* fp = fopen(filename, "wb");
+  if (!fp) {
+    fprintf(stderr, "APEX_Error : Unable to create %s\n", filename);
+    return -1;
+  }
+
+  uint32_t last = DMEM_NO_PAGE;
+  for (uint32_t p = APEX_dmem_next_page(m, 0); p != DMEM_NO_PAGE;
+       p = APEX_dmem_next_page(m, p + 1)) {
+    last = p;
+  }
+
+  APEX_StateHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, APEX_STATE_MAGIC, 4);
+  header.version = APEX_STATE_VERSION;
+  header.mem_bits = m->bits;
+  header.trapped = trapped;
+  header.mem_words = last == DMEM_NO_PAGE ? 0 : ((uint64_t)last + 1) * DMEM_PAGE_WORDS;
+  header.mem_offset = APEX_STATE_MEM_OFFSET;
+  header.pc = pc;
+  header.z_flag = z_flag;
+  memcpy(header.regs, regs, sizeof(header.regs));
+
+  int ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+  for (uint32_t p = APEX_dmem_next_page(m, 0); ok && p != DMEM_NO_PAGE;
+       p = APEX_dmem_next_page(m, p + 1)) {
+    off_t offset = APEX_STATE_MEM_OFFSET + (off_t)p * DMEM_PAGE_WORDS * sizeof(int32_t);
+    ok = fseeko(fp, offset, SEEK_SET) == 0 &&
+         fwrite(APEX_dmem_find_page(m, p), sizeof(int32_t), DMEM_PAGE_WORDS, fp) == DMEM_PAGE_WORDS;
+  }
+
+  /* Without memory the header is still padded to mem_offset */
+  if (ok && last == DMEM_NO_PAGE) {
+    fflush(fp);
+    ok = ftruncate(fileno(fp), APEX_STATE_MEM_OFFSET) == 0;
+  }
+  if (fclose(fp) != 0 || !ok) {
+    fprintf(stderr, "APEX_Error : Unable to write %s\n", filename);
+    return -1;
+  }
+  return 0;
+}
+
+/* Writes the architectural state of cpu to filename, see APEX_state_write() */
+int
+APEX_cpu_write_state(const APEX_CPU* cpu, const char* filename)
+{
+  return APEX_state_write(filename, cpu->regs, cpu->z_flag[0], cpu->pc, cpu->trapped,
+                          &cpu->data_memory);
+}
@@ -0,0 +1,34 @@
+#ifndef _APEX_STATE_H_
+#define _APEX_STATE_H_
+/**
+ *  state.h
+ *  Layout of the final state image written by --state-out, for tools
+ *  which read it back. Only depends on <stdint.h>.
+ *
+ *  The image is an APEX_StateHeader padded to mem_offset, followed by
+ *  data memory as raw 32-bit words in host byte order from address 0.
+ *  mem_offset is a multiple of 4096, so the memory can be mapped on its
+ *  own. Words at or past mem_words, and pages never written, are 0; the
+ *  latter are left as holes in the file.
+ */
+#include <stdint.h>
+
+#define APEX_STATE_MAGIC "APXS"
+#define APEX_STATE_VERSION 1
+#define APEX_STATE_REGS 32
+#define APEX_STATE_MEM_OFFSET 4096
+
+typedef struct APEX_StateHeader
+{
+  char magic[4];		// APEX_STATE_MAGIC
+  uint32_t version;		// APEX_STATE_VERSION
+  uint32_t mem_bits;		// Width of a data memory word address
+  uint32_t trapped;		// 1 if the run stopped on a trap at pc
+  uint64_t mem_words;		// Words of data memory in the image
+  uint64_t mem_offset;		// File offset of data memory
+  int32_t pc;			// Faulting LOAD/STORE if trapped, else the fetch pc
+  int32_t z_flag;
+  int32_t regs[APEX_STATE_REGS];	// Architectural register file
+} APEX_StateHeader;
+
+#endif
@@ -0,0 +1,427 @@
+/*
+ *  sweep.c
+ *  Contains the sweep driver: expands a grid of settings into batch jobs,
+ *  one per program at every point, and sums the results of each point
+ *  into a CSV or JSON row
+ */
+#define _GNU_SOURCE
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "sweep.h"
+
+/* Large grids are almost always a typo, and every point is a full run */
+#define SWEEP_MAX_POINTS (1 << 20)
+
+#define SWEEP_DELIMS " \t\r\n"
+
+/* Returns 0 if every point of the grid can be set up, -1 after printing
+ * the first which can not. Settings can depend on each other, a cache
+ * size on its line size for one, so each point is applied in order to
+ * the defaults like its runs will be, on one scratch CPU reset in between */
+static int
+check_points(const APEX_Sweep* sweep, const int* key_lines, const char* filename)
+{
+  APEX_CPU* cpu = APEX_cpu_init(sweep->programs[0]);
+  APEX_CPU* defaults = malloc(sizeof(*defaults));
+  if (!cpu || !defaults) {
+    fprintf(stderr, "APEX_Error : Unable to initialize CPU for %s\n", sweep->programs[0]);
+    if (cpu) {
+      APEX_cpu_stop(cpu);
+    }
+    free(defaults);
+    return -1;
+  }
+  memcpy(defaults, cpu, sizeof(*cpu));
+
+  int ret = 0;
+  for (int p = 0; ret == 0 && p < sweep->num_points; ++p) {
+    char** point = &sweep->points[(size_t)p * sweep->num_keys];
+    for (int k = 0; k < sweep->num_keys; ++k) {
+      if (APEX_config_parse(cpu, point[k]) != 0) {
+        fprintf(stderr, "APEX_Error : %s:%d: bad setting %s at point", filename, key_lines[k], point[k]);
+        for (int i = 0; i < sweep->num_keys; ++i) {
+          fprintf(stderr, " %s", point[i]);
+        }
+        fprintf(stderr, "\n");
+        ret = -1;
+        break;
+      }
+    }
+
+    /* Only the data memory owns anything a setting can replace */
+    APEX_dmem_free(&cpu->data_memory);
+    memcpy(cpu, defaults, sizeof(*cpu));
+    if (APEX_dmem_init(&cpu->data_memory, defaults->data_memory.bits) != 0) {
+      fprintf(stderr, "APEX_Error : Unable to initialize CPU for %s\n", sweep->programs[0]);
+      ret = -1;
+    }
+  }
+
+  APEX_cpu_stop(cpu);
+  free(defaults);
+  return ret;
+}
+
+/* Adds key with the values of the rest of the line, NULL on failure */
+static APEX_SweepKey*
+add_key(APEX_Sweep* sweep, const char* key, const char* filename, int line_num)
+{
+  for (int k = 0; k < sweep->num_keys; ++k) {
+    if (strcmp(sweep->keys[k].key, key) == 0) {
+      fprintf(stderr, "APEX_Error : %s:%d: %s is swept twice\n", filename, line_num, key);
+      return NULL;
+    }
+  }
+
+  APEX_SweepKey* keys = realloc(sweep->keys, sizeof(*keys) * (sweep->num_keys + 1));
+  if (!keys) {
+    fprintf(stderr, "APEX_Error : Unable to allocate sweep key %s\n", key);
+    return NULL;
+  }
+  sweep->keys = keys;
+  APEX_SweepKey* k = &keys[sweep->num_keys++];
+  memset(k, 0, sizeof(*k));
+  k->key = strdup(key);
+  if (!k->key) {
+    fprintf(stderr, "APEX_Error : Unable to allocate sweep key %s\n", key);
+    return NULL;
+  }
+
+  char* value;
+  while ((value = strtok(NULL, SWEEP_DELIMS)) != NULL) {
+    char** settings = realloc(k->settings, sizeof(*settings) * (k->num_values + 1));
+    if (!settings) {
+      fprintf(stderr, "APEX_Error : Unable to allocate the values of %s\n", key);
+      return NULL;
+    }
+    k->settings = settings;
+    if (asprintf(&settings[k->num_values], "%s=%s", key, value) < 0) {
+      fprintf(stderr, "APEX_Error : Unable to allocate the values of %s\n", key);
+      return NULL;
+    }
+    k->num_values++;
+  }
+  if (k->num_values == 0) {
+    fprintf(stderr, "APEX_Error : %s:%d: %s has no values\n", filename, line_num, key);
+    return NULL;
+  }
+  return k;
+}
+
+/*
+ * Reads a sweep file. Each line is a key, '=' and a list of values
+ * separated by spaces:
+ *
+ *   program = <input_file>...	programs run at every point, may repeat
+ *   cycles = <n>			cycle budget of every run
+ *   <key> = <value>...		any --set key, and the values it takes
+ *
+ * The grid is every combination of the values of the swept keys. Blank
+ * lines and lines starting with '#' are skipped.
+ */
+APEX_Sweep*
+APEX_sweep_load(const char* filename)
+{
+  FILE* fp = fopen(filename, "r");
+  if (!fp) {
+    fprintf(stderr, "APEX_Error : Unable to open sweep file %s\n", filename);
+    return NULL;
+  }
+
+  APEX_Sweep* sweep = calloc(1, sizeof(*sweep));
+  if (!sweep) {
+    fprintf(stderr, "APEX_Error : Unable to allocate sweep %s\n", filename);
+    fclose(fp);
+    return NULL;
+  }
+  int* key_lines = NULL;
+  char* line = NULL;
+  size_t len = 0;
+  int line_num = 0;
+  int ok = 1;
+
+  while (ok && getline(&line, &len, fp) != -1) {
+    line_num++;
+    char* eq = strchr(line, '=');
+    if (eq) {
+      *eq = ' ';
+    }
+    char* key = strtok(line, SWEEP_DELIMS);
+    if (!key || key[0] == '#') {
+      continue;
+    }
+    if (!eq) {
+      fprintf(stderr, "APEX_Error : %s:%d: expected <key> = <value>...\n", filename, line_num);
+      ok = 0;
+    } else if (strcmp(key, "program") == 0) {
+      char* program;
+      while (ok && (program = strtok(NULL, SWEEP_DELIMS)) != NULL) {
+        char** programs = realloc(sweep->programs, sizeof(*programs) * (sweep->num_programs + 1));
+        if (programs) {
+          sweep->programs = programs;
+          programs[sweep->num_programs] = strdup(program);
+        }
+        if (!programs || !programs[sweep->num_programs]) {
+          fprintf(stderr, "APEX_Error : Unable to allocate program %s\n", program);
+          ok = 0;
+        } else {
+          sweep->num_programs++;
+        }
+      }
+    } else if (strcmp(key, "cycles") == 0) {
+      char* cycles = strtok(NULL, SWEEP_DELIMS);
+      if (!cycles || strtok(NULL, SWEEP_DELIMS)) {
+        fprintf(stderr, "APEX_Error : %s:%d: cycles takes a single value\n", filename, line_num);
+        ok = 0;
+      } else {
+        char* end;
+        long max_cycles = strtol(cycles, &end, 10);
+        sweep->max_cycles = *end == '\0' && max_cycles > 0 && max_cycles <= INT_MAX ? max_cycles : -1;
+      }
+    } else if (add_key(sweep, key, filename, line_num)) {
+      int* lines = realloc(key_lines, sizeof(*lines) * sweep->num_keys);
+      if (!lines) {
+        fprintf(stderr, "APEX_Error : Unable to allocate sweep key %s\n", key);
+        ok = 0;
+      } else {
+        key_lines = lines;
+        key_lines[sweep->num_keys - 1] = line_num;
+      }
+    } else {
+      ok = 0;
+    }
+  }
+  free(line);
+  fclose(fp);
+
+  if (ok && sweep->num_programs == 0) {
+    fprintf(stderr, "APEX_Error : %s: no program to run\n", filename);
+    ok = 0;
+  }
+  if (ok && sweep->max_cycles <= 0) {
+    fprintf(stderr, "APEX_Error : %s: cycles must be set and positive\n", filename);
+    ok = 0;
+  }
+
+  sweep->num_points = 1;
+  for (int k = 0; ok && k < sweep->num_keys; ++k) {
+    if (sweep->num_points > SWEEP_MAX_POINTS / sweep->keys[k].num_values) {
+      fprintf(stderr, "APEX_Error : %s: the grid has more than %d points\n", filename, SWEEP_MAX_POINTS);
+      ok = 0;
+    } else {
+      sweep->num_points *= sweep->keys[k].num_values;
+    }
+  }
+  if (!ok) {
+    free(key_lines);
+    APEX_sweep_free(sweep);
+    return NULL;
+  }
+
+  sweep->points = malloc(sizeof(*sweep->points) * ((size_t)sweep->num_points * sweep->num_keys + 1));
+  if (!sweep->points) {
+    fprintf(stderr, "APEX_Error : Unable to allocate %d points\n", sweep->num_points);
+    free(key_lines);
+    APEX_sweep_free(sweep);
+    return NULL;
+  }
+  for (int p = 0; p < sweep->num_points; ++p) {
+    int rest = p;
+    for (int k = sweep->num_keys - 1; k >= 0; --k) {
+      const APEX_SweepKey* key = &sweep->keys[k];
+      sweep->points[(size_t)p * sweep->num_keys + k] = key->settings[rest % key->num_values];
+      rest /= key->num_values;
+    }
+  }
+
+  /* A bad point is reported here once rather than by every run of it */
+  ok = check_points(sweep, key_lines, filename) == 0;
+  free(key_lines);
+  if (!ok) {
+    APEX_sweep_free(sweep);
+    return NULL;
+  }
+  return sweep;
+}
+
+/*
+ * Returns the batch jobs of a sweep, every program at point 0, then at
+ * point 1 and so on. The jobs point at the settings of the sweep, which
+ * must outlive them.
+ */
+APEX_Job*
+APEX_sweep_jobs(const APEX_Sweep* sweep, int* num_jobs)
+{
+  int count = sweep->num_points * sweep->num_programs;
+  APEX_Job* jobs = calloc(count, sizeof(*jobs));
+  if (!jobs) {
+    fprintf(stderr, "APEX_Error : Unable to allocate %d jobs\n", count);
+    return NULL;
+  }
+
+  for (int p = 0; p < sweep->num_points; ++p) {
+    for (int i = 0; i < sweep->num_programs; ++i) {
+      APEX_Job* job = &jobs[p * sweep->num_programs + i];
+      job->program = strdup(sweep->programs[i]);
+      if (!job->program) {
+        fprintf(stderr, "APEX_Error : Unable to allocate %d jobs\n", count);
+        APEX_batch_free(jobs, count);
+        return NULL;
+      }
+      job->max_cycles = sweep->max_cycles;
+      job->mode = MODE_NONE;
+      job->settings = &sweep->points[(size_t)p * sweep->num_keys];
+      job->num_settings = sweep->num_keys;
+    }
+  }
+  *num_jobs = count;
+  return jobs;
+}
+
+/* Results of every program at a point, summed */
+typedef struct Sweep_Row
+{
+  int failed;
+  long long cycles;
+  long long retired;
+  long long stall_cycles[NUM_STALLS];
+} Sweep_Row;
+
+static void
+sum_point(const APEX_Sweep* sweep, const APEX_Job* jobs, int p, Sweep_Row* row)
+{
+  memset(row, 0, sizeof(*row));
+  for (int i = 0; i < sweep->num_programs; ++i) {
+    const APEX_Job* job = &jobs[p * sweep->num_programs + i];
+    row->failed += job->status != 0;
+    row->cycles += job->cycles;
+    row->retired += job->ins_completed;
+    for (int s = 0; s < NUM_STALLS; ++s) {
+      row->stall_cycles[s] += job->stall_cycles[s];
+    }
+  }
+}
+
+/* Value of setting number k of point p */
+static const char*
+point_value(const APEX_Sweep* sweep, int p, int k)
+{
+  return strchr(sweep->points[(size_t)p * sweep->num_keys + k], '=') + 1;
+}
+
+/* Writes s as a CSV field, quoted if it holds a comma, as ex,mem does */
+static void
+write_csv_field(FILE* fp, const char* s)
+{
+  if (!strpbrk(s, ",\"")) {
+    fputs(s, fp);
+    return;
+  }
+  fputc('"', fp);
+  for (; *s; ++s) {
+    if (*s == '"') {
+      fputc('"', fp);
+    }
+    fputc(*s, fp);
+  }
+  fputc('"', fp);
+}
+
+static void
+write_json_string(FILE* fp, const char* s)
+{
+  fputc('"', fp);
+  for (; *s; ++s) {
+    if (*s == '"' || *s == '\\') {
+      fputc('\\', fp);
+    }
+    fputc(*s, fp);
+  }
+  fputc('"', fp);
+}
+
+/*
+ * Writes a header and a row per point: the point, the value of every swept
+ * key, then over all programs the failed runs, cycles, retired
+ * instructions, IPC and the writeback cycles lost to each stall cause
+ */
+void
+APEX_sweep_write_csv(FILE* fp, const APEX_Sweep* sweep, const APEX_Job* jobs)
+{
+  fprintf(fp, "point");
+  for (int k = 0; k < sweep->num_keys; ++k) {
+    fputc(',', fp);
+    write_csv_field(fp, sweep->keys[k].key);
+  }
+  fprintf(fp, ",programs,failed,cycles,retired,ipc");
+  for (int s = 0; s < NUM_STALLS; ++s) {
+    fprintf(fp, ",cycles_%s", stall_names[s]);
+  }
+  fprintf(fp, "\n");
+
+  for (int p = 0; p < sweep->num_points; ++p) {
+    Sweep_Row row;
+    sum_point(sweep, jobs, p, &row);
+    fprintf(fp, "%d", p);
+    for (int k = 0; k < sweep->num_keys; ++k) {
+      fputc(',', fp);
+      write_csv_field(fp, point_value(sweep, p, k));
+    }
+    fprintf(fp, ",%d,%d,%lld,%lld,%.6f", sweep->num_programs, row.failed, row.cycles,
+            row.retired, row.cycles ? (double)row.retired / row.cycles : 0.0);
+    for (int s = 0; s < NUM_STALLS; ++s) {
+      fprintf(fp, ",%lld", row.stall_cycles[s]);
+    }
+    fprintf(fp, "\n");
+  }
+}
+
+/* Writes the rows of APEX_sweep_write_csv() as a JSON array of objects */
+void
+APEX_sweep_write_json(FILE* fp, const APEX_Sweep* sweep, const APEX_Job* jobs)
+{
+  fprintf(fp, "[");
+  for (int p = 0; p < sweep->num_points; ++p) {
+    Sweep_Row row;
+    sum_point(sweep, jobs, p, &row);
+    fprintf(fp, "%s\n  {\"point\": %d, \"settings\": {", p ? "," : "", p);
+    for (int k = 0; k < sweep->num_keys; ++k) {
+      fprintf(fp, "%s", k ? ", " : "");
+      write_json_string(fp, sweep->keys[k].key);
+      fprintf(fp, ": ");
+      write_json_string(fp, point_value(sweep, p, k));
+    }
+    fprintf(fp, "}, \"programs\": %d, \"failed\": %d, \"cycles\": %lld, \"retired\": %lld, \"ipc\": %.6f",
+            sweep->num_programs, row.failed, row.cycles, row.retired,
+            row.cycles ? (double)row.retired / row.cycles : 0.0);
+    fprintf(fp, ", \"stall_cycles\": {");
+    for (int s = 0; s < NUM_STALLS; ++s) {
+      fprintf(fp, "%s\"%s\": %lld", s ? ", " : "", stall_names[s], row.stall_cycles[s]);
+    }
+    fprintf(fp, "}}");
+  }
+  fprintf(fp, "\n]\n");
+}
+
+void
+APEX_sweep_free(APEX_Sweep* sweep)
+{
+  for (int i = 0; i < sweep->num_programs; ++i) {
+    free(sweep->programs[i]);
+  }
+  free(sweep->programs);
+  for (int k = 0; k < sweep->num_keys; ++k) {
+    for (int v = 0; v < sweep->keys[k].num_values; ++v) {
+      free(sweep->keys[k].settings[v]);
+    }
+    free(sweep->keys[k].settings);
+    free(sweep->keys[k].key);
+  }
+  free(sweep->keys);
+  free(sweep->points);
+  free(sweep);
+}
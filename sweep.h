@@ -0,0 +1,46 @@
+#ifndef _APEX_SWEEP_H_
+#define _APEX_SWEEP_H_
+/**
+ *  sweep.h
+ *  Design space exploration: runs a set of programs at every point of a
+ *  grid of settings and reports one row per point
+ */
+#include <stdio.h>
+
+#include "batch.h"
+
+/* A setting and the values it is swept over */
+typedef struct APEX_SweepKey
+{
+  char* key;
+  char** settings;	// "key=value" for each value
+  int num_values;
+} APEX_SweepKey;
+
+typedef struct APEX_Sweep
+{
+  char** programs;	// Run at every point
+  int num_programs;
+  int max_cycles;	// Cycle budget of each run
+  APEX_SweepKey* keys;
+  int num_keys;
+  int num_points;	// Product of the num_values of all keys
+  char** points;	// num_keys settings per point, the last key varies fastest
+} APEX_Sweep;
+
+APEX_Sweep*
+APEX_sweep_load(const char* filename);
+
+APEX_Job*
+APEX_sweep_jobs(const APEX_Sweep* sweep, int* num_jobs);
+
+void
+APEX_sweep_write_csv(FILE* fp, const APEX_Sweep* sweep, const APEX_Job* jobs);
+
+void
+APEX_sweep_write_json(FILE* fp, const APEX_Sweep* sweep, const APEX_Job* jobs);
+
+void
+APEX_sweep_free(APEX_Sweep* sweep);
+
+#endif
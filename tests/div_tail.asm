@@ -0,0 +1,3 @@
+MOVC,R1,#12
+MOVC,R2,#4
+DIV,R3,R1,R2
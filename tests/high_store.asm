@@ -0,0 +1,5 @@
+MOVC,R1,#7
+MOVC,R2,#1048000
+STORE,R1,R2,#575
+LOAD,R3,R2,#575
+HALT,
@@ -0,0 +1,10 @@
+MOVC,R1,#3
+MOVC,R2,#1
+MOVC,R3,#0
+ADD,R3,R3,R1
+MUL,R5,R3,R3
+STORE,R5,R0,#8
+LOAD,R6,R0,#8
+SUB,R1,R1,R2
+BNZ,#-20
+HALT,
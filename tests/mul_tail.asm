@@ -0,0 +1,3 @@
+MOVC,R1,#3
+MOVC,R2,#4
+MUL,R3,R1,R2
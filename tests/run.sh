@@ -0,0 +1,145 @@
+#!/bin/sh
+# Regression tests, run from the top directory by make test
+cd "$(dirname "$0")/.." || exit 1
+failed=0
+tmp=${TMPDIR:-/tmp}/apex_test.$$
+
+fail()
+{
+  echo "FAIL: $*"
+  failed=1
+}
+
+# expect_reg <program> <reg> <value> [options], the register must end Valid
+expect_reg()
+{
+  program=$1 reg=$2 value=$3
+  shift 3
+  line=$(./apex_sim "$program" simulate 1000 "$@" | grep "REG\[$reg\]")
+  echo "$line" | grep -q "Value = *$value .*Valid" ||
+    fail "$program $*: expected REG[$reg] = $value, got: $line"
+}
+
+# Programs without a HALT whose last instruction outlasts the pipeline
+for core in inorder superscalar ooo; do
+  expect_reg tests/mul_tail.asm 03 12 --set core=$core
+  expect_reg tests/div_tail.asm 03 3 --set core=$core
+done
+expect_reg tests/mul_tail.asm 03 12 --set latency.MUL=8 --set ii.MUL=8
+expect_reg tests/div_tail.asm 03 3 --set fetch_queue=4
+
+# expect_trace <program> [options], apex_trace must print the cycles of
+# display mode, which are followed by a blank line or the completion message
+expect_trace()
+{
+  program=$1
+  shift
+  trace=${TMPDIR:-/tmp}/apex_test.$$.trace
+  ./apex_sim "$program" display 200 "$@" |
+    sed -n '/^-----/,$p' | sed '/^$/,$d; /Simulation Complete/,$d' > "$trace.display"
+  ./apex_sim "$program" display 200 "$@" --trace "$trace" > /dev/null &&
+    ./apex_trace "$trace" > "$trace.dump" &&
+    cmp -s "$trace.display" "$trace.dump" ||
+    fail "$program $*: apex_trace differs from display"
+  rm -f "$trace" "$trace.display" "$trace.dump"
+}
+
+for core in inorder superscalar ooo; do
+  expect_trace tests/loop.asm --set core=$core
+  expect_trace tests/mul_tail.asm --set core=$core
+done
+
+# Forwarding lists with an empty stage name
+for value in "ex," ",mem" "ex,,mem" ""; do
+  ./apex_sim tests/loop.asm simulate 10 --set "forward=$value" 2>&1 |
+    grep -q "APEX_Error : forward must be" || fail "forward=$value was accepted"
+done
+
+# A run resumed from a checkpoint ends in the state of an uninterrupted one
+for core in inorder superscalar ooo; do
+  ./apex_sim tests/stores.asm simulate 1000 --set core=$core --state-out "$tmp.full" > /dev/null
+  for cycle in 5 15 25; do
+    ./apex_sim tests/stores.asm simulate 1000 --set core=$core --save-at $cycle --save "$tmp.ckpt" > /dev/null &&
+      ./apex_sim tests/stores.asm simulate 1000 --restore "$tmp.ckpt" --state-out "$tmp.resumed" > /dev/null &&
+      cmp -s "$tmp.full" "$tmp.resumed" ||
+      fail "core=$core: resuming from a checkpoint at cycle $cycle changed the final state"
+  done
+done
+
+# An assembled program image runs exactly like its source
+for program in tests/*.asm; do
+  ./apex_sim --assemble "$program" "$tmp.image" || fail "$program: --assemble failed"
+  for core in inorder ooo; do
+    ./apex_sim "$program" display 200 --set core=$core > "$tmp.source" 2>&1
+    ./apex_sim "$tmp.image" display 200 --set core=$core > "$tmp.assembled" 2>&1
+    cmp -s "$tmp.source" "$tmp.assembled" ||
+      fail "$program core=$core: the assembled image runs differently"
+  done
+done
+
+# The last word of a 20-bit data memory, which traps one bit narrower
+for core in inorder superscalar ooo; do
+  expect_reg tests/high_store.asm 03 7 --set mem_bits=20 --set core=$core
+  if ./apex_sim tests/high_store.asm simulate 1000 --set mem_bits=19 --set core=$core > /dev/null 2> "$tmp.err"; then
+    fail "core=$core: a STORE outside the 19-bit data memory did not trap"
+  fi
+  grep -q "APEX_Error : STORE at pc(4008) accessed address 1048575, outside the 19-bit data memory" "$tmp.err" ||
+    fail "core=$core: unexpected trap report: $(cat "$tmp.err")"
+done
+
+# A mapped data image is read by the program and left unchanged on disk,
+# tests/sum.asm stores 1 + ... + word 0 into word 1
+printf '\005\000\000\000' > "$tmp.data"
+cp "$tmp.data" "$tmp.data.orig"
+for core in inorder superscalar ooo; do
+  expect_reg tests/sum.asm 02 15 --set core=$core --data-in "$tmp.data"
+  ./apex_sim tests/sum.asm simulate 1000 --set core=$core --data-in "$tmp.data" --state-out "$tmp.state" > /dev/null
+  [ "$(od -An -td4 -j 4100 -N 4 "$tmp.state" | tr -d ' ')" = 15 ] ||
+    fail "core=$core: --state-out does not hold the sum in data word 1"
+done
+cmp -s "$tmp.data" "$tmp.data.orig" || fail "--data-in wrote to the image file"
+head -c 20000 /dev/zero > "$tmp.data"
+./apex_sim tests/sum.asm simulate 1000 --data-in "$tmp.data" 2>&1 > /dev/null |
+  grep -q "APEX_Error : .* holds 5000 words, more than the 12-bit data memory" ||
+  fail "an image larger than data memory was accepted"
+
+# Every lockstep lane ends where --ff over its own image does. Ten images
+# fill more than one group, and word 0 = 0 never halts so its lane hits
+# the instruction limit
+images=
+i=0
+for word in 000 001 002 003 004 005 006 007 010 011; do
+  printf "\\$word\\000\\000\\000" > "$tmp.lane$i"
+  images="$images $tmp.lane$i"
+  i=$((i + 1))
+done
+./apex_sim --lockstep tests/sum.asm 200 --state-out "$tmp.lockstep" $images > "$tmp.report" ||
+  fail "--lockstep failed"
+i=0
+for image in $images; do
+  ff=$(./apex_sim tests/sum.asm simulate 0 --data-in "$image" --ff 200 --state-out "$tmp.ff" |
+       sed -n 's/.*Fast-forwarded \([0-9]*\) instructions.*/\1/p')
+  retired=$(awk -F'|' -v i=$i '/^\| *[0-9]/ && $2 + 0 == i { print $5 + 0 }' "$tmp.report")
+  [ "$ff" = "$retired" ] && cmp -s "$tmp.lockstep.$i" "$tmp.ff" ||
+    fail "lockstep lane $i retired $retired, --ff $ff, or ended in a different state"
+  i=$((i + 1))
+done
+
+# A 2 point sweep prints a row per core with the cycles of a plain run
+printf 'program = tests/loop.asm\ncycles = 1000\ncore = inorder ooo\n' > "$tmp.sweep"
+./apex_sim --sweep "$tmp.sweep" -j 2 > "$tmp.csv" || fail "--sweep failed"
+head -n 1 "$tmp.csv" | grep -q "^point,core,programs,failed,cycles,retired,ipc," ||
+  fail "unexpected sweep header: $(head -n 1 "$tmp.csv")"
+[ "$(wc -l < "$tmp.csv")" -eq 3 ] || fail "a 2 point sweep printed $(wc -l < "$tmp.csv") lines"
+point=0
+for core in inorder ooo; do
+  ./apex_sim tests/loop.asm simulate 1000 --set core=$core --stats "$tmp.json" > /dev/null
+  cycles=$(sed -n 's/^  "cycles": \([0-9]*\),$/\1/p' "$tmp.json")
+  grep -q "^$point,$core,1,0,$cycles,21," "$tmp.csv" ||
+    fail "sweep row $point does not match a run of core=$core taking $cycles cycles"
+  point=$((point + 1))
+done
+
+rm -f "$tmp".*
+[ $failed = 0 ] && echo "All tests passed"
+exit $failed
@@ -0,0 +1,11 @@
+MOVC,R1,#4
+MOVC,R2,#1
+MOVC,R3,#0
+ADD,R3,R3,R1
+STORE,R3,R1,#10
+SUB,R1,R1,R2
+BNZ,#-12
+LOAD,R4,R0,#14
+LOAD,R5,R0,#11
+ADD,R6,R4,R5
+HALT,
@@ -0,0 +1,8 @@
+LOAD,R1,R0,#0
+MOVC,R2,#0
+MOVC,R3,#1
+ADD,R2,R2,R1
+SUB,R1,R1,R3
+BNZ,#-8
+STORE,R2,R0,#1
+HALT,
@@ -0,0 +1,127 @@
+/*
+ *  trace.c
+ *  Contains the buffered binary pipeline trace writer
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+/* Records per buffer, two buffers are in use at any time */
+#define TRACE_BUFFER_RECORDS (64 * 1024)
+
+static void*
+writer_main(void* arg)
+{
+  APEX_Trace* trace = arg;
+
+  pthread_mutex_lock(&trace->lock);
+  while (1) {
+    while (!trace->pending && !trace->closing) {
+      pthread_cond_wait(&trace->cond, &trace->lock);
+    }
+    if (!trace->pending) {
+      break;
+    }
+
+    APEX_TraceRecord* records = trace->pending;
+    size_t count = trace->pending_count;
+    pthread_mutex_unlock(&trace->lock);
+
+    size_t written = fwrite(records, sizeof(*records), count, trace->fp);
+
+    pthread_mutex_lock(&trace->lock);
+    trace->error |= written != count;
+    trace->pending = NULL;
+    pthread_cond_broadcast(&trace->cond);
+  }
+  pthread_mutex_unlock(&trace->lock);
+  return NULL;
+}
+
+/*
+ * Creates the trace file and starts its writer thread
+ *
+ * Returns NULL on failure
+ */
+APEX_Trace*
+APEX_trace_open(const char* filename, int core)
+{
+  FILE* fp = fopen(filename, "wb");
+  if (!fp) {
+    fprintf(stderr, "APEX_Error : Unable to create trace %s\n", filename);
+    return NULL;
+  }
+
+  APEX_TraceHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, APEX_TRACE_MAGIC, 4);
+  header.version = APEX_TRACE_VERSION;
+  header.record_size = sizeof(APEX_TraceRecord);
+  header.core = core;
+  if (fwrite(&header, sizeof(header), 1, fp) != 1) {
+    fclose(fp);
+    return NULL;
+  }
+
+  APEX_Trace* trace = calloc(1, sizeof(*trace));
+  trace->capacity = TRACE_BUFFER_RECORDS;
+  trace->records = calloc(trace->capacity, sizeof(APEX_TraceRecord));
+  trace->spare = calloc(trace->capacity, sizeof(APEX_TraceRecord));
+  trace->fp = fp;
+  pthread_mutex_init(&trace->lock, NULL);
+  pthread_cond_init(&trace->cond, NULL);
+  pthread_create(&trace->writer, NULL, writer_main, trace);
+  return trace;
+}
+
+/*
+ * Hands the buffer being filled to the writer thread and carries on in
+ * the other one, waiting only if the writer has not finished with it yet
+ */
+void
+APEX_trace_flush(APEX_Trace* trace)
+{
+  if (!trace->used) {
+    return;
+  }
+
+  pthread_mutex_lock(&trace->lock);
+  while (trace->pending) {
+    pthread_cond_wait(&trace->cond, &trace->lock);
+  }
+  trace->pending = trace->records;
+  trace->pending_count = trace->used;
+  trace->records = trace->spare;
+  trace->spare = trace->pending;
+  trace->used = 0;
+  pthread_cond_broadcast(&trace->cond);
+  pthread_mutex_unlock(&trace->lock);
+}
+
+/*
+ * Writes out whatever is buffered and closes the trace
+ *
+ * Returns 0 on success, -1 if any write failed
+ */
+int
+APEX_trace_close(APEX_Trace* trace)
+{
+  APEX_trace_flush(trace);
+
+  pthread_mutex_lock(&trace->lock);
+  trace->closing = 1;
+  pthread_cond_broadcast(&trace->cond);
+  pthread_mutex_unlock(&trace->lock);
+  pthread_join(trace->writer, NULL);
+
+  int error = trace->error || fclose(trace->fp) != 0;
+  pthread_mutex_destroy(&trace->lock);
+  pthread_cond_destroy(&trace->cond);
+  free(trace->records);
+  free(trace->spare);
+  free(trace);
+  return error ? -1 : 0;
+}
@@ -0,0 +1,107 @@
+#ifndef _APEX_TRACE_H_
+#define _APEX_TRACE_H_
+/**
+ *  trace.h
+ *  Binary pipeline trace. The simulator appends fixed size records to an
+ *  in-memory buffer, full buffers are written out by a background thread
+ *  and apex_trace renders them in the display format afterwards.
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "cpu.h"
+
+#define APEX_TRACE_MAGIC "APXT"
+#define APEX_TRACE_VERSION 1
+
+/* Stage id of the record which opens a new clock cycle */
+#define TRACE_CYCLE NUM_STAGES
+
+/* One stage of one cycle, 32 bytes */
+typedef struct APEX_TraceRecord
+{
+  uint32_t cycle;	// Clock cycle, starting at 1 as displayed
+  uint8_t stage;	// F..WB or TRACE_CYCLE
+  uint8_t opcode;	// Operation Code
+  int8_t rd;		// Destination Register Address
+  int8_t rs1;		// Source-1 Register Address
+  int8_t rs2;		// Source-2 Register Address
+  uint8_t empty;	// Nonzero for a stage slot holding no instruction
+  uint8_t pad[2];
+  int32_t pc;		// Program Counter
+  int32_t imm;		// Literal Value
+  int32_t buffer;	// Result latch
+  int32_t mem_address;	// Computed Memory Address
+  int32_t rs1_value;	// Source-1 Register Value
+} APEX_TraceRecord;
+
+/* Header at the start of a trace file */
+typedef struct APEX_TraceHeader
+{
+  char magic[4];	// APEX_TRACE_MAGIC
+  uint32_t version;	// APEX_TRACE_VERSION
+  uint32_t record_size;	// sizeof(APEX_TraceRecord)
+  uint32_t core;		// CORE_* of the run, older traces hold 0 (in-order)
+} APEX_TraceHeader;
+
+typedef struct APEX_Trace
+{
+  APEX_TraceRecord* records;	// Buffer being filled by the simulator
+  size_t used;
+  size_t capacity;
+
+  /* Hand-off to the writer thread */
+  APEX_TraceRecord* spare;	// Buffer not being filled
+  APEX_TraceRecord* pending;	// Buffer waiting to be written, or NULL
+  size_t pending_count;
+  int closing;
+  int error;
+  FILE* fp;
+  pthread_t writer;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} APEX_Trace;
+
+APEX_Trace*
+APEX_trace_open(const char* filename, int core);
+
+int
+APEX_trace_close(APEX_Trace* trace);
+
+void
+APEX_trace_flush(APEX_Trace* trace);
+
+/*
+ * Appends one record, only blocks when both buffers are full. A NULL
+ * latch records an empty slot, or the start of a cycle for TRACE_CYCLE
+ */
+static inline void
+APEX_trace_append(APEX_Trace* trace, uint32_t cycle, int stage, const CPU_Stage* latch)
+{
+  if (trace->used == trace->capacity) {
+    APEX_trace_flush(trace);
+  }
+
+  APEX_TraceRecord* r = &trace->records[trace->used++];
+  if (!latch) {
+    memset(r, 0, sizeof(*r));
+  }
+  r->cycle = cycle;
+  r->stage = stage;
+  r->empty = !latch && stage != TRACE_CYCLE;
+  if (latch) {
+    r->opcode = latch->opcode;
+    r->rd = latch->rd;
+    r->rs1 = latch->rs1;
+    r->rs2 = latch->rs2;
+    r->pc = latch->pc;
+    r->imm = latch->imm;
+    r->buffer = latch->buffer;
+    r->mem_address = latch->mem_address;
+    r->rs1_value = latch->rs1_value;
+  }
+}
+
+#endif
@@ -0,0 +1,107 @@
+/*
+ *  trace_dump.c
+ *  apex_trace, renders a binary pipeline trace written with --trace in
+ *  the same format as the display mode of apex_sim
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "trace.h"
+
+static char* stage_names[NUM_STAGES] = {
+  [F] = "Fetch",
+  [DRF] = "Decode/RF",
+  [EX] = "Execute",
+  [MEM] = "Memory",
+  [WB] = "Writeback",
+};
+
+/* Names shown by the superscalar and out-of-order cores */
+static char* ooo_stage_names[NUM_STAGES] = {
+  [F] = "Fetch",
+  [DRF] = "Rename",
+  [EX] = "Issue",
+  [MEM] = "Complete",
+  [WB] = "Commit",
+};
+
+static void
+print_record(FILE* out, const APEX_TraceRecord* r, int core)
+{
+  if (r->stage == TRACE_CYCLE) {
+    fprintf(out, "--------------------------------\n");
+    fprintf(out, "Clock Cycle #: %u\n", r->cycle);
+    fprintf(out, "--------------------------------\n");
+    return;
+  }
+
+  if (r->empty) {
+    fprintf(out, "%-15s: Empty\n", ooo_stage_names[r->stage]);
+    return;
+  }
+
+  CPU_Stage stage;
+  memset(&stage, 0, sizeof(stage));
+  stage.pc = r->pc;
+  stage.opcode = r->opcode;
+  stage.rd = r->rd;
+  stage.rs1 = r->rs1;
+  stage.rs2 = r->rs2;
+  stage.imm = r->imm;
+  stage.buffer = r->buffer;
+  stage.mem_address = r->mem_address;
+  stage.rs1_value = r->rs1_value;
+
+  if (core != CORE_INORDER) {
+    print_stage_content(out, ooo_stage_names[r->stage], &stage);
+  } else if (r->stage == WB) {
+    print_stage_content_WB(out, stage_names[WB], &stage);
+  } else {
+    print_stage_content(out, stage_names[r->stage], &stage);
+  }
+}
+
+int
+main(int argc, char const* argv[])
+{
+  if (argc != 2) {
+    fprintf(stderr, "APEX_Help : Usage %s <trace_file>\n", argv[0]);
+    exit(1);
+  }
+
+  FILE* fp = fopen(argv[1], "rb");
+  if (!fp) {
+    fprintf(stderr, "APEX_Error : Unable to open trace %s\n", argv[1]);
+    exit(1);
+  }
+
+  APEX_TraceHeader header;
+  if (fread(&header, sizeof(header), 1, fp) != 1 ||
+      memcmp(header.magic, APEX_TRACE_MAGIC, 4) != 0 ||
+      header.version != APEX_TRACE_VERSION ||
+      header.record_size != sizeof(APEX_TraceRecord) ||
+      header.core > CORE_OOO) {
+    fprintf(stderr, "APEX_Error : %s is not an APEX trace\n", argv[1]);
+    exit(1);
+  }
+
+  static char outbuf[1 << 16];
+  setvbuf(stdout, outbuf, _IOFBF, sizeof(outbuf));
+
+  APEX_TraceRecord records[4096];
+  size_t n;
+  while ((n = fread(records, sizeof(records[0]), 4096, fp)) > 0) {
+    for (size_t i = 0; i < n; ++i) {
+      if (records[i].stage > TRACE_CYCLE || records[i].opcode >= NUM_OPCODES) {
+        fprintf(stderr, "APEX_Error : %s is corrupt\n", argv[1]);
+        exit(1);
+      }
+      print_record(stdout, &records[i], header.core);
+    }
+  }
+
+  fclose(fp);
+  return 0;
+}